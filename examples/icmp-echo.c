@@ -188,57 +188,48 @@ bool ping( const char* host, uint32_t timeout, uint32_t ttl, uint32_t count )
 
 	char src_ip_str[ 16 ]  = { '\0' };
 	char dst_ip_str[ 16 ]  = { '\0' };
-	bool first_packet = false;
-	ping_stats_t stats = {
-		.min = 0,
-		.max = 0,
-		.sum = 0,
-		.avg = 0,
-		.count = count,
-		.lost = 0
-	};
+	ping_stats_t stats;
+	memset( &stats, 0, sizeof(stats) );
+	stats.count = count;
+
+	prober_t* prober = nu_prober_create( 1, timeout, NULL, NULL );
+
+	if( !prober )
+	{
+		fprintf( stderr, "Failed to create prober.\n" );
+		goto failed;
+	}
 
 	for( uint32_t i = 1; i <= count; i++ )
 	{
-		double latency = 0.0;
-        const char echo_payload[] = "Yo ho, yo ho, a pirates life for me";
-		packet_t* p    = nu_icmp_create_echo( src_ip, dst_ip, ttl, timeout, echo_payload, sizeof(echo_payload), &latency );
-		const struct ip* ip_header = nu_packet_ip_header( p );
+		probe_result_t result = { .timed_out = true };
 
-		if( p )
+		if( nu_prober_submit( prober, dst_ip, ttl, NULL ) )
 		{
-			struct icmp* icmp_header = nu_icmp_header( p );
+			while( !nu_prober_next( prober, &result ) && nu_prober_poll( prober, timeout ) >= 0 )
+			{
+			}
+		}
 
-			if( icmp_header->icmp_type == ICMP_ECHOREPLY )
+		if( !result.timed_out )
+		{
+			double latency = result.latency;
+
+			if( result.icmp_type == ICMP_ECHOREPLY )
 			{
-				if( !first_packet )
-				{
-					stats.min   = latency;
-					stats.max   = latency;
-					stats.avg   = latency;
-					stats.sum   = latency;
-					first_packet = true;
-				}
-				else
-				{
-					stats.min  = fmin( stats.min, latency );
-					stats.max  = fmax( stats.max, latency );
-					stats.sum += latency;
-				}
+				nu_ping_stats_record( &stats, latency );
 
-				fprintf( stdout, "Packet %s%06u%s -- Sent %s%02u%s bytes in %s%.2lf%s ms\n", COLOR_CYAN, i, COLOR_END, COLOR_CYAN, ntohs(ip_header->ip_len), COLOR_END, color_latency(latency), latency, COLOR_END );
+				fprintf( stdout, "Packet %s%06u%s -- Reply seq %s%05u%s in %s%.2lf%s ms\n", COLOR_CYAN, i, COLOR_END, COLOR_CYAN, result.seq, COLOR_END, color_latency(latency), latency, COLOR_END );
 			}
-			else if( icmp_header->icmp_type == ICMP_UNREACH /* ICMP_DEST_UNREACH */ )
+			else if( result.icmp_type == ICMP_UNREACH /* ICMP_DEST_UNREACH */ )
 			{
 				fprintf( stdout, "Packet %s%06u%s -- %sDestination unreacheable%s\n", COLOR_CYAN, i, COLOR_END, COLOR_RED, COLOR_END );
 
 			}
-			else if( icmp_header->icmp_type == ICMP_TIMXCEED /* ICMP_TIME_EXCEEDED */ )
+			else if( result.icmp_type == ICMP_TIMXCEED /* ICMP_TIME_EXCEEDED */ )
 			{
 				fprintf( stdout, "Packet %s%06u%s -- Time exceeded\n", COLOR_CYAN, i, COLOR_END );
 			}
-
-			nu_packet_destroy( &p );
 		}
 		else
 		{
@@ -247,6 +238,8 @@ bool ping( const char* host, uint32_t timeout, uint32_t ttl, uint32_t count )
 		}
 	} /* for */
 
+	nu_prober_destroy( &prober );
+
 	fprintf( stdout, "\n" );
 
 	nu_address_to_string_r( src_ip, src_ip_str, sizeof(src_ip_str) );
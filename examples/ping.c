@@ -21,17 +21,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <errno.h>
 #include "../src/netutils.h"
 
-bool ping( const char* host );
+typedef struct target {
+	struct in_addr ip;
+	ping_stats_t stats;
+} target_t;
+
+bool ping( const char* hosts[], size_t host_count );
 
 int main( int argc, char* argv[] )
 {
 	if( argc >= 2 )
 	{
-		const char* host  = argv[ 1 ];
-		ping( host );
+		ping( (const char**) &argv[ 1 ], argc - 1 );
 	}
 	else
 	{
@@ -41,57 +46,100 @@ int main( int argc, char* argv[] )
 	return 0;
 }
 
-
-bool ping( const char* host )
+static void ping_result( const probe_result_t* result, void* context )
 {
-	struct in_addr src_ip = { .s_addr = INADDR_ANY };
-	struct in_addr dst_ip;
+	target_t* target = (target_t*) result->user_data;
+	(void) context;
 
-	if( !nu_address_from_ip_string( "127.0.0.1", &src_ip ) )
+	if( result->timed_out || result->icmp_type != ICMP_ECHOREPLY )
 	{
-		fprintf( stderr, "Failed to initialize loopback address.\n" );
-		goto failed;
+		target->stats.lost += 1;
 	}
+	else
+	{
+		nu_ping_stats_record( &target->stats, result->latency );
+	}
+}
 
-	if( !nu_resolve_hostname( host, &dst_ip ) )
+bool ping( const char* hosts[], size_t host_count )
+{
+	const uint32_t timeout = 200;
+	const uint32_t count   = 20;
+	target_t* targets      = (target_t*) calloc( host_count, sizeof(target_t) );
+	prober_t* prober       = NULL;
+
+	if( !targets )
 	{
-		fprintf( stderr, "Failed to resolve %s.\n", host );
 		goto failed;
 	}
-	else
+
+	for( size_t i = 0; i < host_count; i++ )
 	{
-		fprintf( stdout, "Pinging %s\n", nu_address_to_string(dst_ip) );
-	}
+		if( !nu_resolve_hostname( hosts[ i ], &targets[ i ].ip ) )
+		{
+			fprintf( stderr, "Failed to resolve %s.\n", hosts[ i ] );
+			goto failed;
+		}
 
+		targets[ i ].stats.count = count;
+		fprintf( stdout, "Pinging %s\n", nu_address_to_string(targets[ i ].ip) );
+	}
 
-	ping_stats_t stats;
-	const uint32_t timeout = 200;
-	const uint32_t count   = 20;
+	/* Every host is probed at once; each round waits for the slowest. */
+	prober = nu_prober_create( host_count, timeout, ping_result, NULL );
 
-	if( !nu_ping( src_ip, dst_ip, timeout, count, &stats ) )
+	if( !prober )
 	{
 		fprintf( stdout, "Ping failed!\n" );
+		goto failed;
 	}
-	else
+
+	for( uint32_t round = 0; round < count; round++ )
 	{
-		char src_ip_str[ 16 ] = { '\0' };
-		char dst_ip_str[ 16 ] = { '\0' };
+		for( size_t i = 0; i < host_count; i++ )
+		{
+			if( !nu_prober_submit( prober, targets[ i ].ip, MAXTTL, &targets[ i ] ) )
+			{
+				targets[ i ].stats.lost += 1;
+			}
+		}
+
+		while( nu_prober_in_flight( prober ) > 0 )
+		{
+			if( nu_prober_poll( prober, timeout ) < 0 )
+			{
+				fprintf( stdout, "Ping failed!\n" );
+				goto failed;
+			}
+		}
+	}
 
-		nu_address_to_string_r( src_ip, src_ip_str, sizeof(src_ip_str) );
-		nu_address_to_string_r( dst_ip, dst_ip_str, sizeof(dst_ip_str) );
+	for( size_t i = 0; i < host_count; i++ )
+	{
+		ping_stats_t* stats = &targets[ i ].stats;
+
+		char dst_ip_str[ 16 ] = { '\0' };
+		nu_address_to_string_r( targets[ i ].ip, dst_ip_str, sizeof(dst_ip_str) );
 
 		fprintf( stdout, "-----------------------------------------------------------------------------------------\n" );
-		fprintf( stdout, "|  Source: %-15s  |  Destination: %-15s                             |\n", src_ip_str, dst_ip_str );
+		fprintf( stdout, "|  Destination: %-15s                                                         |\n", dst_ip_str );
 		fprintf( stdout, "-----------------------------------------------------------------------------------------\n" );
-		fprintf( stdout, "| Timeout: %05u ms            | Min: %08.1lf ms | Max: %08.1lf ms | Avg: %08.1lf ms |\n", timeout, stats.min, stats.max, stats.avg );
+		fprintf( stdout, "| Timeout: %05u ms            | Min: %08.1lf ms | Max: %08.1lf ms | Avg: %08.1lf ms |\n", timeout, stats->min, stats->max, stats->avg );
+		fprintf( stdout, "| Std Dev: %08.3lf ms         | Jitter: %08.3lf ms                                    |\n", stats->stddev, stats->jitter );
+		fprintf( stdout, "| P50: %08.3lf ms | P90: %08.3lf ms | P99: %08.3lf ms | P99.9: %08.3lf ms           |\n",
+		         nu_ping_stats_percentile( stats, 50.0 ), nu_ping_stats_percentile( stats, 90.0 ),
+		         nu_ping_stats_percentile( stats, 99.0 ), nu_ping_stats_percentile( stats, 99.9 ) );
 		fprintf( stdout, "-----------------------------------------------------------------------------------------\n" );
-		fprintf( stdout, "| Packets Sent: %-14u | Packets Lost: %-14u | Percent Lost: %-6.2lf%%   |\n", stats.count, stats.lost, (stats.lost * 100.0) / stats.count );
+		fprintf( stdout, "| Packets Sent: %-14u | Packets Lost: %-14u | Percent Lost: %-6.2lf%%   |\n", stats->count, stats->lost, (stats->lost * 100.0) / stats->count );
 		fprintf( stdout, "-----------------------------------------------------------------------------------------\n" );
 	}
 
+	nu_prober_destroy( &prober );
+	free( targets );
 	return true;
 
 failed:
+	nu_prober_destroy( &prober );
+	free( targets );
 	return false;
 }
-
@@ -173,6 +173,7 @@ bool traceroute( const char* host, uint32_t timeout, uint32_t max_hops, uint32_t
 {
 	struct in_addr src_ip = { .s_addr = INADDR_ANY };
 	struct in_addr dst_ip;
+	traceroute_hop_t* hops = NULL;
 
 	if( !nu_address_from_ip_string( "127.0.0.1", &src_ip ) )
 	{
@@ -186,67 +187,50 @@ bool traceroute( const char* host, uint32_t timeout, uint32_t max_hops, uint32_t
 		goto failed;
 	}
 
-	bool is_done = false;
-
-	fprintf( stdout, "%-4s %-20s %-10s\n", "Hop", "Host", "Latency");
-
-	for( uint8_t ttl = 1; !is_done && ttl <= max_hops; ttl += 1 )
+	if( max_hops > MAXTTL )
 	{
-		bool first_packet = false;
+		max_hops = MAXTTL;
+	}
 
-		for( uint32_t i = 1; i <= count; i += 1 )
-		{
-			double latency = 0.0;
-			const char echo_payload[] = "Yo ho, yo ho, a pirates life for me";
-			packet_t* p = nu_icmp_create_echo( src_ip, dst_ip, ttl, timeout, echo_payload, sizeof(echo_payload), &latency );
+	/* Each hop carries a latency histogram, too big for the stack. */
+	hops = (traceroute_hop_t*) calloc( max_hops, sizeof(traceroute_hop_t) );
+	uint8_t hop_count = 0;
 
-			if( p )
-			{
-				struct icmp* icmp_header = nu_icmp_header( p );
-				const struct ip* ip = nu_packet_ip_header( p );
+	if( !hops )
+	{
+		fprintf( stderr, "Out of memory.\n" );
+		goto failed;
+	}
 
-				char dst_ip_str[ 16 ] = { '\0' };
-				nu_address_to_string_r( ip->ip_src, dst_ip_str, sizeof(dst_ip_str) );
+	if( !nu_traceroute( dst_ip, max_hops, count, timeout, hops, &hop_count ) )
+	{
+		fprintf( stderr, "Failed to trace route to %s.\n", host );
+		goto failed;
+	}
 
-				if (i == 1)
-				{
-					fprintf( stdout, "%-4d %-20s %s%.3lfms%s\n", ttl, dst_ip_str, color_latency(latency), latency, COLOR_END);
-				}
-				else
-				{
-					fprintf( stdout, "%-4s %-20s %s%.3lfms%s\n", "", dst_ip_str, color_latency(latency), latency, COLOR_END);
-				}
+	fprintf( stdout, "%-4s %-20s %-10s %-10s\n", "Hop", "Host", "Latency", "Lost");
 
-				if( icmp_header->icmp_type == ICMP_ECHOREPLY )
-				{
-					is_done = true;
-				}
-				else if( icmp_header->icmp_type == ICMP_UNREACH /* ICMP_DEST_UNREACH */ )
-				{
-				}
-				else if( icmp_header->icmp_type == ICMP_TIMXCEED /* ICMP_TIME_EXCEEDED */ )
-				{
+	for( uint8_t ttl = 1; ttl <= hop_count; ttl += 1 )
+	{
+		const traceroute_hop_t* hop = &hops[ ttl - 1 ];
 
-				}
+		if( hop->addr.s_addr != INADDR_ANY )
+		{
+			char hop_ip_str[ 16 ] = { '\0' };
+			nu_address_to_string_r( hop->addr, hop_ip_str, sizeof(hop_ip_str) );
 
-				nu_packet_destroy( &p );
-			}
-			else
-			{
-				if (i == 1)
-				{
-					fprintf( stdout, "%-4d %-20s\n", ttl, "no response" );
-				}
-				else
-				{
-					fprintf( stdout, "%-4s %-20s\n", "", "no response" );
-				}
-			}
-		} /* for */
+			fprintf( stdout, "%-4d %-20s %s%.3lfms%s   %u/%u\n", ttl, hop_ip_str, color_latency(hop->stats.avg), hop->stats.avg, COLOR_END, hop->stats.lost, hop->stats.count );
+		}
+		else
+		{
+			fprintf( stdout, "%-4d %-20s\n", ttl, "no response" );
+		}
 	} /* for */
 
+	free( hops );
 	return true;
 
 failed:
+	free( hops );
 	return false;
 }
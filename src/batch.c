@@ -0,0 +1,311 @@
+/* Copyright (C) 2013 by Joseph A. Marrero, https://joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* sendmmsg, recvmmsg */
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/uio.h>
+#include "libnu-config.h"
+#include "netutils.h"
+#include "netutils-internal.h"
+
+#define NU_SEND_BATCH_SIZE   64 /* messages per sendmmsg() call */
+#define NU_RECV_RING_STRIDE(size)  (((size) + 7) & ~((size_t) 7)) /* keep every buffer 8-byte aligned */
+
+struct recv_ring {
+	size_t count;
+	size_t buffer_size;
+	size_t headroom;
+	#if defined(HAVE_RECVMMSG)
+	struct mmsghdr* messages;
+	#else
+	size_t* lengths;
+	#endif
+	struct iovec* iovecs;
+	struct sockaddr_in* addresses;
+	uint8_t* controls;     /* room for a kernel timestamp per datagram */
+	uint64_t* timestamps;
+	uint8_t* buffers;
+};
+
+static inline const void* packet_send_buffer( const packet_t* packet, size_t* p_size )
+{
+	#ifdef NU_ICMP_INCLUDE_IP4_HEADER
+	*p_size = nu_packet_ip_length( packet );
+	return &packet->ip_header;
+	#else
+	*p_size = nu_packet_ip_length( packet ) - (packet->ip_header.ip_hl << 2);
+	return packet->payload;
+	#endif
+}
+
+size_t nu_send_batch( int socket, packet_t* const packets[], const struct sockaddr_in destinations[], size_t count )
+{
+	size_t sent = 0;
+
+	#if defined(HAVE_SENDMMSG)
+	struct mmsghdr messages[ NU_SEND_BATCH_SIZE ];
+	struct iovec iovecs[ NU_SEND_BATCH_SIZE ];
+	struct sockaddr_in addresses[ NU_SEND_BATCH_SIZE ];
+
+	while( sent < count )
+	{
+		size_t batch_size = count - sent;
+		if( batch_size > NU_SEND_BATCH_SIZE ) batch_size = NU_SEND_BATCH_SIZE;
+
+		for( size_t i = 0; i < batch_size; i++ )
+		{
+			const packet_t* packet = packets[ sent + i ];
+
+			iovecs[ i ].iov_base = (void*) packet_send_buffer( packet, &iovecs[ i ].iov_len );
+
+			if( destinations )
+			{
+				addresses[ i ] = destinations[ sent + i ];
+			}
+			else
+			{
+				nu_set_ipaddress( &addresses[ i ], packet->ip_header.ip_dst, 0 );
+			}
+
+			memset( &messages[ i ], 0, sizeof(messages[ i ]) );
+			messages[ i ].msg_hdr.msg_name    = &addresses[ i ];
+			messages[ i ].msg_hdr.msg_namelen = sizeof(addresses[ i ]);
+			messages[ i ].msg_hdr.msg_iov     = &iovecs[ i ];
+			messages[ i ].msg_hdr.msg_iovlen  = 1;
+		}
+
+		int rv = sendmmsg( socket, messages, batch_size, 0 );
+
+		if( rv < 0 )
+		{
+			if( errno == EINTR ) continue;
+			trace( "Unable to send batch [errno = %d].\n", errno );
+			break;
+		}
+
+		sent += rv;
+
+		if( (size_t) rv < batch_size )
+		{
+			/* The next message failed; let the caller see why. */
+			if( sendmmsg( socket, &messages[ rv ], 1, 0 ) < 0 ) break;
+			sent += 1;
+		}
+	}
+	#else
+	for( ; sent < count; sent++ )
+	{
+		const packet_t* packet = packets[ sent ];
+		struct sockaddr_in address;
+		size_t size;
+		const void* buffer = packet_send_buffer( packet, &size );
+
+		if( destinations )
+		{
+			address = destinations[ sent ];
+		}
+		else
+		{
+			nu_set_ipaddress( &address, packet->ip_header.ip_dst, 0 );
+		}
+
+		if( sendto( socket, buffer, size, 0, (struct sockaddr*) &address, sizeof(address) ) < 0 )
+		{
+			trace( "Unable to send batch [errno = %d].\n", errno );
+			break;
+		}
+	}
+	#endif
+
+	return sent;
+}
+
+recv_ring_t* nu_recv_ring_create( size_t count, size_t buffer_size )
+{
+	recv_ring_t* ring = (recv_ring_t*) malloc( sizeof(recv_ring_t) );
+
+	if( ring )
+	{
+		ring->count       = count;
+		ring->buffer_size = buffer_size;
+		ring->headroom    = 0;
+		#if defined(HAVE_RECVMMSG)
+		ring->messages    = (struct mmsghdr*) calloc( count, sizeof(struct mmsghdr) );
+		#else
+		ring->lengths     = (size_t*) calloc( count, sizeof(size_t) );
+		#endif
+		ring->iovecs      = (struct iovec*) calloc( count, sizeof(struct iovec) );
+		ring->addresses   = (struct sockaddr_in*) calloc( count, sizeof(struct sockaddr_in) );
+		ring->controls    = (uint8_t*) calloc( count, NU_TIMESTAMP_CONTROL_SIZE );
+		ring->timestamps  = (uint64_t*) calloc( count, sizeof(uint64_t) );
+		ring->buffers     = (uint8_t*) malloc( count * NU_RECV_RING_STRIDE(buffer_size) );
+
+		#if defined(HAVE_RECVMMSG)
+		if( !ring->messages || !ring->iovecs || !ring->addresses || !ring->controls || !ring->timestamps || !ring->buffers )
+		#else
+		if( !ring->lengths || !ring->iovecs || !ring->addresses || !ring->controls || !ring->timestamps || !ring->buffers )
+		#endif
+		{
+			nu_recv_ring_destroy( &ring );
+			return NULL;
+		}
+
+		for( size_t i = 0; i < count; i++ )
+		{
+			ring->iovecs[ i ].iov_base = ring->buffers + i * NU_RECV_RING_STRIDE(buffer_size);
+			ring->iovecs[ i ].iov_len  = buffer_size;
+		}
+	}
+
+	return ring;
+}
+
+void nu_recv_ring_destroy( recv_ring_t** p_ring )
+{
+	if( p_ring && *p_ring )
+	{
+		recv_ring_t* ring = *p_ring;
+		#if defined(HAVE_RECVMMSG)
+		free( ring->messages );
+		#else
+		free( ring->lengths );
+		#endif
+		free( ring->iovecs );
+		free( ring->addresses );
+		free( ring->controls );
+		free( ring->timestamps );
+		free( ring->buffers );
+		free( ring );
+		*p_ring = NULL;
+	}
+}
+
+size_t nu_recv_ring_count( const recv_ring_t* ring )
+{
+	return ring->count;
+}
+
+bool nu_recv_ring_set_headroom( recv_ring_t* ring, size_t headroom )
+{
+	if( headroom >= ring->buffer_size )
+	{
+		return false;
+	}
+
+	for( size_t i = 0; i < ring->count; i++ )
+	{
+		ring->iovecs[ i ].iov_base = ring->buffers + i * NU_RECV_RING_STRIDE(ring->buffer_size) + headroom;
+		ring->iovecs[ i ].iov_len  = ring->buffer_size - headroom;
+	}
+
+	ring->headroom = headroom;
+	return true;
+}
+
+static inline void recv_ring_prepare( recv_ring_t* ring, size_t index, struct msghdr* header )
+{
+	memset( header, 0, sizeof(*header) );
+	header->msg_name       = &ring->addresses[ index ];
+	header->msg_namelen    = sizeof(ring->addresses[ index ]);
+	header->msg_iov        = &ring->iovecs[ index ];
+	header->msg_iovlen     = 1;
+	header->msg_control    = ring->controls + index * NU_TIMESTAMP_CONTROL_SIZE;
+	header->msg_controllen = NU_TIMESTAMP_CONTROL_SIZE;
+}
+
+int nu_recv_batch( int socket, recv_ring_t* ring, int flags )
+{
+	#if defined(HAVE_RECVMMSG)
+	for( size_t i = 0; i < ring->count; i++ )
+	{
+		recv_ring_prepare( ring, i, &ring->messages[ i ].msg_hdr );
+	}
+
+	int rv;
+	do {
+		rv = recvmmsg( socket, ring->messages, ring->count, flags, NULL );
+	} while( rv < 0 && errno == EINTR );
+
+	for( int i = 0; i < rv; i++ )
+	{
+		ring->timestamps[ i ] = nu_timestamp_from_cmsg( &ring->messages[ i ].msg_hdr );
+	}
+
+	return rv;
+	#else
+	int received = 0;
+
+	for( size_t i = 0; i < ring->count; i++ )
+	{
+		struct msghdr header;
+		recv_ring_prepare( ring, i, &header );
+
+		ssize_t rv = recvmsg( socket, &header, flags );
+
+		if( rv < 0 )
+		{
+			if( received > 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ) break;
+			return received > 0 ? received : -1;
+		}
+
+		ring->lengths[ i ]    = rv;
+		ring->timestamps[ i ] = nu_timestamp_from_cmsg( &header );
+		received += 1;
+
+		/* Only the first datagram may block. */
+		flags |= MSG_DONTWAIT;
+	}
+
+	return received;
+	#endif
+}
+
+const void* nu_recv_ring_buffer( const recv_ring_t* ring, size_t index, size_t* p_length, struct sockaddr_in* p_from )
+{
+	assert( index < ring->count );
+
+	if( p_length )
+	{
+		#if defined(HAVE_RECVMMSG)
+		*p_length = ring->headroom + ring->messages[ index ].msg_len;
+		#else
+		*p_length = ring->headroom + ring->lengths[ index ];
+		#endif
+	}
+
+	if( p_from )
+	{
+		*p_from = ring->addresses[ index ];
+	}
+
+	return (const uint8_t*) ring->iovecs[ index ].iov_base - ring->headroom;
+}
+
+uint64_t nu_recv_ring_timestamp( const recv_ring_t* ring, size_t index )
+{
+	assert( index < ring->count );
+	return ring->timestamps[ index ];
+}
@@ -0,0 +1,286 @@
+/* Copyright (C) 2013 by Joseph A. Marrero, https://joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "netutils.h"
+#include "netutils-internal.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+# define NU_CHECKSUM_X86 1
+# include <immintrin.h>
+#endif
+
+/*
+ * Internet checksum (RFC 1071).
+ *
+ * The one's complement sum is independent of byte order and of how the
+ * 16-bit words are grouped, so every kernel below adds 32-bit words into
+ * 64-bit accumulators and the result is folded back down to 16 bits at the
+ * end.  Because 2^16 = 1 (mod 0xffff), a 32-bit word contributes exactly
+ * the same as the two 16-bit words it is made of, which is why all of the
+ * kernels produce bit-identical results to the original 16-bit loop.
+ *
+ * Words are always paired relative to the start of the buffer, so any
+ * alignment is fine.  Only the final odd byte (if any) is padded.
+ */
+typedef uint64_t (*checksum_kernel_fxn)( const uint8_t* data, size_t len, uint64_t sum );
+
+static inline uint64_t checksum_add( uint64_t sum, uint64_t value )
+{
+	sum += value;
+	return sum + (sum < value); /* end-around carry */
+}
+
+static uint64_t nu_checksum_portable( const uint8_t* data, size_t len, uint64_t sum )
+{
+	uint64_t acc0 = 0;
+	uint64_t acc1 = 0;
+
+	/* Two independent accumulators of 32-bit words; these can't overflow
+	 * for anything less than 16 GiB of input. */
+	while( len >= 8 )
+	{
+		uint32_t w[ 2 ];
+		memcpy( w, data, sizeof(w) );
+		acc0 += w[ 0 ];
+		acc1 += w[ 1 ];
+		data += 8;
+		len  -= 8;
+	}
+
+	if( len >= 4 )
+	{
+		uint32_t w;
+		memcpy( &w, data, sizeof(w) );
+		acc0 += w;
+		data += 4;
+		len  -= 4;
+	}
+
+	if( len >= 2 )
+	{
+		uint16_t w;
+		memcpy( &w, data, sizeof(w) );
+		acc1 += w;
+		data += 2;
+		len  -= 2;
+	}
+
+	/* mop up an odd byte, if necessary */
+	if( len == 1 )
+	{
+		union {
+			uint16_t us;
+			uint8_t  uc[2];
+		} last;
+
+		last.uc[0] = *data;
+		last.uc[1] = 0;
+		acc0 += last.us;
+	}
+
+	sum = checksum_add( sum, acc0 );
+	sum = checksum_add( sum, acc1 );
+	return sum;
+}
+
+#ifdef NU_CHECKSUM_X86
+__attribute__((target("sse2")))
+static uint64_t nu_checksum_sse2( const uint8_t* data, size_t len, uint64_t sum )
+{
+	const __m128i zero = _mm_setzero_si128( );
+	__m128i acc0 = zero;
+	__m128i acc1 = zero;
+
+	while( len >= 16 )
+	{
+		__m128i v = _mm_loadu_si128( (const __m128i*) data );
+		acc0 = _mm_add_epi64( acc0, _mm_unpacklo_epi32( v, zero ) );
+		acc1 = _mm_add_epi64( acc1, _mm_unpackhi_epi32( v, zero ) );
+		data += 16;
+		len  -= 16;
+	}
+
+	uint64_t lanes[ 4 ];
+	_mm_storeu_si128( (__m128i*) &lanes[ 0 ], acc0 );
+	_mm_storeu_si128( (__m128i*) &lanes[ 2 ], acc1 );
+
+	for( size_t i = 0; i < 4; i++ )
+	{
+		sum = checksum_add( sum, lanes[ i ] );
+	}
+
+	return nu_checksum_portable( data, len, sum );
+}
+
+__attribute__((target("avx2")))
+static uint64_t nu_checksum_avx2( const uint8_t* data, size_t len, uint64_t sum )
+{
+	const __m256i zero = _mm256_setzero_si256( );
+	__m256i acc0 = zero;
+	__m256i acc1 = zero;
+
+	while( len >= 32 )
+	{
+		__m256i v = _mm256_loadu_si256( (const __m256i*) data );
+		acc0 = _mm256_add_epi64( acc0, _mm256_unpacklo_epi32( v, zero ) );
+		acc1 = _mm256_add_epi64( acc1, _mm256_unpackhi_epi32( v, zero ) );
+		data += 32;
+		len  -= 32;
+	}
+
+	uint64_t lanes[ 8 ];
+	_mm256_storeu_si256( (__m256i*) &lanes[ 0 ], acc0 );
+	_mm256_storeu_si256( (__m256i*) &lanes[ 4 ], acc1 );
+
+	for( size_t i = 0; i < 8; i++ )
+	{
+		sum = checksum_add( sum, lanes[ i ] );
+	}
+
+	return nu_checksum_portable( data, len, sum );
+}
+
+__attribute__((target("avx512f")))
+static uint64_t nu_checksum_avx512( const uint8_t* data, size_t len, uint64_t sum )
+{
+	const __m512i zero = _mm512_setzero_si512( );
+	__m512i acc0 = zero;
+	__m512i acc1 = zero;
+
+	while( len >= 64 )
+	{
+		__m512i v = _mm512_loadu_si512( (const void*) data );
+		acc0 = _mm512_add_epi64( acc0, _mm512_unpacklo_epi32( v, zero ) );
+		acc1 = _mm512_add_epi64( acc1, _mm512_unpackhi_epi32( v, zero ) );
+		data += 64;
+		len  -= 64;
+	}
+
+	uint64_t lanes[ 16 ];
+	_mm512_storeu_si512( (void*) &lanes[ 0 ], acc0 );
+	_mm512_storeu_si512( (void*) &lanes[ 8 ], acc1 );
+
+	for( size_t i = 0; i < 16; i++ )
+	{
+		sum = checksum_add( sum, lanes[ i ] );
+	}
+
+	return nu_checksum_portable( data, len, sum );
+}
+#endif
+
+/* Below this size the vector setup costs more than it saves. */
+#define NU_CHECKSUM_VECTOR_MIN  64
+
+static checksum_kernel_fxn nu_checksum_kernel = nu_checksum_portable;
+
+/*
+ * Pick the widest kernel the CPU supports.  This runs once when the library
+ * is loaded so that nu_checksum() is just an indirect call.
+ */
+__attribute__((constructor))
+static void nu_checksum_initialize( void )
+{
+	#ifdef NU_CHECKSUM_X86
+	__builtin_cpu_init( );
+
+	if( __builtin_cpu_supports( "avx512f" ) )
+	{
+		nu_checksum_kernel = nu_checksum_avx512;
+	}
+	else if( __builtin_cpu_supports( "avx2" ) )
+	{
+		nu_checksum_kernel = nu_checksum_avx2;
+	}
+	else if( __builtin_cpu_supports( "sse2" ) )
+	{
+		nu_checksum_kernel = nu_checksum_sse2;
+	}
+	#endif
+}
+
+uint64_t nu_checksum_partial( const void* data, size_t len, uint64_t sum )
+{
+	if( len < NU_CHECKSUM_VECTOR_MIN )
+	{
+		return nu_checksum_portable( (const uint8_t*) data, len, sum );
+	}
+
+	return nu_checksum_kernel( (const uint8_t*) data, len, sum );
+}
+
+uint16_t nu_checksum_fold( uint64_t sum )
+{
+	/* add back carry outs from the top bits to the low 16 bits */
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	return (uint16_t) ~sum;
+}
+
+uint16_t nu_checksum( const void* data, size_t len )
+{
+	return nu_checksum_fold( nu_checksum_partial( data, len, 0 ) );
+}
+
+/*
+ * Incrementally update a checksum after the bytes at old_data were replaced
+ * with the bytes at new_data (RFC 1624, eqn. 3):
+ *
+ *     HC' = ~(~HC + ~m + m')
+ *
+ * The changed bytes must start at an even offset from the start of the
+ * checksummed data.
+ */
+uint16_t nu_checksum_adjust( uint16_t checksum, const void* old_data, const void* new_data, size_t len )
+{
+	uint64_t sum = (uint16_t) ~checksum;
+	sum += nu_checksum( old_data, len ); /* ~m */
+	sum  = nu_checksum_partial( new_data, len, sum );
+	return nu_checksum_fold( sum );
+}
+
+/*
+ * TCP and UDP checksums also cover a pseudo-header made of the addresses,
+ * the protocol and the transport length (RFC 768, RFC 793).
+ */
+uint64_t nu_checksum_pseudo_header( struct in_addr src, struct in_addr dst, uint8_t protocol, uint16_t length )
+{
+	struct {
+		struct in_addr src;
+		struct in_addr dst;
+		uint8_t zero;
+		uint8_t protocol;
+		uint16_t length;
+	} pseudo_header = {
+		.src      = src,
+		.dst      = dst,
+		.zero     = 0,
+		.protocol = protocol,
+		.length   = htons( length )
+	};
+
+	assert( sizeof(pseudo_header) == 12 );
+	return nu_checksum_partial( &pseudo_header, sizeof(pseudo_header), 0 );
+}
@@ -0,0 +1,224 @@
+/* Copyright (C) 2013 by Joseph A. Marrero, https://joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/uio.h>
+#include <poll.h>
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#endif
+#include "netutils.h"
+#include "netutils-internal.h"
+
+/*
+ * The socket error queue.
+ *
+ * On Linux the error queue carries transmit timestamps and, on sockets with
+ * IP_RECVERR, the ICMP errors our datagrams caused.  Ping sockets have no
+ * other way of seeing TIME_EXCEEDED or UNREACH, and they only hand back what
+ * the error quoted of our request; the rest of the message is rebuilt from
+ * the extended error so that callers can parse it like raw socket input:
+ *
+ *     [ IP header, from the offender ][ ICMP error header ]
+ *     [ quoted IP header, to the original destination ][ quoted request... ]
+ */
+#define NU_ERROR_QUOTE_OFFSET  (NU_IP4_HDRLEN + NU_ICMP_HDRLEN + NU_IP4_HDRLEN)
+
+#if defined(__linux__) && defined(IP_RECVERR)
+static void error_ip_header( struct ip* ip, size_t length, struct in_addr src, struct in_addr dst )
+{
+	memset( ip, 0, NU_IP4_HDRLEN );
+	ip->ip_v   = IPVERSION;
+	ip->ip_hl  = NU_IP4_HDRLEN >> 2;
+	ip->ip_len = htons( (uint16_t) length );
+	ip->ip_p   = IPPROTO_ICMP;
+	ip->ip_src = src;
+	ip->ip_dst = dst;
+}
+#endif
+
+ssize_t nu_recv_error( int socket, void* buffer, size_t size, uint32_t* p_tx_id, uint64_t* p_timestamp )
+{
+	#if defined(__linux__) && defined(IP_RECVERR)
+	union {
+		struct cmsghdr align;
+		uint8_t buffer[ NU_TIMESTAMP_CONTROL_SIZE + CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in)) ];
+	} control;
+
+	assert( size >= NU_ERROR_QUOTE_OFFSET + NU_ICMP_HDRLEN );
+
+	for( ;; )
+	{
+		uint8_t* quote = (uint8_t*) buffer + NU_ERROR_QUOTE_OFFSET;
+		struct sockaddr_in original_dst;
+		struct iovec iov = { .iov_base = quote, .iov_len = size - NU_ERROR_QUOTE_OFFSET };
+		struct msghdr message = {
+			.msg_name       = &original_dst,
+			.msg_namelen    = sizeof(original_dst),
+			.msg_iov        = &iov,
+			.msg_iovlen     = 1,
+			.msg_control    = control.buffer,
+			.msg_controllen = sizeof(control.buffer),
+			.msg_flags      = 0
+		};
+
+		ssize_t quote_length = recvmsg( socket, &message, MSG_ERRQUEUE | MSG_DONTWAIT );
+
+		if( quote_length < 0 )
+		{
+			return -1;
+		}
+
+		struct sock_extended_err error;
+		struct sockaddr_in offender;
+		bool has_error = false;
+
+		*p_timestamp = nu_timestamp_from_cmsg( &message );
+
+		for( struct cmsghdr* cmsg = CMSG_FIRSTHDR( &message ); cmsg; cmsg = CMSG_NXTHDR( &message, cmsg ) )
+		{
+			if( cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR )
+			{
+				memcpy( &error, CMSG_DATA(cmsg), sizeof(error) );
+				memcpy( &offender, CMSG_DATA(cmsg) + sizeof(error), sizeof(offender) );
+				has_error = true;
+			}
+		}
+
+		if( !has_error )
+		{
+			continue;
+		}
+
+		if( error.ee_origin == SO_EE_ORIGIN_TIMESTAMPING && *p_timestamp )
+		{
+			*p_tx_id = error.ee_data;
+			return 0;
+		}
+		else if( error.ee_origin == SO_EE_ORIGIN_ICMP )
+		{
+			struct ip* outer      = (struct ip*) buffer;
+			struct icmp* icmp     = (struct icmp*) ((uint8_t*) buffer + NU_IP4_HDRLEN);
+			struct ip* inner      = (struct ip*) ((uint8_t*) buffer + NU_IP4_HDRLEN + NU_ICMP_HDRLEN);
+			size_t length         = NU_ERROR_QUOTE_OFFSET + quote_length;
+			struct in_addr source = { .s_addr = INADDR_ANY };
+
+			error_ip_header( outer, length, offender.sin_family == AF_INET ? offender.sin_addr : original_dst.sin_addr, source );
+			error_ip_header( inner, NU_IP4_HDRLEN + quote_length, source, original_dst.sin_addr );
+
+			memset( icmp, 0, NU_ICMP_HDRLEN );
+			icmp->icmp_type = error.ee_type;
+			icmp->icmp_code = error.ee_code;
+			return length;
+		}
+
+		/* Local errors (EMSGSIZE and the like) don't quote anything we could match. */
+	}
+	#else
+	errno = EAGAIN;
+	return -1;
+	#endif
+}
+
+int nu_zerocopy_reap( int socket, zerocopy_t* zerocopy, int timeout )
+{
+	#if defined(__linux__) && defined(SO_EE_ORIGIN_ZEROCOPY)
+	uint64_t deadline = nu_monotonic_ns( ) + (uint64_t) (timeout > 0 ? timeout : 0) * 1000000ULL;
+
+	for( ;; )
+	{
+		union {
+			struct cmsghdr align;
+			uint8_t buffer[ CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6)) ];
+		} control;
+		struct msghdr message;
+		memset( &message, 0, sizeof(message) );
+		message.msg_control    = control.buffer;
+		message.msg_controllen = sizeof(control.buffer);
+
+		if( recvmsg( socket, &message, MSG_ERRQUEUE | MSG_DONTWAIT ) >= 0 )
+		{
+			for( struct cmsghdr* cmsg = CMSG_FIRSTHDR( &message ); cmsg; cmsg = CMSG_NXTHDR( &message, cmsg ) )
+			{
+				struct sock_extended_err error;
+
+				if( !(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+				    !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR) )
+				{
+					continue;
+				}
+
+				memcpy( &error, CMSG_DATA(cmsg), sizeof(error) );
+
+				if( error.ee_origin != SO_EE_ORIGIN_ZEROCOPY || error.ee_errno != 0 )
+				{
+					continue;
+				}
+
+				/* Sends ee_info through ee_data are done; ranges arrive in order. */
+				if( (int32_t) (error.ee_data + 1 - zerocopy->completed) > 0 )
+				{
+					zerocopy->completed = error.ee_data + 1;
+				}
+
+				if( error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED )
+				{
+					zerocopy->copied = true;
+				}
+			}
+			continue;
+		}
+
+		if( errno == EINTR )
+		{
+			continue;
+		}
+		else if( errno != EAGAIN )
+		{
+			trace( "Unable to read error queue [errno = %d].\n", errno );
+			return -1;
+		}
+
+		int pending = (int) (zerocopy->sent - zerocopy->completed);
+		uint64_t now = nu_monotonic_ns( );
+
+		if( pending == 0 || timeout == 0 || (timeout > 0 && now >= deadline) )
+		{
+			return pending;
+		}
+
+		/* Errors are always reported; no events are needed to wait for them. */
+		struct pollfd fd = { .fd = socket, .events = 0, .revents = 0 };
+		int wait_time    = timeout < 0 ? -1 : (int) ((deadline - now + 999999ULL) / 1000000ULL);
+
+		if( poll( &fd, 1, wait_time ) < 0 && errno != EINTR )
+		{
+			return -1;
+		}
+	}
+	#else
+	zerocopy->completed = zerocopy->sent;
+	return 0;
+	#endif
+}
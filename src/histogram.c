@@ -0,0 +1,203 @@
+/* Copyright (C) 2013 by Joseph A. Marrero, https://joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "netutils.h"
+
+#define NU_HISTOGRAM_SUB_BUCKETS   (1U << NU_HISTOGRAM_SUB_BITS)
+#define NU_HISTOGRAM_HALF_BUCKETS  (1U << (NU_HISTOGRAM_SUB_BITS - 1))
+
+static inline unsigned histogram_msb( uint64_t value )
+{
+	#if defined(__GNUC__)
+	return 63 - __builtin_clzll( value );
+	#else
+	unsigned msb = 0;
+	while( value >>= 1 ) msb += 1;
+	return msb;
+	#endif
+}
+
+/*
+ * Small values get a bucket each.  Above that, each power of two gets
+ * HALF_BUCKETS buckets of equal width, picked by the value's SUB_BITS most
+ * significant bits (the top one always being set).
+ */
+static inline size_t histogram_index( uint64_t value )
+{
+	if( value < NU_HISTOGRAM_SUB_BUCKETS )
+	{
+		return (size_t) value;
+	}
+
+	unsigned shift = histogram_msb( value ) - (NU_HISTOGRAM_SUB_BITS - 1);
+	size_t index   = ((size_t) shift << (NU_HISTOGRAM_SUB_BITS - 1)) + (size_t) (value >> shift);
+
+	return index < NU_HISTOGRAM_BUCKETS ? index : NU_HISTOGRAM_BUCKETS - 1;
+}
+
+/* Midpoint of a bucket, in nanoseconds. */
+static inline double histogram_value( size_t index )
+{
+	if( index < NU_HISTOGRAM_SUB_BUCKETS )
+	{
+		return (double) index;
+	}
+
+	unsigned shift = (unsigned) (index >> (NU_HISTOGRAM_SUB_BITS - 1)) - 1;
+	uint64_t lower = (uint64_t) (index - ((size_t) shift << (NU_HISTOGRAM_SUB_BITS - 1))) << shift;
+
+	return (double) lower + (double) (1ULL << shift) / 2.0;
+}
+
+void nu_histogram_record( latency_histogram_t* histogram, double latency )
+{
+	double ns = latency > 0.0 ? latency * 1000000.0 : 0.0;
+	uint64_t value = ns < (double) UINT64_MAX ? (uint64_t) ns : UINT64_MAX;
+
+	histogram->buckets[ histogram_index( value ) ] += 1;
+	histogram->count += 1;
+
+	double delta = latency - histogram->mean;
+	histogram->mean += delta / histogram->count;
+	histogram->m2   += delta * (latency - histogram->mean);
+}
+
+void nu_histogram_merge( latency_histogram_t* histogram, const latency_histogram_t* other )
+{
+	if( other->count == 0 )
+	{
+		return;
+	}
+
+	for( size_t i = 0; i < NU_HISTOGRAM_BUCKETS; i++ )
+	{
+		histogram->buckets[ i ] += other->buckets[ i ];
+	}
+
+	/* Chan et al.'s pairwise update of the mean and squared deviations. */
+	double count = (double) histogram->count + (double) other->count;
+	double delta = other->mean - histogram->mean;
+
+	histogram->m2    += other->m2 + delta * delta * ((double) histogram->count * (double) other->count / count);
+	histogram->mean  += delta * (double) other->count / count;
+	histogram->count += other->count;
+}
+
+double nu_histogram_percentile( const latency_histogram_t* histogram, double percentile )
+{
+	if( histogram->count == 0 )
+	{
+		return 0.0;
+	}
+
+	if( percentile < 0.0 ) percentile = 0.0;
+	if( percentile > 100.0 ) percentile = 100.0;
+
+	/* The smallest value with at least this many samples at or below it. */
+	uint64_t rank = (uint64_t) ceil( percentile / 100.0 * (double) histogram->count );
+	if( rank == 0 ) rank = 1;
+
+	uint64_t seen = 0;
+
+	for( size_t i = 0; i < NU_HISTOGRAM_BUCKETS; i++ )
+	{
+		seen += histogram->buckets[ i ];
+
+		if( seen >= rank )
+		{
+			return histogram_value( i ) / 1000000.0;
+		}
+	}
+
+	return histogram_value( NU_HISTOGRAM_BUCKETS - 1 ) / 1000000.0;
+}
+
+double nu_histogram_stddev( const latency_histogram_t* histogram )
+{
+	return histogram->count > 1 ? sqrt( histogram->m2 / (double) (histogram->count - 1) ) : 0.0;
+}
+
+void nu_ping_stats_record( ping_stats_t* stats, double latency )
+{
+	if( stats->received == 0 )
+	{
+		stats->min    = latency;
+		stats->max    = latency;
+		stats->jitter = 0.0;
+	}
+	else
+	{
+		stats->min = fmin( stats->min, latency );
+		stats->max = fmax( stats->max, latency );
+
+		/* RFC 3550, section 6.4.1: J += (|D| - J) / 16. */
+		stats->jitter += (fabs( latency - stats->last ) - stats->jitter) / 16.0;
+	}
+
+	stats->last      = latency;
+	stats->sum      += latency;
+	stats->received += 1;
+	stats->avg       = stats->sum / stats->received;
+
+	nu_histogram_record( &stats->histogram, latency );
+	stats->stddev = nu_histogram_stddev( &stats->histogram );
+}
+
+void nu_ping_stats_merge( ping_stats_t* stats, const ping_stats_t* other )
+{
+	if( other->received > 0 )
+	{
+		if( stats->received == 0 )
+		{
+			stats->min    = other->min;
+			stats->max    = other->max;
+			stats->jitter = other->jitter;
+			stats->last   = other->last;
+		}
+		else
+		{
+			double received = (double) stats->received + (double) other->received;
+
+			stats->min    = fmin( stats->min, other->min );
+			stats->max    = fmax( stats->max, other->max );
+			stats->jitter = (stats->jitter * stats->received + other->jitter * other->received) / received;
+		}
+	}
+
+	stats->sum        += other->sum;
+	stats->count      += other->count;
+	stats->received   += other->received;
+	stats->lost       += other->lost;
+	stats->duplicates += other->duplicates;
+	stats->reordered  += other->reordered;
+	stats->late       += other->late;
+	stats->avg         = stats->received > 0 ? stats->sum / stats->received : 0.0;
+
+	nu_histogram_merge( &stats->histogram, &other->histogram );
+	stats->stddev = nu_histogram_stddev( &stats->histogram );
+}
+
+double nu_ping_stats_percentile( const ping_stats_t* stats, double percentile )
+{
+	return nu_histogram_percentile( &stats->histogram, percentile );
+}
@@ -23,13 +23,31 @@
 #include <sys/time.h>
 #include <errno.h>
 #include <assert.h>
+#include <poll.h>
 #include "netutils.h"
 #include "netutils-internal.h"
 
 packet_t* nu_icmp_create( uint8_t icmp_type, struct in_addr ip_src, struct in_addr ip_dst, const void* icmp_payload, size_t icmp_payload_size )
+{
+	size_t packet_size = nu_packet_size( NU_ICMP_HDRLEN + icmp_payload_size );
+	packet_t* packet   = nu_packet_alloc( packet_size );
+
+	if( packet )
+	{
+		nu_icmp_init( packet, packet_size, icmp_type, ip_src, ip_dst, icmp_payload, icmp_payload_size );
+
+		#ifdef DEBUG_NETUTILS
+		trace( "ICMP packet created.\n" );
+		#endif
+	}
+
+	return packet;
+}
+
+packet_t* nu_icmp_init( void* buffer, size_t buffer_size, uint8_t icmp_type, struct in_addr ip_src, struct in_addr ip_dst, const void* icmp_payload, size_t icmp_payload_size )
 {
 	size_t ip_payload_size = NU_ICMP_HDRLEN + icmp_payload_size;
-	packet_t* packet       = nu_packet_create( IPPROTO_ICMP, ip_src, ip_dst, ip_payload_size );
+	packet_t* packet       = nu_packet_init( buffer, buffer_size, IPPROTO_ICMP, ip_src, ip_dst, ip_payload_size );
 
 	if( packet )
 	{
@@ -39,10 +57,10 @@ packet_t* nu_icmp_create( uint8_t icmp_type, struct in_addr ip_src, struct in_ad
 			icmp_header->icmp_type  = icmp_type; /* Message Type (8 bits): echo request */
 			icmp_header->icmp_code  = 0; /* Message Code (8 bits): echo request */
 			#if __APPLE__
-			icmp_header->icmp_id    = 1000; /* Identifier (16 bits): usually pid of sending process - pick a number */
+			icmp_header->icmp_id    = NU_ICMP_ECHO_ID; /* Identifier (16 bits): usually pid of sending process - pick a number */
 			icmp_header->icmp_seq   = 0; /* Sequence Number (16 bits): starts at 0 */
 			#else
-			icmp_header->icmp_id    = htons( 1000 ); /* Identifier (16 bits): usually pid of sending process - pick a number */
+			icmp_header->icmp_id    = htons( NU_ICMP_ECHO_ID ); /* Identifier (16 bits): usually pid of sending process - pick a number */
 			icmp_header->icmp_seq   = htons( 0 ); /* Sequence Number (16 bits): starts at 0 */
 			#endif
 
@@ -54,10 +72,6 @@ packet_t* nu_icmp_create( uint8_t icmp_type, struct in_addr ip_src, struct in_ad
 
 			nu_icmp_recalc_checksum( packet, icmp_payload_size );
 		}
-
-		#ifdef DEBUG_NETUTILS
-		trace( "ICMP packet created.\n" );
-		#endif
 	}
 
 	return packet;
@@ -77,148 +91,417 @@ void nu_icmp_recalc_checksum( packet_t* packet, size_t icmp_payload_size )
 
 struct icmp* nu_icmp_header( const packet_t* packet )
 {
-	return (struct icmp*) &packet->payload;
+	/* Received packets may carry IP options. */
+	return (struct icmp*) ((uint8_t*) &packet->ip_header + (packet->ip_header.ip_hl << 2));
 }
 
 uint8_t* nu_icmp_payload( const packet_t* packet )
 {
-	return (uint8_t*) &packet->payload[ NU_ICMP_HDRLEN ];
+	return (uint8_t*) nu_icmp_header( packet ) + NU_ICMP_HDRLEN;
 }
 
-packet_t* nu_icmp_create_echo( struct in_addr src, struct in_addr dst, uint8_t ttl /* max = MAXTTL */,
-                               uint32_t timeout, const void* echo_payload, size_t echo_payload_size, double* p_latency )
+const struct icmp* nu_packet_view_icmp_header( const packet_view_t* view )
 {
-	packet_t* reply_packet    = NULL;
-	struct protoent* proto    = getprotobyname( "ICMP" );
-	int sock                  = nu_raw_socket( proto->p_proto /* IPPROTO_ICMP */ );
-	size_t ip_payload_size    = NU_ICMP_HDRLEN + echo_payload_size;
-	packet_t* echo_packet     = NULL;
+	if( view->ip_header->ip_p != IPPROTO_ICMP || view->payload_length < NU_ICMP_HDRLEN )
+	{
+		return NULL;
+	}
+
+	return (const struct icmp*) view->payload;
+}
 
-	if( sock < 0 )
+bool nu_icmp_view_quoted( const packet_view_t* view, packet_view_t* quoted )
+{
+	const struct icmp* icmp_header = nu_packet_view_icmp_header( view );
+
+	if( !icmp_header )
 	{
-		trace( "Unable to create socket.\n" );
-		#if defined(DEBUG_NETUTILS)
-		perror( "ERROR" );
-		#endif
-		goto done;
+		return false;
 	}
 
-	echo_packet = nu_icmp_create( ICMP_ECHO, src, dst, echo_payload, echo_payload_size );
+	switch( icmp_header->icmp_type )
+	{
+		case ICMP_UNREACH:
+		case ICMP_SOURCEQUENCH:
+		case ICMP_REDIRECT:
+		case ICMP_TIMXCEED:
+		case ICMP_PARAMPROB:
+			return nu_packet_view_init( quoted, view->payload + NU_ICMP_HDRLEN, view->payload_length - NU_ICMP_HDRLEN );
+		default:
+			return false;
+	}
+}
 
-	#ifdef NU_ICMP_INCLUDE_IP4_HEADER
-	if( !nu_set_include_header( sock, true ) )
+packet_t* nu_icmp_template_create( struct in_addr ip_src, struct in_addr ip_dst, const void* payload, size_t payload_size )
+{
+	size_t icmp_payload_size = sizeof(struct timespec) + payload_size;
+	packet_t* packet         = nu_icmp_create( ICMP_ECHO, ip_src, ip_dst, NULL, icmp_payload_size );
+
+	if( packet )
 	{
-		trace( "Unable to set socket option: IP_HDRINCL.\n" );
-		#if defined(DEBUG_NETUTILS)
-		perror( "ERROR" );
-		#endif
-		goto done;
+		/* The timestamp slot is zeroed; the user payload follows it. */
+		if( payload )
+		{
+			memcpy( nu_icmp_payload( packet ) + sizeof(struct timespec), payload, payload_size );
+		}
+
+		nu_icmp_recalc_checksum( packet, icmp_payload_size );
 	}
-	echo_packet->ip_ttl = ttl;
-	nu_packet_recalc_checksum( packet, ip_payload_size );
+
+	return packet;
+}
+
+void nu_icmp_template_stamp( packet_t* packet, uint16_t id, uint16_t seq, const struct timespec* timestamp )
+{
+	struct icmp* icmp_header = nu_icmp_header( packet );
+
+	/* The id, sequence and timestamp are contiguous, starting at an even
+	 * offset, so the checksum can be adjusted in one go. */
+	uint8_t* fields = (uint8_t*) &icmp_header->icmp_id;
+	uint8_t old_fields[ sizeof(icmp_header->icmp_id) + sizeof(icmp_header->icmp_seq) + sizeof(struct timespec) ];
+	size_t fields_size = timestamp ? sizeof(old_fields) : sizeof(old_fields) - sizeof(struct timespec);
+
+	assert( fields + sizeof(icmp_header->icmp_id) + sizeof(icmp_header->icmp_seq) == nu_icmp_payload( packet ) );
+	memcpy( old_fields, fields, fields_size );
+
+	#if __APPLE__
+	icmp_header->icmp_id  = id;
+	icmp_header->icmp_seq = seq;
 	#else
-	if( !nu_set_ttl( sock, ttl ) )
+	icmp_header->icmp_id  = htons( id );
+	icmp_header->icmp_seq = htons( seq );
+	#endif
+
+	if( timestamp )
 	{
-		trace( "Unable to set TTL.\n" );
-		#if defined(DEBUG_NETUTILS)
-		perror( "ERROR" );
-		#endif
-		goto done;
+		memcpy( nu_icmp_payload( packet ), timestamp, sizeof(*timestamp) );
 	}
-	#endif
 
-	if( !nu_set_timeout( sock, timeout ) )
+	icmp_header->icmp_cksum = nu_checksum_adjust( icmp_header->icmp_cksum, old_fields, fields, fields_size );
+}
+
+/*
+ * Echo replies carry the id and sequence directly; errors quote the IP header
+ * and the first 8 bytes of the offending datagram.
+ */
+bool nu_icmp_parse_reply( const packet_view_t* view, struct in_addr* p_from, struct in_addr* p_dst, uint16_t* p_id, uint16_t* p_seq, uint8_t* p_type, uint8_t* p_code )
+{
+	const struct icmp* icmp_header = nu_packet_view_icmp_header( view );
+	packet_view_t quoted;
+
+	if( !icmp_header )
 	{
-		trace( "Unable to set timeout: %u.\n", timeout );
-		#if defined(DEBUG_NETUTILS)
-		perror( "ERROR" );
-		#endif
-		goto done;
+		return false;
 	}
 
-	struct sockaddr_in dst_addr;
-	memset( &dst_addr, 0, sizeof(struct sockaddr_in) );
-	dst_addr.sin_family      = AF_INET;
-	dst_addr.sin_addr.s_addr = echo_packet->ip_header.ip_dst.s_addr;
+	*p_from = view->ip_header->ip_src;
+	*p_type = icmp_header->icmp_type;
+	*p_code = icmp_header->icmp_code;
 
-	uint8_t recv_packet_buffer[ IP_MAXPACKET ];
-	struct sockaddr_in from_addr;
-	socklen_t from_addr_size;
+	switch( icmp_header->icmp_type )
+	{
+		case ICMP_ECHOREPLY:
+			*p_dst = view->ip_header->ip_src;
+			*p_id  = ntohs( icmp_header->icmp_id );
+			*p_seq = ntohs( icmp_header->icmp_seq );
+			return true;
+		case ICMP_TIMXCEED:
+		case ICMP_UNREACH:
+		{
+			if( !nu_icmp_view_quoted( view, &quoted ) )
+			{
+				return false;
+			}
 
-	struct timeval time_sent;
+			const struct icmp* inner_icmp = nu_packet_view_icmp_header( &quoted );
 
-	if( gettimeofday( &time_sent, NULL ) < 0 )
+			if( !inner_icmp || inner_icmp->icmp_type != ICMP_ECHO )
+			{
+				return false;
+			}
+
+			*p_dst = quoted.ip_header->ip_dst;
+			*p_id  = ntohs( inner_icmp->icmp_id );
+			*p_seq = ntohs( inner_icmp->icmp_seq );
+			return true;
+		}
+		default:
+			/* Includes our own echo requests when probing a local address. */
+			return false;
+	}
+}
+
+void nu_icmp_dgram_header( void* buffer, size_t icmp_length, struct in_addr from )
+{
+	struct ip* ip = (struct ip*) buffer;
+
+	/* Only what nu_packet_view_init() and nu_icmp_parse_reply() look at. */
+	memset( ip, 0, NU_IP4_HDRLEN );
+	ip->ip_v   = IPVERSION;
+	ip->ip_hl  = NU_IP4_HDRLEN >> 2;
+	ip->ip_len = htons( (uint16_t) (NU_IP4_HDRLEN + icmp_length) );
+	ip->ip_p   = IPPROTO_ICMP;
+	ip->ip_src = from;
+}
+
+ssize_t nu_icmp_recv( int socket, bool datagram, void* buffer, size_t size, int flags, uint64_t* p_timestamp )
+{
+	if( !datagram )
 	{
-		#if defined(DEBUG_NETUTILS)
-		perror( "ERROR" );
-		#endif
-		goto done;
+		return nu_recv_timestamp( socket, buffer, size, flags, NULL, p_timestamp );
 	}
 
-	/* Send ICMP_ECHO packet. */
-	#ifdef NU_ICMP_INCLUDE_IP4_HEADER
-	if( sendto( sock, &packet, NU_IP4_HDRLEN + ip_payload_size, 0, (struct sockaddr *) &dst_addr, sizeof(struct sockaddr) ) < 0 )
-	#else
-	if( sendto( sock, &echo_packet->payload, ip_payload_size, 0, (struct sockaddr *) &dst_addr, sizeof(struct sockaddr) ) < 0 )
-	#endif
+	struct sockaddr_in from;
+	ssize_t bytes_read = nu_recv_timestamp( socket, (uint8_t*) buffer + NU_IP4_HDRLEN, size - NU_IP4_HDRLEN, flags, &from, p_timestamp );
+
+	if( bytes_read < 0 )
 	{
-		trace( "Unable to send ICMP packet [errno = %d].\n", errno );
+		return bytes_read;
+	}
+
+	nu_icmp_dgram_header( buffer, bytes_read, from.sin_addr );
+	return NU_IP4_HDRLEN + bytes_read;
+}
+
+ssize_t nu_icmp_sendto( int socket, bool datagram, const void* data, size_t size, const struct sockaddr_in* dst, uint8_t ttl )
+{
+	ssize_t rv = nu_sendto_ttl( socket, data, size, dst, ttl );
+
+	if( rv < 0 && datagram && errno != EAGAIN && errno != EWOULDBLOCK )
+	{
+		/* Possibly an earlier probe's ICMP error, reported once; a real
+		 * failure repeats. */
+		rv = nu_sendto_ttl( socket, data, size, dst, ttl );
+	}
+
+	return rv;
+}
+
+struct icmp_context {
+	int socket;
+	bool datagram;      /* a ping socket; see nu_icmp_socket() */
+	uint16_t id;
+	uint16_t seq;
+	uint32_t timeout;
+	bool timestamping;
+	uint32_t tx_key;    /* sends so far; the kernel's SOF_TIMESTAMPING_OPT_ID counter */
+	packet_t* packet;   /* echo template, reused while the payload is unchanged */
+	size_t payload_size;
+	uint32_t buffer[ IP_MAXPACKET / sizeof(uint32_t) ]; /* aligned for packet views */
+};
+
+icmp_context_t* nu_icmp_context_create( uint32_t timeout )
+{
+	icmp_context_t* context = (icmp_context_t*) malloc( sizeof(icmp_context_t) );
+
+	if( context )
+	{
+		context->socket       = nu_icmp_socket( true, &context->datagram, &context->id );
+		context->seq          = 0;
+		context->timeout      = timeout;
+		context->timestamping = false;
+		context->tx_key       = 0;
+		context->packet       = NULL;
+		context->payload_size = 0;
+
+		if( context->socket < 0 )
+		{
+			trace( "Unable to create socket.\n" );
+			#if defined(DEBUG_NETUTILS)
+			perror( "ERROR" );
+			#endif
+			free( context );
+			return NULL;
+		}
+
+		if( context->datagram )
+		{
+			/* Errors only come back through the error queue. */
+			const int on = 1;
+			setsockopt( context->socket, IPPROTO_IP, IP_RECVERR, &on, sizeof(on) );
+		}
+	}
+
+	return context;
+}
+
+void nu_icmp_context_destroy( icmp_context_t** p_context )
+{
+	if( p_context && *p_context )
+	{
+		icmp_context_t* context = *p_context;
+		close( context->socket );
+		nu_packet_destroy( &context->packet );
+		free( context );
+		*p_context = NULL;
+	}
+}
+
+bool nu_icmp_context_set_timestamping( icmp_context_t* context, bool enable )
+{
+	if( !nu_set_timestamping( context->socket, enable ) )
+	{
+		trace( "Unable to set socket option: SO_TIMESTAMPING.\n" );
 		#if defined(DEBUG_NETUTILS)
 		perror( "ERROR" );
 		#endif
-		goto done;
+		return false;
 	}
-	else
+
+	/* The kernel restarts its send counter whenever timestamping is switched on. */
+	context->timestamping = enable;
+	context->tx_key       = 0;
+	return true;
+}
+
+static bool icmp_context_prepare( icmp_context_t* context, struct in_addr src, struct in_addr dst, const void* echo_payload, size_t echo_payload_size )
+{
+	packet_t* packet = context->packet;
+
+	if( packet &&
+	    context->payload_size == echo_payload_size &&
+	    (echo_payload_size == 0 || memcmp( nu_icmp_payload( packet ) + sizeof(struct timespec), echo_payload, echo_payload_size ) == 0) )
 	{
-		#if defined(DEBUG_NETUTILS)
-		struct icmp* icmp_header = (struct icmp*) echo_packet->payload;
-		trace( "Sent packet [icmp_type = %u].\n", icmp_header->icmp_type );
-		#endif
+		if( packet->ip_header.ip_src.s_addr != src.s_addr || packet->ip_header.ip_dst.s_addr != dst.s_addr )
+		{
+			packet->ip_header.ip_src = src;
+			packet->ip_header.ip_dst = dst;
+			nu_packet_recalc_checksum( packet, nu_packet_ip_length( packet ) - NU_IP4_HDRLEN );
+		}
+
+		return true;
+	}
+
+	nu_packet_destroy( &context->packet );
+	context->packet       = nu_icmp_template_create( src, dst, echo_payload, echo_payload_size );
+	context->payload_size = echo_payload_size;
+	return context->packet != NULL;
+}
+
+packet_t* nu_icmp_context_echo( icmp_context_t* context, struct in_addr src, struct in_addr dst, uint8_t ttl /* max = MAXTTL */,
+                                const void* echo_payload, size_t echo_payload_size, double* p_latency )
+{
+	packet_t* reply_packet = NULL;
+
+	*p_latency = 0.0;
+
+	if( !icmp_context_prepare( context, src, dst, echo_payload, echo_payload_size ) )
+	{
+		return NULL;
 	}
 
-	/* Receive ICMP_ECHOREPLY or ICMP_TIME_EXCEEDED packet. */
-	ssize_t bytes_read = recvfrom( sock, recv_packet_buffer, sizeof(recv_packet_buffer), 0, (struct sockaddr*)  &from_addr, &from_addr_size );
+	uint16_t seq = context->seq++;
+	uint64_t time_sent = nu_monotonic_ns( );
+	struct timespec timestamp = { .tv_sec = time_sent / 1000000000ULL, .tv_nsec = time_sent % 1000000000ULL };
+	nu_icmp_template_stamp( context->packet, context->id, seq, &timestamp );
+
+	struct sockaddr_in dst_addr;
+	nu_set_ipaddress( &dst_addr, dst, 0 );
 
-	if( bytes_read <= 0 )
+	/* Send ICMP_ECHO packet. */
+	if( nu_icmp_sendto( context->socket, context->datagram, context->packet->payload, nu_packet_ip_length( context->packet ) - NU_IP4_HDRLEN, &dst_addr, ttl ) < 0 )
 	{
-		trace( "Unable to receive ICMP packet [errno = %d].\n", errno );
+		trace( "Unable to send ICMP packet [errno = %d].\n", errno );
 		#if defined(DEBUG_NETUTILS)
 		perror( "ERROR" );
 		#endif
+		return NULL;
 	}
-	else
+
+	uint32_t tx_key    = context->tx_key++;
+	uint64_t tx_kernel = 0;
+	uint64_t deadline  = time_sent + (uint64_t) context->timeout * 1000000ULL;
+
+	/* Receive ICMP_ECHOREPLY, ICMP_UNREACH or ICMP_TIME_EXCEEDED for this request,
+	 * skipping anything else the raw socket sees. */
+	for( uint64_t now = time_sent; now < deadline; now = nu_monotonic_ns( ) )
 	{
-		reply_packet = nu_packet_create_from_buf( recv_packet_buffer, bytes_read );
-		struct icmp* recv_icmp_header = (struct icmp*) reply_packet->payload;
+		struct pollfd fd = { .fd = context->socket, .events = POLLIN, .revents = 0 };
+		int ready = poll( &fd, 1, (int) ((deadline - now + 999999ULL) / 1000000ULL) );
 
-		if( recv_icmp_header->icmp_type == ICMP_ECHOREPLY ||
-            recv_icmp_header->icmp_type == ICMP_UNREACH ||
-            recv_icmp_header->icmp_type == ICMP_TIMXCEED )
+		if( ready < 0 && errno != EINTR )
 		{
-			struct timeval now = { .tv_sec = 0, .tv_usec = 0 };
-			if( gettimeofday( &now, NULL ) < 0 )
+			trace( "Unable to receive ICMP packet [errno = %d].\n", errno );
+			break;
+		}
+		else if( ready <= 0 )
+		{
+			continue;
+		}
+
+		ssize_t bytes_read = -1;
+		uint64_t rx_kernel = 0;
+
+		if( fd.revents & POLLERR )
+		{
+			/* Transmit timestamps, and errors on ping sockets, wait on the
+			 * error queue, which keeps the socket ready until it is read. */
+			uint32_t tx_id;
+
+			while( (bytes_read = nu_recv_error( context->socket, context->buffer, sizeof(context->buffer), &tx_id, &rx_kernel )) == 0 )
 			{
-				#if defined(DEBUG_NETUTILS)
-				perror( "ERROR" );
-				#endif
-				goto done;
+				if( tx_id == tx_key ) tx_kernel = rx_kernel;
+				rx_kernel = 0;
 			}
+		}
 
-			*p_latency = 1000 * (now.tv_sec - time_sent.tv_sec) + (now.tv_usec - time_sent.tv_usec) / 1000.0;
+		if( bytes_read < 0 )
+		{
+			bytes_read = nu_icmp_recv( context->socket, context->datagram, context->buffer, sizeof(context->buffer), MSG_DONTWAIT, &rx_kernel );
+		}
 
-			#if defined(DEBUG_NETUTILS)
-			struct icmp* icmp_header = (struct icmp*) reply_packet->payload;
-			trace( "Received packet [icmp_type = %u, icmp_code = %u, latency = %lf].\n", icmp_header->icmp_type, icmp_header->icmp_code, *p_latency );
-			#endif
+		uint64_t time_received = nu_monotonic_ns( );
+
+		if( bytes_read <= 0 )
+		{
+			continue;
 		}
-		else
+
+		struct in_addr from;
+		struct in_addr reply_dst;
+		uint16_t reply_id;
+		uint16_t reply_seq;
+		uint8_t type;
+		uint8_t code;
+
+		packet_view_t view;
+
+		if( !nu_packet_view_init( &view, context->buffer, bytes_read ) ||
+		    !nu_icmp_parse_reply( &view, &from, &reply_dst, &reply_id, &reply_seq, &type, &code ) ||
+		    reply_dst.s_addr != dst.s_addr || reply_id != context->id || reply_seq != seq )
 		{
-			*p_latency = 0.0;
+			continue;
 		}
+
+		if( context->timestamping && !tx_kernel )
+		{
+			tx_kernel = nu_drain_tx_timestamps( context->socket, tx_key );
+		}
+
+		/* Only the reply that is handed back to the caller is copied. */
+		reply_packet = nu_packet_create_from_buf( context->buffer, bytes_read );
+		*p_latency   = nu_latency_ms( tx_kernel, rx_kernel, time_sent, time_received );
+
+		#if defined(DEBUG_NETUTILS)
+		trace( "Received packet [icmp_type = %u, icmp_code = %u, latency = %lf].\n", type, code, *p_latency );
+		#endif
+		break;
+	}
+
+	return reply_packet;
+}
+
+packet_t* nu_icmp_create_echo( struct in_addr src, struct in_addr dst, uint8_t ttl /* max = MAXTTL */,
+                               uint32_t timeout, const void* echo_payload, size_t echo_payload_size, double* p_latency )
+{
+	icmp_context_t* context = nu_icmp_context_create( timeout );
+	packet_t* reply_packet  = NULL;
+
+	if( context )
+	{
+		reply_packet = nu_icmp_context_echo( context, src, dst, ttl, echo_payload, echo_payload_size, p_latency );
+		nu_icmp_context_destroy( &context );
 	}
 
-done:
-	if( sock >= 0 ) close( sock );
-	if( echo_packet) nu_packet_destroy( &echo_packet );
 	return reply_packet;
 }
@@ -4,9 +4,190 @@
 //#include <netinet/icmp6.h>
 
 
+#define NU_ICMP_ECHO_ID  1000  /* Identifier used for echo requests. */
+
 struct packet {
 	struct ip ip_header;
 	uint8_t payload[];
 };
 
+/*
+ * Total length of the datagram in host byte order.  Apple keeps ip_len in
+ * host byte order (see nu_packet_create).
+ */
+static inline size_t nu_packet_ip_length( const packet_t* packet )
+{
+	#if __APPLE__
+	return packet->ip_header.ip_len;
+	#else
+	return ntohs( packet->ip_header.ip_len );
+	#endif
+}
+
+static inline uint64_t nu_monotonic_ns( void )
+{
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Packet memory; see pool.c.
+ */
+packet_t* nu_packet_alloc ( size_t size );
+void      nu_packet_free  ( packet_t* packet );
+
+/*
+ * Random numbers for ids; see netutils.c.
+ */
+uint64_t nu_random( void );
+
+/*
+ * Protocol number for ICMP; the lookup is only done once.
+ */
+int nu_icmp_protocol( void );
+
+/*
+ * Socket filter for the TCP prober's raw socket: only segments sent to port
+ * get through; see nu_icmp_set_filter().
+ */
+bool nu_tcp_set_filter( int socket, uint16_t port );
+
+/*
+ * Give a prober on a raw socket another echo id, so that probers running side
+ * by side can be told apart; see sweep.c.  Returns false for a ping socket,
+ * whose id the kernel picked, or while probes are in flight.
+ */
+bool nu_prober_set_id( prober_t* prober, uint16_t id );
+
+/*
+ * Report every probe still in flight as timed out, for a caller that gives
+ * up on the prober; returns how many there were.
+ */
+int nu_prober_expire_all( prober_t* prober );
+
+/*
+ * Make a socket drop everything it would receive (its replies are read
+ * somewhere else), or detach its filter again.
+ */
+bool nu_set_drop_filter( int socket, bool drop );
+
+/*
+ * Send a datagram with the given TTL.  Where the platform supports it the
+ * TTL goes in an IP_TTL control message, which saves a setsockopt() call
+ * every time the TTL changes.
+ */
+ssize_t nu_sendto_ttl( int socket, const void* data, size_t size, const struct sockaddr_in* dst, uint8_t ttl );
+
+/*
+ * Walking an iovec array through partial transfers; see nu_sendv().  The
+ * position is an entry index and an offset into that entry.  nu_iov_window()
+ * copies what is left (at most NU_IOV_WINDOW entries) into window, and
+ * nu_iov_consume() moves the position past bytes that were transferred, and
+ * past empty entries.
+ */
+#define NU_IOV_WINDOW  64
+
+static inline int nu_iov_window( struct iovec window[], const struct iovec iov[], int count, int index, size_t offset )
+{
+	int n = 0;
+
+	for( ; index < count && n < NU_IOV_WINDOW; index++, n++ )
+	{
+		window[ n ] = iov[ index ];
+	}
+
+	if( n > 0 )
+	{
+		window[ 0 ].iov_base = (uint8_t*) window[ 0 ].iov_base + offset;
+		window[ 0 ].iov_len -= offset;
+	}
+
+	return n;
+}
+
+static inline void nu_iov_consume( const struct iovec iov[], int count, int* p_index, size_t* p_offset, size_t bytes )
+{
+	while( *p_index < count && bytes >= iov[ *p_index ].iov_len - *p_offset )
+	{
+		bytes    -= iov[ *p_index ].iov_len - *p_offset;
+		*p_index += 1;
+		*p_offset = 0;
+	}
+
+	*p_offset += bytes;
+}
+
+/*
+ * Ping socket support; see nu_icmp_socket().  nu_icmp_dgram_header() writes
+ * an IP header into the NU_IP4_HDRLEN bytes in front of an ICMP message read
+ * from a ping socket, and nu_icmp_recv() reads one that way, so either kind
+ * of socket yields whole IP datagrams.  An ICMP error for an earlier probe
+ * also fails the next send on a ping socket with IP_RECVERR (it stays on the
+ * error queue); nu_icmp_sendto() retries past that.
+ */
+void     nu_icmp_dgram_header ( void* buffer, size_t icmp_length, struct in_addr from );
+ssize_t  nu_icmp_recv         ( int socket, bool datagram, void* buffer, size_t size, int flags, uint64_t* p_timestamp );
+ssize_t  nu_icmp_sendto       ( int socket, bool datagram, const void* data, size_t size, const struct sockaddr_in* dst, uint8_t ttl );
+
+/*
+ * Read the error queue; see errqueue.c.  Returns 0 for a transmit timestamp
+ * (*p_tx_id is the SOF_TIMESTAMPING_OPT_ID send counter).  ICMP errors
+ * reported through IP_RECVERR are rebuilt in buffer as the IP datagram a raw
+ * socket would have received, quoting our original request, and their
+ * length is returned; *p_timestamp is then their receive timestamp, if any.
+ * Returns -1 once the queue is empty.
+ */
+ssize_t nu_recv_error( int socket, void* buffer, size_t size, uint32_t* p_tx_id, uint64_t* p_timestamp );
+
+/*
+ * Work out which echo request an incoming ICMP message refers to.  Returns
+ * false for anything that is not an echo reply or an error quoting an echo
+ * request.
+ */
+bool nu_icmp_parse_reply( const packet_view_t* view, struct in_addr* p_from, struct in_addr* p_dst, uint16_t* p_id, uint16_t* p_seq, uint8_t* p_type, uint8_t* p_code );
+
+/*
+ * Kernel timestamps; see timestamp.c.  Timestamps are CLOCK_REALTIME
+ * nanoseconds, or 0 when the kernel did not provide one.
+ * nu_read_tx_timestamp() returns the next transmit timestamp from the error
+ * queue along with the socket's send counter for it
+ * (SOF_TIMESTAMPING_OPT_ID), dropping any ICMP errors queued ahead of it;
+ * nu_drain_tx_timestamps() empties the error queue and returns the timestamp
+ * of send number id if it was there.
+ */
+#define NU_TIMESTAMP_CONTROL_SIZE  CMSG_SPACE(3 * sizeof(struct timespec))
+
+uint64_t nu_timestamp_from_cmsg ( const struct msghdr* message );
+ssize_t  nu_recv_timestamp      ( int socket, void* buffer, size_t size, int flags, struct sockaddr_in* p_from, uint64_t* p_timestamp );
+bool     nu_read_tx_timestamp   ( int socket, uint32_t* p_id, uint64_t* p_timestamp );
+uint64_t nu_drain_tx_timestamps ( int socket, uint32_t id );
+
+/*
+ * Round trip time in milliseconds.  Kernel timestamps are preferred when both
+ * ends have one; otherwise the CLOCK_MONOTONIC readings taken around the
+ * send and receive calls are used.
+ */
+static inline double nu_latency_ms( uint64_t tx_kernel, uint64_t rx_kernel, uint64_t tx_monotonic, uint64_t rx_monotonic )
+{
+	if( tx_kernel && rx_kernel && rx_kernel >= tx_kernel )
+	{
+		return (rx_kernel - tx_kernel) / 1000000.0;
+	}
+
+	return (rx_monotonic - tx_monotonic) / 1000000.0;
+}
+
+/*
+ * Checksum helpers.  nu_checksum_partial() accumulates the one's complement
+ * sum of a buffer into a running 64-bit sum so that discontiguous pieces
+ * (pseudo-headers, headers, payloads) can be summed separately.  Every piece
+ * except the last must have an even length.  nu_checksum_fold() folds the sum
+ * down to 16 bits and complements it.  nu_checksum_pseudo_header() starts
+ * a TCP or UDP checksum with the sum of the IPv4 pseudo-header.
+ */
+uint64_t nu_checksum_partial       ( const void* data, size_t len, uint64_t sum );
+uint16_t nu_checksum_fold          ( uint64_t sum );
+uint64_t nu_checksum_pseudo_header ( struct in_addr src, struct in_addr dst, uint8_t protocol, uint16_t length );
+
 #endif /* _NETUTILS_INTERNAL_H_ */
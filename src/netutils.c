@@ -21,10 +21,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 #include <assert.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#if defined(__linux__)
+#include <linux/filter.h>
+#endif
+#include "libnu-config.h"
+#if defined(HAVE_GETRANDOM)
+#include <sys/random.h>
+#endif
 #include "netutils.h"
 #include "netutils-internal.h"
 
+#define NU_RESOLVE_TIMEOUT  5000  /* milliseconds, for nu_resolve_hostname() */
 
 /*
  *	Print an IP header with options.
@@ -56,17 +68,63 @@ void nu_print_ip_header( const struct ip *ip )
 	putchar('\n');
 }
 
+/*
+ * Blocking lookup through one resolver shared by every caller and created on
+ * first use; a lock lets one lookup at a time use it, so this is safe to call
+ * from any thread.  Whenever that finds nothing (no answer, NXDOMAIN, or no
+ * address), the system's resolver gets a try: it applies the search list to
+ * short names and knows other sources (NSS, mDNS and so on).
+ */
 bool nu_resolve_hostname( const char* hostname, struct in_addr* ip )
 {
-	struct hostent* host = gethostbyname( hostname );
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	static resolver_t* resolver = NULL;
+	resolve_result_t result;
+	bool answered = false;
+
+	pthread_mutex_lock( &lock );
+
+	if( !resolver )
+	{
+		resolver = nu_resolver_create( 1, NU_RESOLVE_TIMEOUT, NULL, NULL );
+	}
+
+	if( resolver && nu_resolver_submit( resolver, hostname, NULL ) )
+	{
+		int polled = 0;
+
+		while( !(answered = nu_resolver_next( resolver, &result )) && (polled = nu_resolver_poll( resolver, NU_RESOLVE_TIMEOUT )) >= 0 )
+		{
+		}
+
+		if( polled < 0 )
+		{
+			/* The query may still be in flight; start over next time. */
+			nu_resolver_destroy( &resolver );
+		}
+	}
 
-	if( host )
+	pthread_mutex_unlock( &lock );
+
+	if( answered && result.found )
 	{
-		ip->s_addr = *((uint32_t*) host->h_addr_list[ 0 ]);
+		*ip = result.address;
 		return true;
 	}
 
-	return false;
+	struct addrinfo hints;
+	struct addrinfo* info = NULL;
+	memset( &hints, 0, sizeof(hints) );
+	hints.ai_family = AF_INET;
+
+	if( getaddrinfo( hostname, NULL, &hints, &info ) != 0 || !info )
+	{
+		return false;
+	}
+
+	*ip = ((const struct sockaddr_in*) info->ai_addr)->sin_addr;
+	freeaddrinfo( info );
+	return true;
 }
 
 //struct hostent	*gethostbyaddr(const void *, socklen_t, int);
@@ -105,43 +163,36 @@ void nu_set_ipaddress( struct sockaddr_in* addr, struct in_addr ip, uint16_t por
 	addr->sin_port   = htons( port );
 }
 
-uint16_t nu_checksum( const void* data, size_t len )
+bool nu_source_address( struct in_addr dst, struct in_addr* p_src )
 {
-	size_t nleft;
-	int sum;
-	uint16_t *w;
-	union {
-		uint16_t	us;
-		uint8_t	uc[2];
-	} last;
-	uint16_t answer;
+	/* Connecting a UDP socket sends nothing, but makes the kernel pick the
+	 * route, and with it the source address. */
+	struct sockaddr_in address;
+	socklen_t address_length = sizeof(address);
+	bool result = false;
+	int s = nu_udp_socket();
+
+	if( s < 0 )
+	{
+		trace( "Unable to create socket [errno = %d].\n", errno );
+		return false;
+	}
 
-	nleft = len;
-	sum = 0;
-	w = (uint16_t*) data;
+	nu_set_ipaddress( &address, dst, 9 /* discard */ );
 
-	/*
-	 * Our algorithm is simple, using a 32 bit accumulator (sum), we add
-	 * sequential 16 bit words to it, and at the end, fold back all the
-	 * carry bits from the top 16 bits into the lower 16 bits.
-	 */
-	while (nleft > 1)  {
-		sum += *w++;
-		nleft -= 2;
+	if( connect( s, (struct sockaddr*) &address, sizeof(address) ) == 0 &&
+	    getsockname( s, (struct sockaddr*) &address, &address_length ) == 0 )
+	{
+		*p_src = address.sin_addr;
+		result = true;
 	}
-
-	/* mop up an odd byte, if necessary */
-	if (nleft == 1) {
-		last.uc[0] = *(uint8_t *)w;
-		last.uc[1] = 0;
-		sum += last.us;
+	else
+	{
+		trace( "No route to %s [errno = %d].\n", nu_address_to_string(dst), errno );
 	}
 
-	/* add back carry outs from top 16 bits to low 16 bits */
-	sum = (sum >> 16) + (sum & 0xffff);	/* add hi 16 to low 16 */
-	sum += (sum >> 16);			/* add carry */
-	answer = ~sum;				/* truncate to 16 bits */
-	return answer;
+	close( s );
+	return result;
 }
 
 bool nu_set_include_header( int socket, bool include_header )
@@ -179,59 +230,318 @@ uint8_t nu_get_ttl( int socket )
 # error "Not socket option IP_TTL.  Need a way to set the TTL."
 #endif
 
-packet_t* nu_packet_create( uint8_t protocol, struct in_addr ip_src, struct in_addr ip_dst, size_t payload_size )
+int nu_icmp_protocol( void )
 {
-	size_t packet_size = sizeof(packet_t) + payload_size;
-	packet_t* packet   = (packet_t*) malloc( packet_size );
+	static int protocol = -1;
 
-	if( packet )
+	if( protocol < 0 )
+	{
+		struct protoent* proto = getprotobyname( "ICMP" );
+		protocol = proto ? proto->p_proto : IPPROTO_ICMP;
+	}
+
+	return protocol;
+}
+
+static uint16_t icmp_socket_id( int socket )
+{
+	struct sockaddr_in addr;
+	socklen_t addr_size = sizeof(addr);
+
+	if( getsockname( socket, (struct sockaddr*) &addr, &addr_size ) < 0 )
+	{
+		return 0;
+	}
+
+	/* Ping sockets use their local "port" as the echo id. */
+	return ntohs( addr.sin_port );
+}
+
+/*
+ * Unpredictable enough for echo ids and DNS query ids, which only need to
+ * differ between sockets (or queries) at the same time, here or in other
+ * processes, and be hard to guess off-path.  Not for cryptography.
+ */
+uint64_t nu_random( void )
+{
+	static uint64_t counter = 0;
+	uint64_t seed = 0;
+
+	#if defined(HAVE_GETRANDOM)
+	if( getrandom( &seed, sizeof(seed), GRND_NONBLOCK ) != sizeof(seed) )
+	#endif
+	{
+		seed = nu_monotonic_ns( ) ^ ((uint64_t) getpid( ) << 32);
+	}
+
+	/* splitmix64 */
+	uint64_t z = seed + (__atomic_add_fetch( &counter, 1, __ATOMIC_RELAXED ) * 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+bool nu_icmp_set_filter( int socket, uint16_t id )
+{
+	#if defined(__linux__) && defined(SO_ATTACH_FILTER)
+	/*
+	 * Accept echo replies carrying id, and TIME_EXCEEDED or UNREACH quoting
+	 * an echo request that carried it; raw sockets see the IP header, so X
+	 * is pointed at the ICMP header first.  Loads past the end of the packet
+	 * drop it.
+	 */
+	struct sock_filter code[] = {
+		/*  0 */ BPF_STMT( BPF_LDX | BPF_B | BPF_MSH, 0 ),                  /* x = ip header length */
+		/*  1 */ BPF_STMT( BPF_LD | BPF_B | BPF_IND, 0 ),                   /* a = icmp type */
+		/*  2 */ BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 0, 2 ),
+		/*  3 */ BPF_STMT( BPF_LD | BPF_H | BPF_IND, 4 ),                   /* a = icmp id */
+		/*  4 */ BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, id, 11, 12 ),
+		/*  5 */ BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, ICMP_TIMXCEED, 1, 0 ),
+		/*  6 */ BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, ICMP_UNREACH, 0, 10 ),
+		/*  7 */ BPF_STMT( BPF_LD | BPF_B | BPF_IND, 8 ),                   /* a = quoted ip header length */
+		/*  8 */ BPF_STMT( BPF_ALU | BPF_AND | BPF_K, 0xf ),
+		/*  9 */ BPF_STMT( BPF_ALU | BPF_LSH | BPF_K, 2 ),
+		/* 10 */ BPF_STMT( BPF_ALU | BPF_ADD | BPF_X, 0 ),
+		/* 11 */ BPF_STMT( BPF_MISC | BPF_TAX, 0 ),                         /* x = quoted icmp header - 8 */
+		/* 12 */ BPF_STMT( BPF_LD | BPF_B | BPF_IND, 8 ),                   /* a = quoted icmp type */
+		/* 13 */ BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHO, 0, 3 ),
+		/* 14 */ BPF_STMT( BPF_LD | BPF_H | BPF_IND, 12 ),                  /* a = quoted icmp id */
+		/* 15 */ BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, id, 0, 1 ),
+		/* 16 */ BPF_STMT( BPF_RET | BPF_K, IP_MAXPACKET ),
+		/* 17 */ BPF_STMT( BPF_RET | BPF_K, 0 ),
+	};
+	struct sock_fprog program = {
+		.len    = sizeof(code) / sizeof(code[ 0 ]),
+		.filter = code
+	};
+
+	return setsockopt( socket, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program) ) == 0;
+	#else
+	return false;
+	#endif
+}
+
+bool nu_set_drop_filter( int socket, bool drop )
+{
+	#if defined(__linux__) && defined(SO_ATTACH_FILTER)
+	if( !drop )
+	{
+		return setsockopt( socket, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0 ) == 0 || errno == ENOENT;
+	}
+
+	struct sock_filter code[] = {
+		BPF_STMT( BPF_RET | BPF_K, 0 ),
+	};
+	struct sock_fprog program = {
+		.len    = sizeof(code) / sizeof(code[ 0 ]),
+		.filter = code
+	};
+
+	return setsockopt( socket, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program) ) == 0;
+	#else
+	return false;
+	#endif
+}
+
+int nu_icmp_socket( bool datagram, bool* p_datagram, uint16_t* p_id )
+{
+	*p_datagram = false;
+
+	#if defined(__linux__)
+	if( datagram )
 	{
-		assert( sizeof(struct ip) == NU_IP4_HDRLEN );
-		memset( packet, 0, packet_size );
+		int sock = socket( AF_INET, SOCK_DGRAM, IPPROTO_ICMP );
 
-		/* Initialize IP header */
+		if( sock >= 0 )
 		{
-			assert( IPVERSION == 4 );
-			packet->ip_header.ip_hl  = NU_IP4_HDRLEN / sizeof(uint32_t); /* IPv4 header length (4 bits): Number of 32-bit words in header = 5 */
-			packet->ip_header.ip_v   = IPVERSION; /* IPv4 */
-			packet->ip_header.ip_tos = 0; /* Type of service (8 bits) */
-			#if __APPLE__
-			packet->ip_header.ip_len = NU_IP4_HDRLEN + payload_size; /* Total length of datagram (16 bits): IP header + data */
-			packet->ip_header.ip_id  = 0; /* ID sequence number (16 bits): unused, since single datagram */
-			#else
-			packet->ip_header.ip_len = htons( NU_IP4_HDRLEN + payload_size ); /* Total length of datagram (16 bits): IP header + data */
-			packet->ip_header.ip_id  = htons( 0 ); /* ID sequence number (16 bits): unused, since single datagram */
-			#endif
+			/* Binding assigns the echo id now rather than on the first send. */
+			struct sockaddr_in addr;
+			nu_set_ipaddress( &addr, (struct in_addr) { .s_addr = INADDR_ANY }, 0 );
 
-			/* Flags, and Fragmentation offset (3, 13 bits): 0 since single datagram */
+			if( bind( sock, (struct sockaddr*) &addr, sizeof(addr) ) == 0 )
 			{
-				int8_t ip_flags[ 4 ] = {
-					0, /* Zero (1 bit) */
-					0, /* Do not fragment flag (1 bit) */
-					0, /* More fragments following flag (1 bit) */
-					0, /* Fragmentation offset (13 bits) */
-				};
-				#if __APPLE__
-				packet->ip_header.ip_off = (ip_flags[0] << 15)
-				                         + (ip_flags[1] << 14)
-				                         + (ip_flags[2] << 13)
-				                         +  ip_flags[3];
-				#else
-				packet->ip_header.ip_off = htons( (ip_flags[0] << 15)
-				                                + (ip_flags[1] << 14)
-				                                + (ip_flags[2] << 13)
-				                                +  ip_flags[3] );
-				#endif
+				*p_datagram = true;
+				*p_id       = icmp_socket_id( sock );
+				return sock;
 			}
 
-			packet->ip_header.ip_ttl = IPDEFTTL; /* Time-to-Live (8 bits): default to maximum value */
-			packet->ip_header.ip_p   = protocol; /* Transport layer protocol (8 bits): 1 for ICMP */
-			packet->ip_header.ip_src = ip_src;
-			packet->ip_header.ip_dst = ip_dst;
-			packet->ip_header.ip_sum = 0; /* IPv4 header checksum (16 bits): set to 0 when calculating checksum */
-			//packet->ip_header.ip_sum = nu_checksum( &packet->ip_header, NU_IP4_HDRLEN + payload_size );
+			close( sock );
+		}
+
+		/* Most likely outside net.ipv4.ping_group_range. */
+		trace( "Ping sockets unavailable; using a raw socket [errno = %d].\n", errno );
+	}
+	#endif
+
+	int sock = nu_raw_socket( nu_icmp_protocol( ) );
+	*p_id    = (uint16_t) nu_random( );
+
+	if( sock >= 0 && !nu_icmp_set_filter( sock, *p_id ) )
+	{
+		/* Everything still works, just with more wakeups. */
+		trace( "Unable to attach ICMP filter.\n" );
+	}
+
+	return sock;
+}
+
+int nu_tcp_probe_socket( void )
+{
+	int sock = nu_tcp_socket( );
+
+	if( sock < 0 )
+	{
+		return -1;
+	}
+
+	/* A zero linger time makes close() send a RST and drop the connection
+	 * on the spot instead of going through FIN and TIME_WAIT. */
+	const struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+	int flags = fcntl( sock, F_GETFL, 0 );
+
+	if( flags < 0 || fcntl( sock, F_SETFL, flags | O_NONBLOCK ) < 0 ||
+	    setsockopt( sock, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger) ) < 0 )
+	{
+		trace( "Unable to set up TCP socket [errno = %d].\n", errno );
+		close( sock );
+		return -1;
+	}
+
+	return sock;
+}
+
+bool nu_tcp_set_filter( int socket, uint16_t port )
+{
+	#if defined(__linux__) && defined(SO_ATTACH_FILTER)
+	/* Accept segments sent to port; raw sockets see the IP header. */
+	struct sock_filter code[] = {
+		/* 0 */ BPF_STMT( BPF_LDX | BPF_B | BPF_MSH, 0 ),                   /* x = ip header length */
+		/* 1 */ BPF_STMT( BPF_LD | BPF_H | BPF_IND, 2 ),                    /* a = tcp destination port */
+		/* 2 */ BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, port, 0, 1 ),
+		/* 3 */ BPF_STMT( BPF_RET | BPF_K, IP_MAXPACKET ),
+		/* 4 */ BPF_STMT( BPF_RET | BPF_K, 0 ),
+	};
+	struct sock_fprog program = {
+		.len    = sizeof(code) / sizeof(code[ 0 ]),
+		.filter = code
+	};
+
+	return setsockopt( socket, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program) ) == 0;
+	#else
+	return false;
+	#endif
+}
+
+ssize_t nu_sendto_ttl( int socket, const void* data, size_t size, const struct sockaddr_in* dst, uint8_t ttl )
+{
+	#if defined(__linux__)
+	struct iovec iov = { .iov_base = (void*) data, .iov_len = size };
+	union {
+		struct cmsghdr align;
+		uint8_t buffer[ CMSG_SPACE(sizeof(int)) ];
+	} control;
+	struct msghdr message = {
+		.msg_name       = (void*) dst,
+		.msg_namelen    = sizeof(*dst),
+		.msg_iov        = &iov,
+		.msg_iovlen     = 1,
+		.msg_control    = control.buffer,
+		.msg_controllen = sizeof(control.buffer),
+		.msg_flags      = 0
+	};
+	const int option_ttl = ttl;
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR( &message );
+	cmsg->cmsg_level = IPPROTO_IP;
+	cmsg->cmsg_type  = IP_TTL;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(option_ttl));
+	memcpy( CMSG_DATA(cmsg), &option_ttl, sizeof(option_ttl) );
+
+	return sendmsg( socket, &message, 0 );
+	#else
+	if( !nu_set_ttl( socket, ttl ) )
+	{
+		return -1;
+	}
+
+	return sendto( socket, data, size, 0, (const struct sockaddr*) dst, sizeof(*dst) );
+	#endif
+}
+
+size_t nu_packet_size( size_t payload_size )
+{
+	return sizeof(packet_t) + payload_size;
+}
+
+packet_t* nu_packet_init( void* buffer, size_t buffer_size, uint8_t protocol, struct in_addr ip_src, struct in_addr ip_dst, size_t payload_size )
+{
+	size_t packet_size = nu_packet_size( payload_size );
+	packet_t* packet   = (packet_t*) buffer;
+
+	if( buffer_size < packet_size )
+	{
+		return NULL;
+	}
+
+	assert( sizeof(struct ip) == NU_IP4_HDRLEN );
+	assert( ((uintptr_t) buffer & 3) == 0 );
+	memset( packet, 0, packet_size );
+
+	/* Initialize IP header */
+	{
+		assert( IPVERSION == 4 );
+		packet->ip_header.ip_hl  = NU_IP4_HDRLEN / sizeof(uint32_t); /* IPv4 header length (4 bits): Number of 32-bit words in header = 5 */
+		packet->ip_header.ip_v   = IPVERSION; /* IPv4 */
+		packet->ip_header.ip_tos = 0; /* Type of service (8 bits) */
+		#if __APPLE__
+		packet->ip_header.ip_len = NU_IP4_HDRLEN + payload_size; /* Total length of datagram (16 bits): IP header + data */
+		packet->ip_header.ip_id  = 0; /* ID sequence number (16 bits): unused, since single datagram */
+		#else
+		packet->ip_header.ip_len = htons( NU_IP4_HDRLEN + payload_size ); /* Total length of datagram (16 bits): IP header + data */
+		packet->ip_header.ip_id  = htons( 0 ); /* ID sequence number (16 bits): unused, since single datagram */
+		#endif
+
+		/* Flags, and Fragmentation offset (3, 13 bits): 0 since single datagram */
+		{
+			int8_t ip_flags[ 4 ] = {
+				0, /* Zero (1 bit) */
+				0, /* Do not fragment flag (1 bit) */
+				0, /* More fragments following flag (1 bit) */
+				0, /* Fragmentation offset (13 bits) */
+			};
+			#if __APPLE__
+			packet->ip_header.ip_off = (ip_flags[0] << 15)
+			                         + (ip_flags[1] << 14)
+			                         + (ip_flags[2] << 13)
+			                         +  ip_flags[3];
+			#else
+			packet->ip_header.ip_off = htons( (ip_flags[0] << 15)
+			                                + (ip_flags[1] << 14)
+			                                + (ip_flags[2] << 13)
+			                                +  ip_flags[3] );
+			#endif
 		}
 
+		packet->ip_header.ip_ttl = IPDEFTTL; /* Time-to-Live (8 bits): default to maximum value */
+		packet->ip_header.ip_p   = protocol; /* Transport layer protocol (8 bits): 1 for ICMP */
+		packet->ip_header.ip_src = ip_src;
+		packet->ip_header.ip_dst = ip_dst;
+		packet->ip_header.ip_sum = 0; /* IPv4 header checksum (16 bits): set to 0 when calculating checksum */
+		//packet->ip_header.ip_sum = nu_checksum( &packet->ip_header, NU_IP4_HDRLEN + payload_size );
+	}
+
+	return packet;
+}
+
+packet_t* nu_packet_create( uint8_t protocol, struct in_addr ip_src, struct in_addr ip_dst, size_t payload_size )
+{
+	size_t packet_size = nu_packet_size( payload_size );
+	packet_t* packet   = nu_packet_alloc( packet_size );
+
+	if( packet )
+	{
+		nu_packet_init( packet, packet_size, protocol, ip_src, ip_dst, payload_size );
+
 		trace( "Packet created [proto = %u, ", protocol );
 		trace( "src = %s, ", nu_address_to_string(ip_src) );
 		trace( "dst = %s].\n", nu_address_to_string(ip_dst) );
@@ -248,7 +558,7 @@ packet_t* nu_packet_create( uint8_t protocol, struct in_addr ip_src, struct in_a
 
 packet_t* nu_packet_create_from_buf( const void* buffer, size_t buffer_size )
 {
-	packet_t* packet = (packet_t*) malloc( buffer_size );
+	packet_t* packet = nu_packet_alloc( buffer_size );
 
 	if( packet )
 	{
@@ -267,7 +577,7 @@ void nu_packet_destroy( packet_t** p_packet )
 	if( p_packet )
 	{
 		packet_t* p = *p_packet;
-		free( p );
+		nu_packet_free( p );
 		*p_packet = NULL;
 		trace( "Packet destroyed.\n" );
 	}
@@ -276,8 +586,12 @@ void nu_packet_destroy( packet_t** p_packet )
 
 void nu_packet_recalc_checksum( packet_t* packet, size_t payload_size )
 {
+	/* The IPv4 checksum only covers the header; the payload is protected by
+	 * the transport layer's own checksum.  payload_size is kept so existing
+	 * callers still compile. */
+	(void) payload_size;
 	packet->ip_header.ip_sum = 0;
-	packet->ip_header.ip_sum = nu_checksum( &packet->ip_header, NU_IP4_HDRLEN + payload_size );
+	packet->ip_header.ip_sum = nu_checksum( &packet->ip_header, packet->ip_header.ip_hl << 2 );
 }
 
 const struct ip* nu_packet_ip_header( const packet_t* packet )
@@ -289,3 +603,61 @@ size_t nu_packet_length( const packet_t* packet )
 {
 	return packet->ip_header.ip_len;
 }
+
+bool nu_packet_view_init( packet_view_t* view, const void* buffer, size_t buffer_size )
+{
+	const struct ip* ip = (const struct ip*) buffer;
+
+	if( buffer_size < NU_IP4_HDRLEN || ip->ip_v != IPVERSION )
+	{
+		return false;
+	}
+
+	size_t header_length = ip->ip_hl << 2;
+
+	if( header_length < NU_IP4_HDRLEN || header_length > buffer_size )
+	{
+		return false;
+	}
+
+	/* Trust ip_len only when it is consistent with what we have; quoted
+	 * datagrams are truncated, and some platforms report ip_len in host
+	 * order or without the header. */
+	size_t length = ntohs( ip->ip_len );
+
+	if( length < header_length || length > buffer_size )
+	{
+		length = buffer_size;
+	}
+
+	view->ip_header        = ip;
+	view->ip_header_length = header_length;
+	view->payload          = (const uint8_t*) buffer + header_length;
+	view->payload_length   = length - header_length;
+	return true;
+}
+
+const packet_t* nu_packet_view_packet( const packet_view_t* view )
+{
+	return (const packet_t*) view->ip_header;
+}
+
+const struct udphdr* nu_packet_view_udp_header( const packet_view_t* view )
+{
+	if( view->ip_header->ip_p != IPPROTO_UDP || view->payload_length < NU_UDP_HDRLEN )
+	{
+		return NULL;
+	}
+
+	return (const struct udphdr*) view->payload;
+}
+
+const struct tcphdr* nu_packet_view_tcp_header( const packet_view_t* view )
+{
+	if( view->ip_header->ip_p != IPPROTO_TCP || view->payload_length < NU_TCP_HDRLEN )
+	{
+		return NULL;
+	}
+
+	return (const struct tcphdr*) view->payload;
+}
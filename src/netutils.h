@@ -23,6 +23,7 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h> /* symlink missing headers for iOS */
@@ -33,6 +34,7 @@
 #include <sys/un.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
 
 #if defined(WIN32) || defined(WIN64)
 # include <windows.h>
@@ -46,6 +48,7 @@ extern "C" {
 #define NU_IP4_HDRLEN               20           /* IPv4 header length */
 #define NU_ICMP_HDRLEN              ICMP_MINLEN  /* ICMP header length. This is 8. */
 #define NU_UDP_HDRLEN               8            /* UDP header length. */
+#define NU_TCP_HDRLEN               20           /* TCP header length, without options. */
 #define NU_MAX_RETRIES              2
 //#define NU_ICMP_INCLUDE_IP4_HEADER  1
 
@@ -59,6 +62,12 @@ typedef enum nu_result {
  * Create a TCP socket.
  */
 #define  nu_tcp_socket() socket( AF_INET, SOCK_STREAM, 0 )
+/*
+ * Create a non-blocking TCP socket for probing.  Closing it resets the
+ * connection (SO_LINGER with a zero timeout), so it leaves no TIME_WAIT
+ * state behind.
+ */
+int nu_tcp_probe_socket( void );
 /*
  * Create a UDP socket.
  */
@@ -73,12 +82,29 @@ typedef enum nu_result {
 # define  nu_raw_socket(proto) socket( AF_INET, SOCK_RAW, proto )
 #endif
 
+/*
+ * Create a socket for ICMP echo probes.  With datagram set, Linux ping
+ * sockets (SOCK_DGRAM/IPPROTO_ICMP) are tried first: they need no
+ * privileges where net.ipv4.ping_group_range allows it, and the kernel
+ * picks the echo id, fills in the checksum and only hands each socket its
+ * own replies, without their IP header.  Errors such as TIME_EXCEEDED are
+ * only reported through IP_RECVERR.  Otherwise, or if ping sockets are not
+ * available, this is a raw socket with a random echo id and, on Linux, a
+ * socket filter (nu_icmp_set_filter) so that the kernel only passes on the
+ * replies and errors that carry that id.  *p_datagram tells which one was
+ * created and *p_id is the echo id to send with.
+ */
+int  nu_icmp_socket     ( bool datagram, bool* p_datagram, uint16_t* p_id );
+bool nu_icmp_set_filter ( int socket, uint16_t id );
+
 bool        nu_resolve_hostname       ( const char* hostname, struct in_addr* ip );
 bool        nu_address_from_ip_string ( const char* ip_str, struct in_addr* ip );
 const char* nu_address_to_string      ( struct in_addr ip );
 void        nu_address_to_string_r    ( struct in_addr ip, char* str, size_t str_size );
 void        nu_set_ipaddress          ( struct sockaddr_in* addr, struct in_addr ip, uint16_t port );
+bool        nu_source_address         ( struct in_addr dst, struct in_addr* p_src ); /* the local address that packets to dst leave from */
 uint16_t    nu_checksum               ( const void* data, size_t len );
+uint16_t    nu_checksum_adjust        ( uint16_t checksum, const void* old_data, const void* new_data, size_t len );
 bool        nu_set_include_header     ( int socket, bool include_header );
 bool        nu_set_timeout            ( int socket, uint32_t timeout );
 bool        nu_set_ttl                ( int socket, uint8_t ttl /* max = MAXTTL */ );
@@ -88,6 +114,90 @@ nu_result_t nu_send_async             ( int socket, const void* data, size_t siz
 bool        nu_recv                   ( int socket, void* data, size_t size );
 nu_result_t nu_recv_async             ( int socket, void* data, size_t size );
 void        nu_print_ip_header        ( const struct ip *ip );
+bool        nu_set_timestamping       ( int socket, bool enable ); /* kernel software TX/RX timestamps (Linux) */
+
+/*
+ * Vectored I/O.  nu_sendv() and nu_recvv() move all of iov[] (a header and
+ * payload, say) without first copying it into one buffer; partial transfers
+ * resume mid-entry, and there may be more than IOV_MAX entries.
+ *
+ * Zero-copy sends (Linux).  After nu_set_zerocopy(), nu_sendv_zerocopy()
+ * sends with MSG_ZEROCOPY (without it, an ordinary send): the kernel reads
+ * straight from the caller's pages, which saves a copy on large transfers
+ * (small ones are better off copied).  The memory must stay untouched until
+ * the kernel lets go of it, which it reports on the error queue.
+ * nu_zerocopy_reap() reads those reports, waiting up to timeout milliseconds
+ * (-1 forever) for them, and returns how many sends are still pending (-1 on
+ * error); buffers are free to reuse once it returns 0.  copied is set if the
+ * kernel had to copy after all (loopback, or a device without
+ * scatter-gather), in which case zero-copy only costs more.
+ */
+typedef struct zerocopy {
+	uint32_t sent;      /* MSG_ZEROCOPY sends; the kernel numbers them from 0 */
+	uint32_t completed; /* sends whose memory the kernel has released */
+	bool copied;
+} zerocopy_t;
+
+bool        nu_sendv                  ( int socket, const struct iovec iov[], int count );
+bool        nu_recvv                  ( int socket, const struct iovec iov[], int count );
+bool        nu_set_zerocopy           ( int socket, bool enable );
+bool        nu_sendv_zerocopy         ( int socket, const struct iovec iov[], int count, zerocopy_t* zerocopy );
+int         nu_zerocopy_reap          ( int socket, zerocopy_t* zerocopy, int timeout );
+
+/*
+ * File and pipe transfers that skip userspace buffers.  nu_send_file() sends
+ * size bytes of a file, from offset on, with sendfile() (a read/send loop
+ * where that isn't available); nu_send_file_async() is its resumable form
+ * for non-blocking sockets, advancing *p_offset and *p_remaining as it goes.
+ *
+ * A splice cursor moves size bytes from in to out with splice() (Linux):
+ * socket to socket, file to socket or pipe to socket.  Unless in is a pipe
+ * the data goes through a pipe the cursor owns.  nu_splice() moves as much
+ * as it can without blocking, returning NU_TRYAGAIN once a side would block;
+ * nu_splice_events() then tells which descriptor to wait on and for what.
+ * NU_FAILED means an error, with errno set, or in running dry early (errno
+ * is then 0).
+ */
+typedef struct splice_cursor {
+	int in;
+	int out;
+	int pipe[ 2 ];      /* { -1, -1 } when in is a pipe itself */
+	size_t size;
+	size_t offset;      /* bytes delivered to out */
+	size_t buffered;    /* bytes waiting in the pipe */
+	int wait_fd;
+	short wait_events;
+} splice_cursor_t;
+
+bool        nu_send_file              ( int socket, int fd, off_t offset, size_t size );
+nu_result_t nu_send_file_async        ( int socket, int fd, off_t* p_offset, size_t* p_remaining );
+bool        nu_splice_init            ( splice_cursor_t* cursor, int in, int out, size_t size );
+void        nu_splice_destroy         ( splice_cursor_t* cursor );
+nu_result_t nu_splice                 ( splice_cursor_t* cursor );
+short       nu_splice_events          ( const splice_cursor_t* cursor, int* p_fd );
+
+/*
+ * Resumable transfers.  nu_send_async() and nu_recv_async() start over on
+ * every call; a transfer cursor instead remembers how many bytes have been
+ * moved, so a transfer on a non-blocking stream socket picks up exactly where
+ * it stopped.  nu_transfer_resume() moves as much as the socket takes without
+ * blocking and returns NU_TRYAGAIN once it would block (it always drains to
+ * EAGAIN, so edge-triggered epoll is fine).  Wait for nu_transfer_events()
+ * (POLLIN or POLLOUT, which are also the epoll bits) before resuming.
+ * NU_FAILED means an error, with errno set, or, for a receive, the peer
+ * closing the connection early (errno is then 0).
+ */
+typedef struct transfer {
+	uint8_t* data;
+	size_t size;
+	size_t offset;      /* bytes moved so far */
+	bool send;
+} transfer_t;
+
+void        nu_transfer_init          ( transfer_t* transfer, bool send, void* data, size_t size );
+nu_result_t nu_transfer_resume        ( int socket, transfer_t* transfer );
+short       nu_transfer_events        ( const transfer_t* transfer );
+size_t      nu_transfer_remaining     ( const transfer_t* transfer );
 
 #if defined(NDEBUG) || defined(DEBUG_NETUTILS)
 #define trace(...) fprintf( stderr, __VA_ARGS__ )
@@ -102,35 +212,664 @@ typedef struct packet packet_t;
 /*
  * Low-level packet functions.  These are used for ICMP echo
  * and other uses of raw sockets.
+ *
+ * nu_packet_init() builds a packet in memory owned by the caller (a transmit
+ * ring slot, say), 4-byte aligned and at least nu_packet_size() bytes long;
+ * it returns NULL if the buffer is too small.  Such packets must not be
+ * passed to nu_packet_destroy().  The ICMP and UDP builders have _init
+ * forms too.
  */
 packet_t*        nu_packet_create          ( uint8_t protocol, struct in_addr ip_src, struct in_addr ip_dst, size_t payload_size );
+packet_t*        nu_packet_init            ( void* buffer, size_t buffer_size, uint8_t protocol, struct in_addr ip_src, struct in_addr ip_dst, size_t payload_size );
+size_t           nu_packet_size            ( size_t payload_size );
 packet_t*        nu_packet_create_from_buf ( const void* buffer, size_t buffer_size );
 void             nu_packet_destroy         ( packet_t** p_packet );
 void             nu_packet_recalc_checksum ( packet_t* packet, size_t payload_size );
 const struct ip* nu_packet_ip_header       ( const packet_t* packet );
 size_t           nu_packet_length          ( const packet_t* packet );
 
+/*
+ * Packet views.  A view validates and parses an IPv4 datagram in place, over
+ * memory owned by someone else (a receive buffer or a ring slot), so reading
+ * a reply needs no copy and no allocation.  The IP header length honours
+ * ip_hl, so options are skipped correctly.  The buffer must stay alive and
+ * unchanged for as long as the view is used, and must be 4-byte aligned.
+ *
+ * nu_packet_view_packet() lets the packet_t accessors (nu_packet_ip_header,
+ * nu_icmp_header, nu_icmp_payload) be used on a view.  nu_icmp_view_quoted()
+ * opens a view on the datagram quoted inside an ICMP error message; that
+ * datagram is truncated, usually to its first 8 bytes of payload.
+ */
+typedef struct packet_view {
+	const struct ip* ip_header;
+	size_t           ip_header_length;  /* Including options. */
+	const uint8_t*   payload;           /* The transport header. */
+	size_t           payload_length;    /* Bytes actually present after the IP header. */
+} packet_view_t;
+
+bool                 nu_packet_view_init        ( packet_view_t* view, const void* buffer, size_t buffer_size );
+const packet_t*      nu_packet_view_packet      ( const packet_view_t* view );
+const struct icmp*   nu_packet_view_icmp_header ( const packet_view_t* view );
+const struct udphdr* nu_packet_view_udp_header  ( const packet_view_t* view );
+const struct tcphdr* nu_packet_view_tcp_header  ( const packet_view_t* view );
+bool                 nu_icmp_view_quoted        ( const packet_view_t* view, packet_view_t* quoted );
+
+/*
+ * Packet pool.  Once enabled, packets are carved from slabs in size classes
+ * of 64, 128, 576, 1500 and 64K bytes and are recycled through per-thread
+ * free lists instead of going back to the heap.  Slabs are backed by huge
+ * pages when requested and available (transparent huge pages otherwise).
+ * Larger packets, and packets created before the pool was enabled, still
+ * use the heap; nu_packet_destroy() handles both.
+ */
+typedef struct packet_pool_stats {
+	uint64_t allocations;       /* Packets handed out by the pool. */
+	uint64_t recycled;          /* ...of which came straight off a free list. */
+	uint64_t releases;          /* Packets returned to the pool. */
+	uint64_t heap_allocations;  /* Packets too large for any size class. */
+	uint64_t slabs;
+	uint64_t bytes_reserved;
+	bool     hugepages;         /* At least one slab is on explicit huge pages. */
+} packet_pool_stats_t;
+
+bool nu_packet_pool_enable ( bool use_hugepages );
+void nu_packet_pool_stats  ( packet_pool_stats_t* stats );
+
 
 /*
  * Create an ICMP packet.
  */
 packet_t*    nu_icmp_create          ( uint8_t icmp_type, struct in_addr ip_src, struct in_addr ip_dst, const void* payload, size_t payload_size );
+packet_t*    nu_icmp_init            ( void* buffer, size_t buffer_size, uint8_t icmp_type, struct in_addr ip_src, struct in_addr ip_dst, const void* payload, size_t payload_size );
 void         nu_icmp_recalc_checksum ( packet_t* packet, size_t icmp_payload_size );
 struct icmp* nu_icmp_header          ( const packet_t* packet );
 uint8_t*     nu_icmp_payload         ( const packet_t* packet );
 packet_t*    nu_icmp_create_echo     ( struct in_addr src, struct in_addr dst, uint8_t ttl /* max = MAXTTL */, uint32_t timeout,
                                        const void* echo_payload, size_t echo_payload_size, double* p_latency );
 
+/*
+ * ICMP echo context.  nu_icmp_create_echo() opens and configures a socket
+ * for every probe; a context owns one for its whole lifetime so repeated
+ * echoes (traceroute, for example) pay that cost once.  The TTL is carried
+ * per packet in an IP_TTL control message where the platform allows it.
+ * With timestamping enabled, latency is measured between the kernel's
+ * transmit and receive timestamps rather than around the system calls.
+ */
+struct icmp_context;
+typedef struct icmp_context icmp_context_t;
+
+icmp_context_t* nu_icmp_context_create           ( uint32_t timeout );
+void            nu_icmp_context_destroy          ( icmp_context_t** p_context );
+bool            nu_icmp_context_set_timestamping ( icmp_context_t* context, bool enable );
+packet_t*       nu_icmp_context_echo             ( icmp_context_t* context, struct in_addr src, struct in_addr dst, uint8_t ttl /* max = MAXTTL */,
+                                                   const void* echo_payload, size_t echo_payload_size, double* p_latency );
+
+/*
+ * ICMP echo probe templates.  A template is built once with room for a
+ * timestamp at the start of the ICMP payload.  Each probe is then stamped
+ * out by patching the id, sequence and timestamp fields in place, and the
+ * ICMP checksum is fixed up incrementally (RFC 1624) so the cost does not
+ * depend on the payload size.
+ */
+packet_t*    nu_icmp_template_create ( struct in_addr ip_src, struct in_addr ip_dst, const void* payload, size_t payload_size );
+void         nu_icmp_template_stamp  ( packet_t* packet, uint16_t id, uint16_t seq, const struct timespec* timestamp );
+
+/*
+ * Create a UDP packet.  The checksum covers the pseudo-header (RFC 768), so
+ * ip_src must be the address the packet will actually leave from (see
+ * nu_source_address); the kernel does not fix it up on raw sockets.
+ * nu_udp_stamp() readdresses a packet in place, fixing up the UDP checksum
+ * incrementally (RFC 1624), so probes can be stamped out of one template.
+ */
+packet_t*      nu_udp_create          ( struct in_addr ip_src, uint16_t sport, struct in_addr ip_dst, uint16_t dport, const void* udp_payload, size_t udp_payload_size );
+packet_t*      nu_udp_init            ( void* buffer, size_t buffer_size, struct in_addr ip_src, uint16_t sport, struct in_addr ip_dst, uint16_t dport,
+                                        const void* udp_payload, size_t udp_payload_size );
+void           nu_udp_recalc_checksum ( packet_t* packet, size_t udp_payload_size );
+struct udphdr* nu_udp_header          ( const packet_t* packet );
+uint8_t*       nu_udp_payload         ( const packet_t* packet );
+void           nu_udp_stamp           ( packet_t* packet, struct in_addr ip_src, struct in_addr ip_dst, uint16_t sport, uint16_t dport, uint8_t ttl );
+
+/*
+ * Create a TCP segment, without options.  flags are the TH_* bits.  As with
+ * UDP, the checksum covers the pseudo-header, so ip_src must be the address
+ * the segment will leave from.
+ */
+packet_t*      nu_tcp_create          ( struct in_addr ip_src, uint16_t sport, struct in_addr ip_dst, uint16_t dport, uint32_t seq, uint32_t ack, uint8_t flags,
+                                        const void* tcp_payload, size_t tcp_payload_size );
+void           nu_tcp_recalc_checksum ( packet_t* packet, size_t tcp_payload_size );
+struct tcphdr* nu_tcp_header          ( const packet_t* packet );
+
+/*
+ * UDP probe generator.  Probes are sent, whole IP header included, over a
+ * raw socket (which needs privileges) from a ring of prebuilt packets: each
+ * probe only patches the addresses, ports and TTL of a ring slot, and a
+ * batch of them goes out in one sendmmsg() call.  All probes carry the same
+ * payload.  With src set to INADDR_ANY the source address is looked up in
+ * the routing table whenever the destination changes, which is slow for
+ * sweeps across many destinations; pass the source address for those.
+ * nu_udp_generator_send() returns the number of probes sent, stopping at
+ * the first error.
+ *
+ * ICMP errors come back on an ICMP socket; nu_udp_parse_error() recovers
+ * the destination and ports of the probe one quotes (TIME_EXCEEDED from a
+ * router for UDP traceroute, UNREACH/port unreachable from the destination
+ * itself); the probe's ttl is not quoted and is set to 0.
+ */
+struct udp_generator;
+typedef struct udp_generator udp_generator_t;
+
+typedef struct udp_probe {
+	struct in_addr dst;
+	uint16_t       sport;
+	uint16_t       dport;
+	uint8_t        ttl;   /* 0 = IPDEFTTL */
+} udp_probe_t;
+
+udp_generator_t* nu_udp_generator_create  ( struct in_addr src, const void* payload, size_t payload_size );
+void             nu_udp_generator_destroy ( udp_generator_t** p_generator );
+int              nu_udp_generator_fd      ( const udp_generator_t* generator );
+size_t           nu_udp_generator_send    ( udp_generator_t* generator, const udp_probe_t probes[], size_t count );
+bool             nu_udp_parse_error       ( const packet_view_t* view, struct in_addr* p_from, udp_probe_t* p_probe, uint8_t* p_type, uint8_t* p_code );
+
+/*
+ * UDP segmentation offload (Linux), for datagram sockets from
+ * nu_udp_socket().  nu_udp_send_segments() sends data as datagrams of
+ * segment_size bytes (the last one may be shorter) to dst, or to the
+ * connected peer if dst is NULL.  With GSO the kernel does the splitting,
+ * so up to NU_UDP_MAX_SEGMENTS datagrams cost one sendmsg(); segment_size
+ * plus the headers must then fit the path MTU.  Where GSO is unavailable the
+ * datagrams go out in sendmmsg() batches instead.
+ *
+ * After nu_udp_set_gro(), the kernel may coalesce consecutive datagrams from
+ * one sender into a single read.  nu_udp_recv_segments() reads one (at most
+ * 64K) into buffer and splits it back apart: segments[] is filled with the
+ * datagrams, which point into buffer, and their number is returned, or -1
+ * on error.  Give room for NU_UDP_MAX_SEGMENTS entries; datagrams that do not
+ * fit are dropped.
+ */
+#define NU_UDP_MAX_SEGMENTS  64
+
+bool nu_udp_send_segments ( int socket, const void* data, size_t size, size_t segment_size, const struct sockaddr_in* dst );
+bool nu_udp_set_gro       ( int socket, bool enable );
+int  nu_udp_recv_segments ( int socket, void* buffer, size_t size, int flags, struct sockaddr_in* p_from, struct iovec segments[], size_t max_segments );
+
+/*
+ * Batched I/O.  nu_send_batch() sends each packet (without its IP header,
+ * just like nu_ping) to the matching destination using as few system calls
+ * as possible; if destinations is NULL, each packet's IP destination is
+ * used.  It returns the number of packets sent, stopping at the first error.
+ *
+ * nu_recv_batch() drains up to the ring's capacity of datagrams into a
+ * preallocated ring of buffers in a single call where possible.  The flags
+ * are passed to recvmmsg(2); MSG_WAITFORONE blocks for the first datagram
+ * only and MSG_DONTWAIT never blocks.  It returns the number of datagrams
+ * received (they are at indices 0..n-1 of the ring), or -1 on error.
+ * nu_recv_ring_timestamp() is the kernel receive timestamp of a datagram in
+ * CLOCK_REALTIME nanoseconds, or 0 if timestamping is off (see
+ * nu_set_timestamping).  nu_recv_ring_set_headroom() leaves room in front
+ * of every datagram (to put a header there, say); the buffers and lengths
+ * returned by nu_recv_ring_buffer() include it.
+ */
+struct recv_ring;
+typedef struct recv_ring recv_ring_t;
+
+#ifndef MSG_WAITFORONE
+# define MSG_WAITFORONE 0 /* the portable fallback only ever blocks for the first datagram */
+#endif
+
+size_t       nu_send_batch             ( int socket, packet_t* const packets[], const struct sockaddr_in destinations[], size_t count );
+recv_ring_t* nu_recv_ring_create       ( size_t count, size_t buffer_size );
+void         nu_recv_ring_destroy      ( recv_ring_t** p_ring );
+size_t       nu_recv_ring_count        ( const recv_ring_t* ring );
+bool         nu_recv_ring_set_headroom ( recv_ring_t* ring, size_t headroom );
+int          nu_recv_batch             ( int socket, recv_ring_t* ring, int flags );
+const void*  nu_recv_ring_buffer       ( const recv_ring_t* ring, size_t index, size_t* p_length, struct sockaddr_in* p_from );
+uint64_t     nu_recv_ring_timestamp    ( const recv_ring_t* ring, size_t index );
+
+/*
+ * io_uring (Linux).  A ring batches socket I/O so that many sends and
+ * receives cost one system call, and completions are reaped from shared
+ * memory.  nu_uring_create() returns NULL when the library was built
+ * without <linux/io_uring.h> or the kernel refuses (too old, or disabled);
+ * callers then stay on the plain system calls.
+ *
+ * Operations are queued with a user_data value that comes back in their
+ * completion, and are sent to the kernel in one go by nu_uring_submit() or
+ * nu_uring_wait().  The queueing calls return NU_TRYAGAIN when the queue
+ * is full; submit and try again.  Data must stay valid until completion.
+ *
+ * - nu_uring_send_async() and nu_uring_recv_async() are the completion-driven
+ *   forms of nu_send_async() and nu_recv_async(): on stream sockets they
+ *   transfer the whole buffer (MSG_WAITALL), and result is the byte count or
+ *   -errno.  Data inside a buffer given to nu_uring_register_buffers() is
+ *   transferred without mapping the pages each time, as a plain read or
+ *   write: that takes no message flags, so it can complete short on stream
+ *   sockets like read() and write() do, and writing to a closed peer raises
+ *   SIGPIPE (ignore it).  Sockets given to nu_uring_register_files() skip
+ *   the descriptor lookup.
+ * - nu_uring_recv_multishot() arms a receive that keeps completing, one
+ *   datagram per completion, into buffers from the pool set up by
+ *   nu_uring_provide_buffers().  nu_uring_buffer() returns a datagram's
+ *   payload (there are at least NU_URING_HEADROOM bytes in front of it that
+ *   may be overwritten once the sender and timestamp have been read); hand
+ *   the buffer back with nu_uring_release_buffer().  When more is false the
+ *   receive has stopped (the pool ran dry, say) and must be armed again.
+ * - nu_uring_wait() submits, then returns up to max completions, waiting up
+ *   to timeout milliseconds (-1 forever) for at least one.
+ */
+struct uring;
+typedef struct uring uring_t;
+
+#define NU_URING_HEADROOM  32
+
+typedef struct uring_completion {
+	uint64_t user_data;
+	int32_t  result;    /* Bytes transferred, or -errno. */
+	int32_t  buffer;    /* Provided buffer holding the data, or -1. */
+	bool     more;      /* The operation is still armed (multishot). */
+} uring_completion_t;
+
+uring_t*    nu_uring_create            ( unsigned entries );
+void        nu_uring_destroy           ( uring_t** p_ring );
+int         nu_uring_fd                ( const uring_t* ring );
+bool        nu_uring_register_files    ( uring_t* ring, const int sockets[], unsigned count );
+bool        nu_uring_register_buffers  ( uring_t* ring, const struct iovec buffers[], unsigned count );
+bool        nu_uring_provide_buffers   ( uring_t* ring, unsigned count, size_t size );
+nu_result_t nu_uring_send_async        ( uring_t* ring, int socket, const void* data, size_t size, uint64_t user_data );
+nu_result_t nu_uring_recv_async        ( uring_t* ring, int socket, void* data, size_t size, uint64_t user_data );
+nu_result_t nu_uring_sendto_async      ( uring_t* ring, int socket, const void* data, size_t size, const struct sockaddr_in* dst, uint8_t ttl /* 0 = socket default */, uint64_t user_data );
+nu_result_t nu_uring_recv_multishot    ( uring_t* ring, int socket, uint64_t user_data );
+int         nu_uring_submit            ( uring_t* ring );
+int         nu_uring_wait              ( uring_t* ring, uring_completion_t completions[], size_t max, int timeout );
+void*       nu_uring_buffer            ( uring_t* ring, const uring_completion_t* completion, size_t* p_length, struct sockaddr_in* p_from, uint64_t* p_timestamp );
+void        nu_uring_release_buffer    ( uring_t* ring, const uring_completion_t* completion );
+
+/*
+ * Packet capture ring (Linux TPACKET_V3).  An AF_PACKET socket delivers
+ * incoming IPv4 datagrams into blocks of memory shared with the kernel, so
+ * thousands of replies are read without a system call or a copy each.  The
+ * kernel hands over a block when it is full or block_timeout milliseconds
+ * after its first frame arrived.
+ *
+ * nu_packet_ring_block() takes the next block the kernel has handed over,
+ * if any; nu_packet_ring_frame() then walks its frames, which point into the
+ * ring and start at the IP header (aligned for packet views), and
+ * nu_packet_ring_release() gives the block back.  Wait for
+ * nu_packet_ring_fd() to become readable when there is no block.
+ *
+ * Every datagram on the interface (NULL for all of them) is captured, sent
+ * ones included, until a filter is attached: nu_packet_ring_set_filter()
+ * keeps received ICMP and/or UDP, and any socket filter (such as
+ * nu_icmp_set_filter) can be attached to nu_packet_ring_fd() instead.
+ * nu_packet_ring_stats() returns the totals since the ring was created.
+ * Needs privileges (CAP_NET_RAW).
+ */
+struct packet_ring;
+typedef struct packet_ring packet_ring_t;
+
+typedef struct packet_frame {
+	const void* data;       /* The IP datagram, in the ring. */
+	size_t      length;     /* Bytes captured. */
+	size_t      original;   /* Length of the datagram on the wire. */
+	uint64_t    timestamp;  /* Kernel receive time, CLOCK_REALTIME nanoseconds. */
+} packet_frame_t;
+
+packet_ring_t* nu_packet_ring_create     ( const char* interface, size_t block_size, size_t block_count, uint32_t block_timeout );
+void           nu_packet_ring_destroy    ( packet_ring_t** p_ring );
+int            nu_packet_ring_fd         ( const packet_ring_t* ring );
+bool           nu_packet_ring_set_filter ( packet_ring_t* ring, bool icmp, bool udp );
+bool           nu_packet_ring_block      ( packet_ring_t* ring );
+bool           nu_packet_ring_frame      ( packet_ring_t* ring, packet_frame_t* frame );
+void           nu_packet_ring_release    ( packet_ring_t* ring );
+void           nu_packet_ring_stats      ( packet_ring_t* ring, uint64_t* p_received, uint64_t* p_dropped );
+
+/*
+ * Packet transmit ring (Linux PACKET_TX_RING).  Probes are written as whole
+ * Ethernet frames straight into memory shared with the kernel, and a batch
+ * of them goes out with a single send(): no copy from user space and no
+ * system call per probe.
+ *
+ * nu_tx_ring_slot() returns the next free frame's IP datagram area (16-byte
+ * aligned, with the Ethernet header in front of it already filled in) and
+ * its size, to build a probe in with nu_packet_init() or the _init builders.
+ * nu_tx_ring_commit() queues that frame with the datagram's length, and
+ * nu_tx_ring_flush() hands everything queued to the kernel without waiting.
+ * When the ring is full, nu_tx_ring_slot() flushes and waits for frames to
+ * be sent, and returns NULL only on error.
+ *
+ * dst_mac is the next hop's hardware address (the gateway's, for off-link
+ * destinations); NULL means all zeros, which is what loopback uses.  The IP
+ * header goes out exactly as built, so its checksum and source address must
+ * be right.  Frames bypass the queueing discipline where the kernel allows.
+ * Needs privileges (CAP_NET_RAW).
+ */
+struct tx_ring;
+typedef struct tx_ring tx_ring_t;
+
+tx_ring_t* nu_tx_ring_create  ( const char* interface, const uint8_t dst_mac[ 6 ], size_t frame_count );
+void       nu_tx_ring_destroy ( tx_ring_t** p_ring );
+int        nu_tx_ring_fd      ( const tx_ring_t* ring );
+void*      nu_tx_ring_slot    ( tx_ring_t* ring, size_t* p_size );
+void       nu_tx_ring_commit  ( tx_ring_t* ring, size_t length );
+bool       nu_tx_ring_flush   ( tx_ring_t* ring );
+
+/*
+ * Event-driven ICMP echo prober.  Many echo requests can be in flight at
+ * once on a single non-blocking raw socket; replies (and TIME_EXCEEDED or
+ * UNREACH errors quoting our requests) are matched back to their request
+ * by (destination, id, sequence).
+ *
+ * Results are delivered to the callback from within nu_prober_poll() or, if
+ * no callback was given, queued for nu_prober_next().  nu_prober_fd()
+ * returns a descriptor that becomes readable when there is work to do so
+ * the prober can be nested in another event loop.
+ *
+ * nu_prober_set_timestamping() switches latency measurement to kernel
+ * transmit and receive timestamps (Linux); probes fall back to
+ * CLOCK_MONOTONIC readings when either timestamp is unavailable.
+ *
+ * nu_prober_set_uring() moves probe I/O onto an io_uring (Linux): submitted
+ * probes are queued and sent together at the next nu_prober_poll(), and
+ * replies arrive through a multishot receive.  It returns false, leaving the
+ * prober as it was, when io_uring is not available.
+ *
+ * nu_prober_set_packet_ring() reads replies from a packet capture ring on
+ * interface (NULL for all) instead of the socket, and takes receive times
+ * from the ring.  It needs privileges, and cannot be combined with the
+ * io_uring receive.
+ */
+struct prober;
+typedef struct prober prober_t;
+
+typedef struct probe_result {
+	struct in_addr dst;       /* Address that was probed. */
+	struct in_addr from;      /* Address that answered (a router for TIME_EXCEEDED). */
+	uint16_t       id;
+	uint16_t       seq;
+	uint8_t        ttl;
+	uint8_t        icmp_type; /* ICMP_ECHOREPLY, ICMP_TIMXCEED or ICMP_UNREACH */
+	uint8_t        icmp_code;
+	bool           timed_out;
+	double         latency;   /* In milliseconds. */
+	void*          user_data;
+} probe_result_t;
+
+typedef void (*prober_callback_t)( const probe_result_t* result, void* context );
+
+prober_t* nu_prober_create           ( size_t max_in_flight, uint32_t timeout, prober_callback_t callback, void* context );
+void      nu_prober_destroy          ( prober_t** p_prober );
+int       nu_prober_fd               ( const prober_t* prober );
+bool      nu_prober_set_timestamping ( prober_t* prober, bool enable );
+bool      nu_prober_set_uring        ( prober_t* prober, bool enable );
+bool      nu_prober_set_packet_ring  ( prober_t* prober, bool enable, const char* interface );
+bool      nu_prober_submit           ( prober_t* prober, struct in_addr dst, uint8_t ttl /* max = MAXTTL */, void* user_data );
+int       nu_prober_poll             ( prober_t* prober, uint32_t timeout );
+bool      nu_prober_next             ( prober_t* prober, probe_result_t* result );
+size_t    nu_prober_in_flight        ( const prober_t* prober );
+
+/*
+ * Probe pacing.  A pacer hands out targets when their next probe is due:
+ * each target asks for one probe every interval milliseconds, and on top of
+ * that a token bucket holds all targets together to rate probes per second
+ * with bursts of at most burst probes (a rate of 0 means no limit).  Probes
+ * stay evenly spaced, so many targets can be probed at a fixed total rate
+ * without tripping ICMP rate limits on the way.
+ *
+ * nu_pacer_wait() blocks until at least one probe is due (or timeout
+ * milliseconds pass), then stores the user_data of up to max targets due
+ * together in due[] and returns how many.  It sleeps on a timer until
+ * shortly before the release and spins for the rest, so departures are
+ * accurate to a few microseconds at the cost of that spin.  To drive a pacer
+ * from another event loop instead, wait for nu_pacer_fd() (Linux) to become
+ * readable and call nu_pacer_poll(), which never blocks; the timer's slack
+ * then adds to the jitter.
+ *
+ * A target's first probe is due delay milliseconds after it is added, and
+ * its interval must be positive (at least a nanosecond).
+ * Spreading the delays of targets added together over their interval keeps
+ * their probes from falling due in bursts.
+ */
+struct pacer;
+typedef struct pacer pacer_t;
+
+pacer_t* nu_pacer_create  ( double rate /* per second */, uint32_t burst );
+void     nu_pacer_destroy ( pacer_t** p_pacer );
+int      nu_pacer_fd      ( const pacer_t* pacer );
+bool     nu_pacer_add     ( pacer_t* pacer, double interval /* ms */, double delay /* ms */, void* user_data );
+bool     nu_pacer_remove  ( pacer_t* pacer, void* user_data );
+size_t   nu_pacer_count   ( const pacer_t* pacer );
+size_t   nu_pacer_poll    ( pacer_t* pacer, void* due[], size_t max );
+size_t   nu_pacer_wait    ( pacer_t* pacer, void* due[], size_t max, uint32_t timeout );
+
+/*
+ * Latency histogram.  Latencies are kept in nanoseconds in log-linear
+ * buckets (HDR style): exact below 32ns, and above that every power of two
+ * is split into 16 sub-buckets, so values are reported to within about 3%.
+ * Latencies beyond about 68 seconds land in the last bucket.  Recording is
+ * O(1) and the size is fixed; a zeroed histogram is empty.
+ *
+ * Histograms are combined by adding them up, so each thread (or target) can
+ * record into its own without locking and merge them when it is done.
+ * Percentiles are in [0, 100] and, like the mean and standard deviation, are
+ * in milliseconds.
+ */
+#define NU_HISTOGRAM_SUB_BITS   5
+#define NU_HISTOGRAM_MAX_BITS   36
+#define NU_HISTOGRAM_BUCKETS    ((NU_HISTOGRAM_MAX_BITS - NU_HISTOGRAM_SUB_BITS + 2) << (NU_HISTOGRAM_SUB_BITS - 1))
+
+typedef struct latency_histogram {
+	uint64_t count;
+	double   mean;  /* Running mean and sum of squared deviations (Welford), */
+	double   m2;    /* in milliseconds. */
+	uint32_t buckets[ NU_HISTOGRAM_BUCKETS ];
+} latency_histogram_t;
+
+void   nu_histogram_record     ( latency_histogram_t* histogram, double latency /* ms */ );
+void   nu_histogram_merge      ( latency_histogram_t* histogram, const latency_histogram_t* other );
+double nu_histogram_percentile ( const latency_histogram_t* histogram, double percentile );
+double nu_histogram_stddev     ( const latency_histogram_t* histogram );
+
+/*
+ * Ping statistics, in milliseconds.  count is the number of requests sent
+ * and received the number of replies; avg is taken over the replies only.
+ * jitter is the RFC 3550 interarrival jitter estimate: a running average of
+ * the change in latency between consecutive replies.  nu_ping_stats_record()
+ * adds one reply and keeps every field current; a zeroed ping_stats_t is
+ * empty.  Merging stats from different targets weights their jitter by the
+ * number of replies.
+ */
 typedef struct ping_stats {
 	double   min;
 	double   max;
 	double   sum;
 	double   avg;
+	double   stddev;
+	double   jitter;
+	double   last;      /* Latency of the latest reply, for jitter. */
 	uint32_t count;
+	uint32_t received;
 	uint32_t lost;
+	uint32_t duplicates; /* Extra replies to a request already answered. */
+	uint32_t reordered;  /* Replies that overtook the reply to a later request. */
+	uint32_t late;       /* Replies that came after their request timed out; these count as lost. */
+	latency_histogram_t histogram;
 } ping_stats_t;
 
-bool nu_ping( struct in_addr src, struct in_addr dst, uint32_t timeout, uint32_t count, ping_stats_t* stats );
+void   nu_ping_stats_record     ( ping_stats_t* stats, double latency );
+void   nu_ping_stats_merge      ( ping_stats_t* stats, const ping_stats_t* other );
+double nu_ping_stats_percentile ( const ping_stats_t* stats, double percentile ); /* p50 = 50.0, p99.9 = 99.9 */
+
+/*
+ * Ping options.  With kernel_timestamps set, round trip times are taken from
+ * the kernel's transmit and receive timestamps where the platform provides
+ * them; otherwise they are CLOCK_MONOTONIC readings around the system calls.
+ *
+ * Echo requests carry increasing sequence numbers, and replies are matched
+ * to their request by them.  Up to window requests may be waiting for a
+ * reply at once; with an interval, a new request goes out every interval
+ * milliseconds (fractions included) as long as the window has room, and
+ * without one each request goes out as soon as the window allows.  A
+ * zeroed interval and window send each request once the previous one is
+ * answered or has timed out, which is what nu_ping() does.  A window of
+ * several requests and no interval is a flood ping.
+ */
+#define NU_PING_MAX_WINDOW  4096
+
+typedef struct ping_options {
+	uint32_t timeout;           /* Milliseconds to wait for each reply. */
+	uint32_t count;             /* Echo requests to send. */
+	bool     kernel_timestamps;
+	double   interval;          /* Milliseconds between requests, or 0. */
+	uint32_t window;            /* Requests waiting for a reply at most; 0 means 1. */
+} ping_options_t;
+
+bool nu_ping              ( struct in_addr src, struct in_addr dst, uint32_t timeout, uint32_t count, ping_stats_t* stats );
+bool nu_ping_with_options ( struct in_addr src, struct in_addr dst, const ping_options_t* options, ping_stats_t* stats );
+
+/*
+ * Parallel sweep.  nu_sweep() sends one echo request to each of count
+ * targets from several threads at once and waits until every one has been
+ * answered or has timed out; results[ i ] is the outcome for targets[ i ]
+ * (with user_data NULL).  It returns false if not every target could be
+ * probed.
+ *
+ * Each worker thread runs its own prober, so it has its own socket, echo id
+ * and packet cache.  The targets are split into chunks of chunk_size, and
+ * every worker starts on an equal share of them; a worker that runs out
+ * takes chunks from the back of the share of the worker with the most left,
+ * so one slow worker does not hold up the whole sweep.  Workers write their
+ * results straight into results[], and stats (if not NULL) is merged from
+ * each worker's own once they are done, so nothing is locked on the way.
+ * With pin_workers, worker i runs only on the i-th CPU the process may use
+ * (Linux).
+ */
+typedef struct sweep_options {
+	size_t   workers;        /* Threads; 0 = one per CPU the process may use. */
+	size_t   chunk_size;     /* Targets handed out at a time; 0 = 256. */
+	size_t   max_in_flight;  /* Per worker; 0 = 1024. */
+	uint32_t timeout;        /* Milliseconds to wait for each reply. */
+	uint8_t  ttl;            /* 0 = MAXTTL. */
+	bool     pin_workers;
+} sweep_options_t;
+
+bool nu_sweep( const struct in_addr* targets, size_t count, const sweep_options_t* options, probe_result_t* results, ping_stats_t* stats );
+
+/*
+ * TCP handshake prober.  Where ICMP is filtered or deprioritised, the time
+ * from a SYN to the SYN/ACK (or the RST of a closed port) measures latency
+ * to a service.  Probes to many host:port pairs can be in flight at once;
+ * results come through the callback or nu_tcp_prober_next(), driven by
+ * nu_tcp_prober_poll(), just like the ICMP prober.
+ *
+ * - NU_TCP_PROBE_CONNECT needs no privileges: every probe is a non-blocking
+ *   connect() watched with epoll, and is closed with a RST as soon as it
+ *   completes, so no TIME_WAIT is left behind.  Latency includes the time
+ *   to wake up and read the event.
+ * - NU_TCP_PROBE_SYN sends bare SYNs from a raw socket (which needs
+ *   privileges) and matches the replies by the acknowledged sequence
+ *   number, then resets the half-open connection.  No local socket state
+ *   exists at all; the source port is reserved for the prober's lifetime so
+ *   that the kernel does not mistake the replies for its own.  Unreachable
+ *   hosts simply time out in this mode.
+ *
+ * nu_tcp_ping() probes one host:port count times in a row and fills in the
+ * same ping_stats_t as nu_ping(); refused connections count as replies,
+ * since a RST measures the round trip just as well.
+ */
+struct tcp_prober;
+typedef struct tcp_prober tcp_prober_t;
+
+typedef enum tcp_probe_mode {
+	NU_TCP_PROBE_CONNECT,
+	NU_TCP_PROBE_SYN
+} tcp_probe_mode_t;
+
+typedef struct tcp_probe_result {
+	struct in_addr dst;
+	uint16_t       port;
+	bool           open;       /* SYN/ACK: something is listening. */
+	bool           refused;    /* RST: the host answered, nothing is listening. */
+	bool           timed_out;
+	int            error;      /* Any other failure reported for the probe (EHOSTUNREACH, say), or 0. */
+	double         latency;    /* In milliseconds. */
+	void*          user_data;
+} tcp_probe_result_t;
+
+typedef void (*tcp_prober_callback_t)( const tcp_probe_result_t* result, void* context );
+
+tcp_prober_t* nu_tcp_prober_create    ( tcp_probe_mode_t mode, size_t max_in_flight, uint32_t timeout, tcp_prober_callback_t callback, void* context );
+void          nu_tcp_prober_destroy   ( tcp_prober_t** p_prober );
+int           nu_tcp_prober_fd        ( const tcp_prober_t* prober );
+bool          nu_tcp_prober_submit    ( tcp_prober_t* prober, struct in_addr dst, uint16_t port, void* user_data );
+int           nu_tcp_prober_poll      ( tcp_prober_t* prober, uint32_t timeout );
+bool          nu_tcp_prober_next      ( tcp_prober_t* prober, tcp_probe_result_t* result );
+size_t        nu_tcp_prober_in_flight ( const tcp_prober_t* prober );
+
+bool nu_tcp_ping ( struct in_addr dst, uint16_t port, tcp_probe_mode_t mode, uint32_t timeout, uint32_t count, ping_stats_t* stats );
+
+/*
+ * Parallel traceroute.  Probes for every TTL from 1 to max_hops (count of
+ * each) are sent at once and told apart by the id and sequence quoted back
+ * in TIME_EXCEEDED messages, so the whole path is discovered in about one
+ * round trip plus the timeout.  hops must have room for max_hops entries;
+ * hops[ ttl - 1 ] describes the hop at that TTL.  Each entry holds a latency
+ * histogram, so allocate hops on the heap.  On return *p_hop_count is the
+ * TTL at which the destination answered, or max_hops if it never did.
+ */
+typedef struct traceroute_hop {
+	struct in_addr addr;      /* First address to answer at this TTL, or INADDR_ANY. */
+	uint8_t        icmp_type;
+	uint8_t        icmp_code;
+	ping_stats_t   stats;
+} traceroute_hop_t;
+
+bool nu_traceroute( struct in_addr dst, uint8_t max_hops /* max = MAXTTL */, uint32_t count, uint32_t timeout, traceroute_hop_t hops[], uint8_t* p_hop_count );
+
+/*
+ * Asynchronous name resolution.  A resolver looks up many names at once over
+ * one UDP socket, the same way the prober handles probes: submit names with
+ * a user_data pointer, then call nu_resolver_poll() (or wait for
+ * nu_resolver_fd() to become readable first) and collect results through
+ * the callback or nu_resolver_next().  Duplicate names in flight share one
+ * query.
+ *
+ * /etc/hosts is consulted first, then the nameservers from
+ * /etc/resolv.conf (or nu_resolver_set_nameservers(), a stub server on
+ * loopback for instance).  Names are looked up as given, without the search
+ * list, and only for IPv4 (A records), like the rest of the library.  Each
+ * query gets timeout milliseconds in all, split over the configured
+ * attempts, rotating through the nameservers.
+ *
+ * Answers are kept in a process-wide cache shared by every resolver and
+ * nu_resolve_hostname(), for as long as their TTL says; names that don't
+ * exist are cached too (RFC 2308).  Results for cached names are ready as
+ * soon as they are submitted, without the descriptor becoming readable.
+ */
+#define NU_HOSTNAME_MAX  253
+
+struct resolver;
+typedef struct resolver resolver_t;
+
+typedef struct resolve_result {
+	char hostname[ NU_HOSTNAME_MAX + 1 ];
+	struct in_addr address;
+	bool found;         /* false: the name doesn't exist or has no address */
+	bool timed_out;     /* no nameserver answered; not cached */
+	uint32_t ttl;       /* seconds the answer stays cached */
+	void* user_data;
+} resolve_result_t;
+
+typedef void (*resolver_callback_t)( const resolve_result_t* result, void* context );
+
+resolver_t* nu_resolver_create          ( size_t max_in_flight, uint32_t timeout, resolver_callback_t callback, void* context );
+void        nu_resolver_destroy         ( resolver_t** p_resolver );
+int         nu_resolver_fd              ( const resolver_t* resolver );
+size_t      nu_resolver_in_flight       ( const resolver_t* resolver );
+bool        nu_resolver_set_nameservers ( resolver_t* resolver, const struct sockaddr_in servers[], size_t count );
+bool        nu_resolver_submit          ( resolver_t* resolver, const char* hostname, void* user_data );
+int         nu_resolver_poll            ( resolver_t* resolver, uint32_t timeout );
+bool        nu_resolver_next            ( resolver_t* resolver, resolve_result_t* result );
+void        nu_resolver_cache_clear     ( void );
 
 
 #ifdef __cplusplus
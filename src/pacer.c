@@ -0,0 +1,358 @@
+/* Copyright (C) 2013 by Joseph A. Marrero, https://joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/timerfd.h>
+#endif
+#include "netutils.h"
+#include "netutils-internal.h"
+
+#define NU_PACER_SPIN_MIN      20000    /* nanoseconds spun instead of slept before a release... */
+#define NU_PACER_SPIN_MAX      2000000  /* ...which follows how late timer wake-ups have been */
+#define NU_PACER_BATCH_WINDOW  10000    /* nanoseconds ahead that a target is released with what is due now */
+
+/*
+ * Targets are kept in a binary min-heap on their due time.  The rate limit
+ * is a token bucket kept in GCRA form: emission is when the bucket would be
+ * full if nothing more was sent, and a probe may go once now is no more than
+ * tolerance (burst - 1 probes) before it.
+ */
+typedef struct pacer_target {
+	uint64_t due;       /* CLOCK_MONOTONIC, in nanoseconds */
+	uint64_t interval;  /* in nanoseconds */
+	void* user_data;
+} pacer_target_t;
+
+struct pacer {
+	int timer_fd;
+	uint64_t spacing;   /* nanoseconds per probe at the configured rate; 0 = no limit */
+	uint64_t tolerance;
+	uint64_t emission;
+	uint64_t armed;     /* when the timer fires, or 0 */
+	uint64_t spin;
+
+	pacer_target_t* targets;
+	size_t count;
+	size_t capacity;
+};
+
+static void pacer_sift_up( pacer_t* pacer, size_t index )
+{
+	pacer_target_t target = pacer->targets[ index ];
+
+	while( index > 0 )
+	{
+		size_t parent = (index - 1) / 2;
+		if( pacer->targets[ parent ].due <= target.due ) break;
+		pacer->targets[ index ] = pacer->targets[ parent ];
+		index = parent;
+	}
+
+	pacer->targets[ index ] = target;
+}
+
+static void pacer_sift_down( pacer_t* pacer, size_t index )
+{
+	pacer_target_t target = pacer->targets[ index ];
+
+	for( ;; )
+	{
+		size_t child = 2 * index + 1;
+		if( child >= pacer->count ) break;
+		if( child + 1 < pacer->count && pacer->targets[ child + 1 ].due < pacer->targets[ child ].due ) child += 1;
+		if( target.due <= pacer->targets[ child ].due ) break;
+		pacer->targets[ index ] = pacer->targets[ child ];
+		index = child;
+	}
+
+	pacer->targets[ index ] = target;
+}
+
+/* When the next probe may go, or 0 if there are no targets. */
+static uint64_t pacer_next( const pacer_t* pacer )
+{
+	if( pacer->count == 0 )
+	{
+		return 0;
+	}
+
+	uint64_t next = pacer->targets[ 0 ].due;
+
+	if( pacer->spacing && pacer->emission > pacer->tolerance && pacer->emission - pacer->tolerance > next )
+	{
+		next = pacer->emission - pacer->tolerance;
+	}
+
+	return next;
+}
+
+/* Arm the timer for the next release, so that the descriptor becomes
+ * readable when something is due. */
+static void pacer_arm( pacer_t* pacer )
+{
+	#if defined(__linux__)
+	uint64_t next = pacer_next( pacer );
+
+	if( next != pacer->armed )
+	{
+		/* A zero it_value disarms the timer, which is right when there are no targets. */
+		struct itimerspec spec;
+		memset( &spec, 0, sizeof(spec) );
+		if( next )
+		{
+			spec.it_value.tv_sec  = next / 1000000000ULL;
+			spec.it_value.tv_nsec = next % 1000000000ULL;
+		}
+
+		timerfd_settime( pacer->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL );
+		pacer->armed = next;
+	}
+	#endif
+}
+
+pacer_t* nu_pacer_create( double rate, uint32_t burst )
+{
+	pacer_t* pacer = (pacer_t*) calloc( 1, sizeof(pacer_t) );
+
+	if( !pacer )
+	{
+		return NULL;
+	}
+
+	pacer->timer_fd = -1;
+	pacer->spin     = 100000;
+
+	if( rate > 0 )
+	{
+		pacer->spacing   = (uint64_t) (1e9 / rate);
+		if( pacer->spacing == 0 ) pacer->spacing = 1;
+		pacer->tolerance = (burst > 1 ? burst - 1 : 0) * pacer->spacing;
+	}
+
+	#if defined(__linux__)
+	pacer->timer_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+
+	if( pacer->timer_fd < 0 )
+	{
+		trace( "Unable to create timer.\n" );
+		#if defined(DEBUG_NETUTILS)
+		perror( "ERROR" );
+		#endif
+		free( pacer );
+		return NULL;
+	}
+	#endif
+
+	return pacer;
+}
+
+void nu_pacer_destroy( pacer_t** p_pacer )
+{
+	if( p_pacer && *p_pacer )
+	{
+		pacer_t* pacer = *p_pacer;
+
+		if( pacer->timer_fd >= 0 ) close( pacer->timer_fd );
+		free( pacer->targets );
+		free( pacer );
+		*p_pacer = NULL;
+	}
+}
+
+int nu_pacer_fd( const pacer_t* pacer )
+{
+	return pacer->timer_fd;
+}
+
+bool nu_pacer_add( pacer_t* pacer, double interval, double delay, void* user_data )
+{
+	/* A target that is always due would be handed out over and over. */
+	if( !(interval * 1e6 >= 1.0) )
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	if( pacer->count == pacer->capacity )
+	{
+		size_t capacity = pacer->capacity ? 2 * pacer->capacity : 64;
+		pacer_target_t* targets = (pacer_target_t*) realloc( pacer->targets, capacity * sizeof(pacer_target_t) );
+
+		if( !targets )
+		{
+			return false;
+		}
+
+		pacer->targets  = targets;
+		pacer->capacity = capacity;
+	}
+
+	pacer_target_t* target = &pacer->targets[ pacer->count ];
+	target->due       = nu_monotonic_ns( ) + (delay > 0 ? (uint64_t) (delay * 1e6) : 0);
+	target->interval  = (uint64_t) (interval * 1e6);
+	target->user_data = user_data;
+	pacer_sift_up( pacer, pacer->count++ );
+	pacer_arm( pacer );
+	return true;
+}
+
+bool nu_pacer_remove( pacer_t* pacer, void* user_data )
+{
+	for( size_t i = 0; i < pacer->count; i++ )
+	{
+		if( pacer->targets[ i ].user_data == user_data )
+		{
+			pacer->count -= 1;
+
+			if( i < pacer->count )
+			{
+				pacer->targets[ i ] = pacer->targets[ pacer->count ];
+				pacer_sift_down( pacer, i );
+				pacer_sift_up( pacer, i );
+			}
+
+			pacer_arm( pacer );
+			return true;
+		}
+	}
+
+	return false;
+}
+
+size_t nu_pacer_count( const pacer_t* pacer )
+{
+	return pacer->count;
+}
+
+static size_t pacer_release( pacer_t* pacer, uint64_t now, void* due[], size_t max )
+{
+	size_t released = 0;
+
+	while( released < max && pacer->count > 0 && pacer->targets[ 0 ].due <= now + NU_PACER_BATCH_WINDOW )
+	{
+		if( pacer->spacing )
+		{
+			if( pacer->emission > now + pacer->tolerance )
+			{
+				break; /* out of tokens */
+			}
+
+			/* A release less than one spacing late keeps its slot, so
+			 * late wake-ups do not eat into the rate. */
+			pacer->emission = (pacer->emission + pacer->spacing > now ? pacer->emission : now) + pacer->spacing;
+		}
+
+		/* The next due time follows on from the last one, so a target's
+		 * probes stay evenly spaced; one that has fallen more than an
+		 * interval behind (the rate limit is below what the targets ask
+		 * for) starts again from now rather than catching up in a burst. */
+		pacer_target_t* target = &pacer->targets[ 0 ];
+		due[ released++ ] = target->user_data;
+		target->due += target->interval;
+		if( target->due + target->interval < now ) target->due = now + target->interval;
+		pacer_sift_down( pacer, 0 );
+	}
+
+	return released;
+}
+
+size_t nu_pacer_poll( pacer_t* pacer, void* due[], size_t max )
+{
+	#if defined(__linux__)
+	uint64_t expirations;
+	if( read( pacer->timer_fd, &expirations, sizeof(expirations) ) > 0 ) pacer->armed = 0;
+	#endif
+
+	size_t released = pacer_release( pacer, nu_monotonic_ns( ), due, max );
+	pacer_arm( pacer );
+	return released;
+}
+
+size_t nu_pacer_wait( pacer_t* pacer, void* due[], size_t max, uint32_t timeout )
+{
+	uint64_t deadline = nu_monotonic_ns( ) + (uint64_t) timeout * 1000000ULL;
+	size_t released   = 0;
+
+	for( ;; )
+	{
+		uint64_t now = nu_monotonic_ns( );
+		released = pacer_release( pacer, now, due, max );
+
+		if( released > 0 || max == 0 )
+		{
+			break;
+		}
+
+		uint64_t next = pacer_next( pacer );
+
+		if( next == 0 || now >= deadline )
+		{
+			break;
+		}
+
+		if( next > deadline ) next = deadline;
+
+		if( next > now + pacer->spin )
+		{
+			/* Sleep until shortly before the release... */
+			uint64_t wake = next - pacer->spin;
+			#if defined(__linux__)
+			struct itimerspec spec;
+			memset( &spec, 0, sizeof(spec) );
+			spec.it_value.tv_sec  = wake / 1000000000ULL;
+			spec.it_value.tv_nsec = wake % 1000000000ULL;
+			timerfd_settime( pacer->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL );
+			pacer->armed = wake;
+
+			struct pollfd pfd = { .fd = pacer->timer_fd, .events = POLLIN };
+			uint64_t expirations;
+			if( poll( &pfd, 1, -1 ) > 0 && read( pacer->timer_fd, &expirations, sizeof(expirations) ) > 0 ) pacer->armed = 0;
+			#else
+			struct timespec delay = { .tv_sec = (wake - now) / 1000000000ULL, .tv_nsec = (wake - now) % 1000000000ULL };
+			nanosleep( &delay, NULL );
+			#endif
+
+			/* Spin for twice the typical lateness, averaged over the last few wake-ups. */
+			uint64_t woke = nu_monotonic_ns( );
+			uint64_t late = woke > wake ? woke - wake : 0;
+			uint64_t spin = pacer->spin - pacer->spin / 8 + late / 4;
+			pacer->spin   = spin < NU_PACER_SPIN_MIN ? NU_PACER_SPIN_MIN : spin > NU_PACER_SPIN_MAX ? NU_PACER_SPIN_MAX : spin;
+		}
+		else
+		{
+			/* ...and spin through the last stretch, which a timer would overshoot. */
+			while( nu_monotonic_ns( ) < next )
+			{
+			}
+		}
+	}
+
+	pacer_arm( pacer );
+	return released;
+}
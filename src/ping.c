@@ -22,20 +22,149 @@
 #include <string.h>
 #include <stdio.h>
 #include <sys/time.h>
+#include <fcntl.h>
 #include <math.h>
 #include <errno.h>
 #include <assert.h>
+#include <poll.h>
 #include "netutils.h"
 #include "netutils-internal.h"
 
+#define NU_PING_HISTORY_MIN  64
+
+/*
+ * Echo requests are numbered from 0 in the order they are sent, and probe k
+ * goes out with icmp_seq = k mod 2^16.  The last few (a power of two, at
+ * least eight windows' worth) are kept in a ring of slots indexed by k.
+ * Every request has the same timeout, so they are settled (answered or
+ * expired) in order from the oldest one still waiting.  Replies to requests
+ * that have left the ring are told apart by a bitmap of every sequence
+ * number answered: set means a duplicate, clear means the reply is late.
+ */
+typedef struct ping_slot {
+	uint64_t sent;      /* CLOCK_MONOTONIC, in nanoseconds */
+	uint64_t tx_stamp;  /* kernel transmit timestamp, or 0 */
+	bool answered;
+} ping_slot_t;
+
+typedef struct ping_state {
+	ping_slot_t* slots;
+	uint32_t mask;
+	uint32_t sent;         /* requests sent so far */
+	uint32_t oldest;       /* first request not yet settled */
+	uint32_t outstanding;  /* unanswered requests that have not expired */
+	uint32_t highest;      /* latest request answered, plus one */
+	uint64_t answered[ 65536 / 64 ];
+} ping_state_t;
+
+static inline bool ping_answered( const ping_state_t* state, uint16_t seq )
+{
+	return (state->answered[ seq / 64 ] >> (seq % 64)) & 1;
+}
+
+static inline void ping_set_answered( ping_state_t* state, uint16_t seq, bool answered )
+{
+	if( answered ) state->answered[ seq / 64 ] |= 1ULL << (seq % 64);
+	else state->answered[ seq / 64 ] &= ~(1ULL << (seq % 64));
+}
+
+static void ping_expire( ping_state_t* state, uint64_t timeout, uint64_t now )
+{
+	while( state->oldest < state->sent )
+	{
+		ping_slot_t* slot = &state->slots[ state->oldest & state->mask ];
+
+		if( !slot->answered )
+		{
+			if( slot->sent + timeout > now )
+			{
+				break;
+			}
+
+			state->outstanding -= 1; /* lost, unless it turns up late */
+		}
+
+		state->oldest += 1;
+	}
+}
+
+static void ping_reply( ping_state_t* state, ping_stats_t* stats, uint16_t seq, uint64_t rx_kernel, uint64_t received )
+{
+	/* Find which request this is: the latest one sent with this sequence number. */
+	uint32_t back = (uint16_t) (state->sent - 1 - seq);
+
+	if( back >= state->sent )
+	{
+		return; /* never sent */
+	}
+
+	uint32_t k = state->sent - 1 - back;
+
+	if( k < state->oldest || state->slots[ k & state->mask ].answered )
+	{
+		if( ping_answered( state, seq ) )
+		{
+			stats->duplicates += 1;
+		}
+		else
+		{
+			stats->late += 1;
+			ping_set_answered( state, seq, true );
+		}
+
+		return;
+	}
+
+	ping_slot_t* slot = &state->slots[ k & state->mask ];
+	slot->answered = true;
+	ping_set_answered( state, seq, true );
+	state->outstanding -= 1;
+
+	if( k + 1 < state->highest )
+	{
+		stats->reordered += 1;
+	}
+	else
+	{
+		state->highest = k + 1;
+	}
+
+	nu_ping_stats_record( stats, nu_latency_ms( slot->tx_stamp, rx_kernel, slot->sent, received ) );
+}
+
 bool nu_ping( struct in_addr src, struct in_addr dst, uint32_t timeout, uint32_t count, ping_stats_t* stats )
 {
+	const ping_options_t options = {
+		.timeout           = timeout,
+		.count             = count,
+		.kernel_timestamps = false
+	};
+
+	return nu_ping_with_options( src, dst, &options, stats );
+}
+
+bool nu_ping_with_options( struct in_addr src, struct in_addr dst, const ping_options_t* options, ping_stats_t* stats )
+{
+	uint64_t timeout          = (uint64_t) options->timeout * 1000000ULL;
+	uint32_t count            = options->count;
+	uint32_t window           = options->window > 1 ? options->window : 1;
 	bool result               = false;
-	struct timeval* time_sent = NULL;
-	struct protoent* proto    = getprotobyname( "ICMP" );
-	int sock                  = nu_raw_socket( proto->p_proto /* IPPROTO_ICMP */ );
-	size_t icmp_payload_size  = sizeof(*time_sent);
+	bool datagram             = false;
+	uint16_t id               = 0;
+	int sock                  = nu_icmp_socket( true, &datagram, &id );
+	size_t icmp_payload_size  = sizeof(struct timespec);
 	size_t ip_payload_size    = NU_ICMP_HDRLEN + icmp_payload_size;
+	packet_t* packet          = nu_icmp_template_create( src, dst, NULL, 0 );
+	ping_state_t* state       = NULL;
+	pacer_t* pacer            = NULL;
+	ping_stats_t ignored;
+
+	if( !stats )
+	{
+		stats = &ignored;
+	}
+
+	memset( stats, 0, sizeof(ping_stats_t) );
 
 	if( sock < 0 )
 	{
@@ -46,8 +175,16 @@ bool nu_ping( struct in_addr src, struct in_addr dst, uint32_t timeout, uint32_t
 		goto done;
 	}
 
-	packet_t* packet = nu_icmp_create( ICMP_ECHO, src, dst, NULL, icmp_payload_size );
+	if( !packet )
+	{
+		goto done;
+	}
 
+	if( window > NU_PING_MAX_WINDOW )
+	{
+		errno = EINVAL;
+		goto done;
+	}
 
 	#ifdef NU_ICMP_INCLUDE_IP4_HEADER
 	if( !nu_set_include_header( sock, true ) )
@@ -58,7 +195,7 @@ bool nu_ping( struct in_addr src, struct in_addr dst, uint32_t timeout, uint32_t
 		#endif
 		goto done;
 	}
-	packet->ip_ttl = MAXTTL;
+	packet->ip_header.ip_ttl = MAXTTL;
 	nu_packet_recalc_checksum( packet, ip_payload_size );
 	#else
 	if( !nu_set_ttl( sock, MAXTTL ) )
@@ -71,150 +208,203 @@ bool nu_ping( struct in_addr src, struct in_addr dst, uint32_t timeout, uint32_t
 	}
 	#endif
 
-	if( !nu_set_timeout( sock, timeout ) )
+	int flags = fcntl( sock, F_GETFL, 0 );
+	if( flags < 0 || fcntl( sock, F_SETFL, flags | O_NONBLOCK ) < 0 )
 	{
-		trace( "Unable to set timeout: %u.\n", timeout );
+		trace( "Unable to make socket non-blocking.\n" );
 		#if defined(DEBUG_NETUTILS)
 		perror( "ERROR" );
 		#endif
 		goto done;
 	}
 
-	struct sockaddr_in dst_addr;
-	memset( &dst_addr, 0, sizeof(struct sockaddr_in) );
-	dst_addr.sin_family      = AF_INET;
-	dst_addr.sin_addr.s_addr = packet->ip_header.ip_dst.s_addr;
+	uint32_t history = NU_PING_HISTORY_MIN;
+	while( history < 8 * window ) history *= 2;
 
-	uint8_t recv_packet_buffer[ IP_MAXPACKET ];
-	struct sockaddr_in from_addr;
-	socklen_t from_addr_size;
-	bool first_packet = false;
+	state = (ping_state_t*) calloc( 1, sizeof(ping_state_t) );
+	if( state ) state->slots = (ping_slot_t*) calloc( history, sizeof(ping_slot_t) );
 
-	if( stats )
+	if( !state || !state->slots )
 	{
-		stats->min   = 0.0;
-		stats->max   = 0.0;
-		stats->avg   = 0.0;
-		stats->sum   = 0.0;
-		stats->count = count;
-		stats->lost  = 0;
+		goto done;
 	}
 
-	while( count-- )
+	state->mask = history - 1;
+
+	/* Requests are sent on the pacer's schedule, or as fast as the window
+	 * allows without an interval.  The first one goes out straight away, so
+	 * the pacer's first release is one interval later. */
+	if( options->interval > 0 )
 	{
-		time_sent = (struct timeval*) &packet->payload[ NU_ICMP_HDRLEN ];
+		pacer = nu_pacer_create( 0, 1 );
 
-		if( gettimeofday( time_sent, NULL ) < 0 )
+		if( !pacer || !nu_pacer_add( pacer, options->interval, options->interval, NULL ) )
 		{
-			#if defined(DEBUG_NETUTILS)
-			perror( "ERROR" );
-			#endif
 			goto done;
 		}
+	}
+
+	bool timestamping = options->kernel_timestamps && nu_set_timestamping( sock, true );
+	bool send_due     = true;
+
+	struct sockaddr_in dst_addr;
+	memset( &dst_addr, 0, sizeof(struct sockaddr_in) );
+	dst_addr.sin_family      = AF_INET;
+	dst_addr.sin_addr.s_addr = packet->ip_header.ip_dst.s_addr;
 
+	uint32_t recv_packet_buffer[ IP_MAXPACKET / sizeof(uint32_t) ]; /* aligned for packet views */
 
-		nu_icmp_recalc_checksum( packet, icmp_payload_size );
+	stats->count = count;
 
-		/* Send ICMP_ECHO packet. */
-		#ifdef NU_ICMP_INCLUDE_IP4_HEADER
-		if( sendto( sock, &packet, NU_IP4_HDRLEN + ip_payload_size, 0, (struct sockaddr *) &dst_addr, sizeof(struct sockaddr) ) < 0 )
-		#else
-		if( sendto( sock, &packet->payload, ip_payload_size, 0, (struct sockaddr *) &dst_addr, sizeof(struct sockaddr) ) < 0 )
-		#endif
+	while( state->sent < count || state->outstanding > 0 )
+	{
+		/* CLOCK_MONOTONIC is immune to the wall clock being stepped mid-run. */
+		uint64_t now = nu_monotonic_ns( );
+		ping_expire( state, timeout, now );
+
+		if( state->sent == count && state->outstanding == 0 )
 		{
-			trace( "Unable to send ICMP packet [errno = %d].\n", errno );
-			#if defined(DEBUG_NETUTILS)
-			perror( "ERROR" );
-			#endif
-			goto done;
+			break;
 		}
-		else
+
+		if( pacer && !send_due && state->sent < count )
 		{
-			#if defined(DEBUG_NETUTILS)
-			struct icmp* icmp_header = (struct icmp*) packet->payload;
-			trace( "Sent packet [icmp_type = %u].\n", icmp_header->icmp_type );
-			//print_ip_header( &packet->ip_header );
-			#endif
+			void* due;
+			send_due = nu_pacer_poll( pacer, &due, 1 ) > 0;
 		}
 
-		/* Receive ICMP_ECHOREPLY or ICMP_TIME_EXCEEDED packet. */
-		ssize_t bytes_read = recvfrom( sock, recv_packet_buffer, sizeof(recv_packet_buffer), 0, (struct sockaddr*)  &from_addr, &from_addr_size );
-
-		if( bytes_read <= 0 )
+		/* A request that falls due while the window is full waits for it to
+		 * open; any that fall due meanwhile are skipped. */
+		if( send_due && state->sent < count && state->outstanding < window && state->sent - state->oldest <= state->mask )
 		{
-			trace( "Unable to receive ICMP packet [errno = %d].\n", errno );
+			uint16_t seq      = (uint16_t) state->sent;
+			ping_slot_t* slot = &state->slots[ state->sent & state->mask ];
+			struct timespec time_sent = { .tv_sec = now / 1000000000ULL, .tv_nsec = now % 1000000000ULL };
+
+			/* Only the sequence number and timestamp change; the checksum is patched incrementally. */
+			nu_icmp_template_stamp( packet, id, seq, &time_sent );
+
+			/* Send ICMP_ECHO packet. */
+			#ifdef NU_ICMP_INCLUDE_IP4_HEADER
+			if( sendto( sock, packet, NU_IP4_HDRLEN + ip_payload_size, 0, (struct sockaddr *) &dst_addr, sizeof(struct sockaddr) ) < 0 )
+			#else
+			if( sendto( sock, &packet->payload, ip_payload_size, 0, (struct sockaddr *) &dst_addr, sizeof(struct sockaddr) ) < 0 )
+			#endif
+			{
+				trace( "Unable to send ICMP packet [errno = %d].\n", errno );
+				#if defined(DEBUG_NETUTILS)
+				perror( "ERROR" );
+				#endif
+				goto done;
+			}
+
+			slot->sent     = now;
+			slot->tx_stamp = 0;
+			slot->answered = false;
+			ping_set_answered( state, seq, false );
+			state->sent        += 1;
+			state->outstanding += 1;
+			send_due            = pacer == NULL;
+
 			#if defined(DEBUG_NETUTILS)
-			perror( "ERROR" );
+			trace( "Sent packet [icmp_seq = %u].\n", seq );
 			#endif
+			continue;
+		}
 
-			if( stats )
+		/* Transmit timestamps are numbered by send, just like the requests. */
+		uint32_t tx_key;
+		uint64_t tx_stamp;
+
+		while( timestamping && nu_read_tx_timestamp( sock, &tx_key, &tx_stamp ) )
+		{
+			if( tx_key >= state->oldest && tx_key < state->sent )
 			{
-				stats->lost += 1;
+				state->slots[ tx_key & state->mask ].tx_stamp = tx_stamp;
 			}
 		}
-		else
+
+		/* Receive everything that has arrived; the replies are parsed in place. */
+		bool any = false;
+
+		for( ;; )
 		{
-			packet_t* recv_packet         = nu_packet_create_from_buf( recv_packet_buffer, bytes_read );
-			struct icmp* recv_icmp_header = (struct icmp*) recv_packet->payload;
+			uint64_t rx_kernel;
+			ssize_t bytes_read = nu_icmp_recv( sock, datagram, recv_packet_buffer, sizeof(recv_packet_buffer), 0, &rx_kernel );
+			uint64_t received  = nu_monotonic_ns( );
 
-			if( recv_icmp_header->icmp_type == ICMP_ECHOREPLY )
+			if( bytes_read < 0 )
 			{
-				time_sent = (struct timeval*) &recv_packet->payload[ NU_ICMP_HDRLEN ];
-
-				struct timeval now = { .tv_sec = 0, .tv_usec = 0 };
-				if( gettimeofday( &now, NULL ) < 0 )
-				{
-					#if defined(DEBUG_NETUTILS)
-					perror( "ERROR" );
-					#endif
-					goto done;
-				}
-
-				//trace( "      now = { %ld, %d }\n", now.tv_sec, now.tv_usec );
-				//trace( "time_sent = { %ld, %d }\n", time_sent->tv_sec, time_sent->tv_usec );
-
-				double latency = 1000 * (now.tv_sec - time_sent->tv_sec) + (now.tv_usec - time_sent->tv_usec) / 1000.0;
-
-
-				if( stats )
-				{
-					if( !first_packet )
-					{
-						stats->min   = latency;
-						stats->max   = latency;
-						stats->avg   = latency;
-						stats->sum   = latency;
-						first_packet = true;
-					}
-					else
-					{
-						stats->min  = fmin( stats->min, latency );
-						stats->max  = fmax( stats->max, latency );
-						stats->sum += latency;
-					}
-				}
-
+				if( errno == EINTR ) continue;
+				if( errno == EAGAIN || errno == EWOULDBLOCK ) break;
 
+				trace( "Unable to receive ICMP packet [errno = %d].\n", errno );
 				#if defined(DEBUG_NETUTILS)
-				struct icmp* icmp_header = (struct icmp*) recv_packet->payload;
-				trace( "Received packet [icmp_type = %u, icmp_code = %u, latency = %lf].\n", icmp_header->icmp_type, icmp_header->icmp_code, latency );
-				//print_ip_header( &recv_packet->ip_header );
+				perror( "ERROR" );
 				#endif
+				goto done;
+			}
+
+			packet_view_t recv_view;
+			struct in_addr from, quoted;
+			uint16_t recv_id, recv_seq;
+			uint8_t type, code;
 
-				nu_packet_destroy( &recv_packet );
+			any = true;
+
+			if( nu_packet_view_init( &recv_view, recv_packet_buffer, bytes_read ) &&
+			    nu_icmp_parse_reply( &recv_view, &from, &quoted, &recv_id, &recv_seq, &type, &code ) &&
+			    type == ICMP_ECHOREPLY && recv_id == id && from.s_addr == dst_addr.sin_addr.s_addr )
+			{
+				ping_reply( state, stats, recv_seq, rx_kernel, received );
+
+				#if defined(DEBUG_NETUTILS)
+				trace( "Received packet [icmp_seq = %u, latency = %lf].\n", recv_seq, stats->last );
+				#endif
 			}
 		}
-	}
 
-	if( stats )
-	{
-		stats->avg = ((double) stats->sum) / stats->count;;
+		if( any )
+		{
+			continue;
+		}
+
+		/* Sleep until a reply arrives, the oldest request expires, or the
+		 * next one is due.  The pacer's timer is only pollable on Linux;
+		 * elsewhere sends are checked at least every millisecond. */
+		struct pollfd fds[ 2 ] = {
+			{ .fd = sock, .events = POLLIN },
+			{ .fd = -1,   .events = POLLIN }
+		};
+		int wait = -1;
+
+		if( state->outstanding > 0 )
+		{
+			uint64_t deadline = state->slots[ state->oldest & state->mask ].sent + timeout;
+			wait = deadline > now ? (int) ((deadline - now + 999999) / 1000000) : 0;
+		}
+
+		if( pacer && state->sent < count && !send_due )
+		{
+			fds[ 1 ].fd = nu_pacer_fd( pacer );
+			if( fds[ 1 ].fd < 0 && (wait < 0 || wait > 1) ) wait = 1;
+		}
+
+		if( poll( fds, 2, wait ) < 0 && errno != EINTR )
+		{
+			goto done;
+		}
 	}
 
+	/* Anything that wasn't answered in time counts as lost, late replies included. */
+	stats->lost = stats->count - stats->received;
 	result = true;
 
 done:
 	if( sock >= 0 ) close( sock );
+	if( state ) free( state->slots );
+	free( state );
+	nu_pacer_destroy( &pacer );
 	nu_packet_destroy( &packet );
 	return result;
 }
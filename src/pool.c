@@ -0,0 +1,372 @@
+/* Copyright (C) 2013 by Joseph A. Marrero, https://joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "netutils.h"
+#include "netutils-internal.h"
+
+/*
+ * Packet pool.
+ *
+ * Every packet is preceded by a small chunk header recording where its
+ * memory came from, so nu_packet_destroy() works the same whether or not
+ * the pool was enabled when the packet was created.
+ *
+ * Pooled chunks are carved out of large slabs, one size class per slab, and
+ * are never returned to the operating system.  Each thread keeps a short
+ * free list per size class and trades chunks with a shared depot in
+ * batches, so the common case takes no locks at all.
+ */
+#define NU_PACKET_POOL_CLASSES   5
+#define NU_PACKET_HEAP           UINT32_MAX
+#define NU_PACKET_POOL_BATCH     32    /* chunks moved between a thread and the depot at once */
+#define NU_PACKET_POOL_SLAB      (2 * 1024 * 1024)  /* one huge page */
+
+#ifndef MAP_ANONYMOUS
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+typedef struct packet_chunk {
+	uint32_t size_class;
+	struct packet_chunk* next;
+	max_align_t payload[];
+} packet_chunk_t;
+
+static const size_t packet_pool_sizes[ NU_PACKET_POOL_CLASSES ] = {
+	64, 128, 576, 1500, IP_MAXPACKET + 1
+};
+
+typedef struct packet_depot {
+	pthread_mutex_t lock;
+	packet_chunk_t* free_list;
+} packet_depot_t;
+
+typedef struct packet_cache {
+	packet_chunk_t* free_list[ NU_PACKET_POOL_CLASSES ];
+	uint32_t count[ NU_PACKET_POOL_CLASSES ];
+	uint64_t allocations;
+	uint64_t recycled;
+	uint64_t releases;
+	uint64_t heap_allocations;
+	struct packet_cache* next;   /* registry of live thread caches */
+	struct packet_cache* prev;
+	bool registered;
+} packet_cache_t;
+
+static struct {
+	bool enabled;
+	bool use_hugepages;
+	bool hugepages;
+	packet_depot_t depots[ NU_PACKET_POOL_CLASSES ];
+	pthread_mutex_t lock;        /* protects the fields below */
+	packet_cache_t* caches;
+	uint64_t allocations;        /* totals from threads that have exited */
+	uint64_t recycled;
+	uint64_t releases;
+	uint64_t heap_allocations;
+	uint64_t slabs;
+	uint64_t bytes_reserved;
+} pool = {
+	.enabled = false,
+	.depots  = {
+		{ PTHREAD_MUTEX_INITIALIZER, NULL }, { PTHREAD_MUTEX_INITIALIZER, NULL },
+		{ PTHREAD_MUTEX_INITIALIZER, NULL }, { PTHREAD_MUTEX_INITIALIZER, NULL },
+		{ PTHREAD_MUTEX_INITIALIZER, NULL }
+	},
+	.lock    = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread packet_cache_t cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static inline size_t chunk_stride( size_t size_class )
+{
+	return (sizeof(packet_chunk_t) + packet_pool_sizes[ size_class ] + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+}
+
+static inline packet_chunk_t* chunk_from_packet( packet_t* packet )
+{
+	return (packet_chunk_t*) ((uint8_t*) packet - offsetof(packet_chunk_t, payload));
+}
+
+static void* slab_map( size_t size )
+{
+	void* slab = MAP_FAILED;
+
+	#ifdef MAP_HUGETLB
+	if( pool.use_hugepages )
+	{
+		slab = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+		if( slab != MAP_FAILED ) pool.hugepages = true;
+	}
+	#endif
+
+	if( slab == MAP_FAILED )
+	{
+		slab = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+		#ifdef MADV_HUGEPAGE
+		/* No reserved huge pages; transparent huge pages are the next best thing. */
+		if( slab != MAP_FAILED && pool.use_hugepages ) madvise( slab, size, MADV_HUGEPAGE );
+		#endif
+	}
+
+	return slab == MAP_FAILED ? NULL : slab;
+}
+
+/* Called with the depot locked. */
+static bool depot_grow( packet_depot_t* depot, size_t size_class )
+{
+	size_t stride = chunk_stride( size_class );
+	size_t slab_size = NU_PACKET_POOL_SLAB;
+
+	while( slab_size / stride < NU_PACKET_POOL_BATCH ) slab_size += NU_PACKET_POOL_SLAB;
+
+	uint8_t* slab = (uint8_t*) slab_map( slab_size );
+
+	if( !slab )
+	{
+		trace( "Unable to map packet slab [errno = %d].\n", errno );
+		return false;
+	}
+
+	for( size_t offset = 0; offset + stride <= slab_size; offset += stride )
+	{
+		packet_chunk_t* chunk = (packet_chunk_t*) (slab + offset);
+		chunk->size_class = (uint32_t) size_class;
+		chunk->next       = depot->free_list;
+		depot->free_list  = chunk;
+	}
+
+	pthread_mutex_lock( &pool.lock );
+	pool.slabs          += 1;
+	pool.bytes_reserved += slab_size;
+	pthread_mutex_unlock( &pool.lock );
+	return true;
+}
+
+static void cache_flush( packet_cache_t* c, size_t size_class, uint32_t keep )
+{
+	packet_depot_t* depot = &pool.depots[ size_class ];
+
+	pthread_mutex_lock( &depot->lock );
+	while( c->count[ size_class ] > keep )
+	{
+		packet_chunk_t* chunk = c->free_list[ size_class ];
+		c->free_list[ size_class ] = chunk->next;
+		c->count[ size_class ] -= 1;
+		chunk->next      = depot->free_list;
+		depot->free_list = chunk;
+	}
+	pthread_mutex_unlock( &depot->lock );
+}
+
+static void cache_destroy( void* data )
+{
+	packet_cache_t* c = (packet_cache_t*) data;
+
+	for( size_t i = 0; i < NU_PACKET_POOL_CLASSES; i++ )
+	{
+		cache_flush( c, i, 0 );
+	}
+
+	pthread_mutex_lock( &pool.lock );
+	if( c->prev ) c->prev->next = c->next;
+	else pool.caches = c->next;
+	if( c->next ) c->next->prev = c->prev;
+	pool.allocations      += c->allocations;
+	pool.recycled         += c->recycled;
+	pool.releases         += c->releases;
+	pool.heap_allocations += c->heap_allocations;
+	pthread_mutex_unlock( &pool.lock );
+
+	c->registered = false;
+}
+
+static void cache_key_create( void )
+{
+	pthread_key_create( &cache_key, cache_destroy );
+}
+
+static packet_cache_t* cache_get( void )
+{
+	packet_cache_t* c = &cache;
+
+	if( !c->registered )
+	{
+		/* The key's destructor hands this thread's chunks back when it exits. */
+		pthread_once( &cache_key_once, cache_key_create );
+		pthread_setspecific( cache_key, c );
+
+		pthread_mutex_lock( &pool.lock );
+		c->prev = NULL;
+		c->next = pool.caches;
+		if( pool.caches ) pool.caches->prev = c;
+		pool.caches = c;
+		pthread_mutex_unlock( &pool.lock );
+
+		c->registered = true;
+	}
+
+	return c;
+}
+
+static bool cache_refill( packet_cache_t* c, size_t size_class )
+{
+	packet_depot_t* depot = &pool.depots[ size_class ];
+
+	pthread_mutex_lock( &depot->lock );
+
+	if( !depot->free_list && !depot_grow( depot, size_class ) )
+	{
+		pthread_mutex_unlock( &depot->lock );
+		return false;
+	}
+
+	while( depot->free_list && c->count[ size_class ] < NU_PACKET_POOL_BATCH )
+	{
+		packet_chunk_t* chunk = depot->free_list;
+		depot->free_list = chunk->next;
+		chunk->next = c->free_list[ size_class ];
+		c->free_list[ size_class ] = chunk;
+		c->count[ size_class ] += 1;
+	}
+
+	pthread_mutex_unlock( &depot->lock );
+	return true;
+}
+
+packet_t* nu_packet_alloc( size_t size )
+{
+	packet_chunk_t* chunk;
+
+	if( __atomic_load_n( &pool.enabled, __ATOMIC_ACQUIRE ) )
+	{
+		packet_cache_t* c = cache_get( );
+
+		for( size_t size_class = 0; size_class < NU_PACKET_POOL_CLASSES; size_class++ )
+		{
+			if( size > packet_pool_sizes[ size_class ] )
+			{
+				continue;
+			}
+
+			if( c->free_list[ size_class ] )
+			{
+				c->recycled += 1;
+			}
+			else if( !cache_refill( c, size_class ) )
+			{
+				break;
+			}
+
+			chunk = c->free_list[ size_class ];
+			c->free_list[ size_class ] = chunk->next;
+			c->count[ size_class ] -= 1;
+			c->allocations += 1;
+			return (packet_t*) chunk->payload;
+		}
+
+		c->heap_allocations += 1;
+	}
+
+	chunk = (packet_chunk_t*) malloc( sizeof(packet_chunk_t) + size );
+
+	if( !chunk )
+	{
+		return NULL;
+	}
+
+	chunk->size_class = NU_PACKET_HEAP;
+	return (packet_t*) chunk->payload;
+}
+
+void nu_packet_free( packet_t* packet )
+{
+	if( !packet )
+	{
+		return;
+	}
+
+	packet_chunk_t* chunk = chunk_from_packet( packet );
+
+	if( chunk->size_class == NU_PACKET_HEAP )
+	{
+		free( chunk );
+		return;
+	}
+
+	size_t size_class = chunk->size_class;
+	packet_cache_t* c = cache_get( );
+
+	assert( size_class < NU_PACKET_POOL_CLASSES );
+	chunk->next = c->free_list[ size_class ];
+	c->free_list[ size_class ] = chunk;
+	c->count[ size_class ] += 1;
+	c->releases += 1;
+
+	if( c->count[ size_class ] > 2 * NU_PACKET_POOL_BATCH )
+	{
+		cache_flush( c, size_class, NU_PACKET_POOL_BATCH );
+	}
+}
+
+bool nu_packet_pool_enable( bool use_hugepages )
+{
+	pthread_mutex_lock( &pool.lock );
+	pool.use_hugepages = use_hugepages;
+	pthread_mutex_unlock( &pool.lock );
+
+	__atomic_store_n( &pool.enabled, true, __ATOMIC_RELEASE );
+	return true;
+}
+
+void nu_packet_pool_stats( packet_pool_stats_t* stats )
+{
+	pthread_mutex_lock( &pool.lock );
+
+	stats->allocations      = pool.allocations;
+	stats->recycled         = pool.recycled;
+	stats->releases         = pool.releases;
+	stats->heap_allocations = pool.heap_allocations;
+	stats->slabs            = pool.slabs;
+	stats->bytes_reserved   = pool.bytes_reserved;
+	stats->hugepages        = pool.hugepages;
+
+	/* Live threads' counters are read without their cooperation; they may
+	 * be a few operations stale, which is fine for statistics. */
+	for( const packet_cache_t* c = pool.caches; c; c = c->next )
+	{
+		stats->allocations      += c->allocations;
+		stats->recycled         += c->recycled;
+		stats->releases         += c->releases;
+		stats->heap_allocations += c->heap_allocations;
+	}
+
+	pthread_mutex_unlock( &pool.lock );
+}
@@ -0,0 +1,1037 @@
+/* Copyright (C) 2013 by Joseph A. Marrero, https://joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#include "netutils.h"
+#include "netutils-internal.h"
+
+#define NU_PROBER_MAX_IN_FLIGHT  UINT16_MAX  /* sequence numbers must be unique while in flight */
+#define NU_PROBER_RING_SIZE      64
+#define NU_PROBER_RCVBUF         (4 * 1024 * 1024)
+#define NU_PROBE_NONE            UINT32_MAX
+#define NU_PROBER_URING_BUFFERS  256
+#define NU_PROBER_URING_MTU      2048
+#define NU_PROBER_URING_RECV     UINT64_MAX  /* user_data of the multishot receive */
+#define NU_PROBER_CAPTURE_BLOCK   (128 * 1024)
+#define NU_PROBER_CAPTURE_BLOCKS  32          /* NU_PROBER_RCVBUF worth of blocks */
+#define NU_PROBER_CAPTURE_TIMEOUT 1           /* milliseconds before a partly filled block is handed over */
+
+/*
+ * Outstanding probes live in a fixed pool.  They are found by key through an
+ * open-addressed hash table of pool indices, and are kept on a list ordered
+ * by send time.  Every probe has the same timeout, so that list is also
+ * ordered by deadline and expiring probes is just a walk from its head.
+ */
+typedef struct probe {
+	struct in_addr dst;
+	uint16_t id;
+	uint16_t seq;
+	uint8_t ttl;
+	uint64_t sent;      /* CLOCK_MONOTONIC, in nanoseconds */
+	uint64_t tx_stamp;  /* kernel transmit timestamp, or 0 */
+	uint32_t tx_key;
+	void* user_data;
+	uint32_t prev;      /* timeout list */
+	uint32_t next;
+} probe_t;
+
+struct prober {
+	int socket;
+	bool datagram;      /* a ping socket; see nu_icmp_socket() */
+	int event_fd;
+	uint16_t id;
+	uint16_t seq;
+	uint64_t timeout;   /* in nanoseconds */
+	prober_callback_t callback;
+	void* context;
+
+	probe_t* probes;
+	size_t max_in_flight;
+	size_t in_flight;
+	uint32_t free_list;
+	uint32_t oldest;
+	uint32_t newest;
+
+	uint32_t* table;    /* pool indices, or NU_PROBE_NONE */
+	size_t table_mask;
+
+	probe_result_t* completions;
+	size_t completions_capacity;
+	size_t completions_head;
+	size_t completions_count;
+
+	bool timestamping;
+	uint32_t tx_key;    /* sends so far; the kernel's SOF_TIMESTAMPING_OPT_ID counter */
+	uint32_t* tx_table; /* pool indices by tx_key, table_mask wide */
+
+	packet_t* packet;
+	recv_ring_t* ring;
+
+	uring_t* uring;     /* see nu_prober_set_uring() */
+	bool uring_recv;    /* replies come through a multishot receive */
+	uint8_t* tx_buffers; /* queued echo requests, one per pool slot */
+	size_t tx_size;
+	size_t unsent;      /* probes queued since the ring was last submitted */
+
+	packet_ring_t* capture; /* see nu_prober_set_packet_ring() */
+};
+
+static inline size_t probe_hash( const prober_t* prober, struct in_addr dst, uint16_t id, uint16_t seq )
+{
+	uint64_t key = ((uint64_t) dst.s_addr << 32) | ((uint32_t) id << 16) | seq;
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return (size_t) key & prober->table_mask;
+}
+
+static size_t probe_lookup( const prober_t* prober, struct in_addr dst, uint16_t id, uint16_t seq )
+{
+	size_t slot = probe_hash( prober, dst, id, seq );
+
+	while( prober->table[ slot ] != NU_PROBE_NONE )
+	{
+		const probe_t* probe = &prober->probes[ prober->table[ slot ] ];
+
+		if( probe->dst.s_addr == dst.s_addr && probe->id == id && probe->seq == seq )
+		{
+			return slot;
+		}
+
+		slot = (slot + 1) & prober->table_mask;
+	}
+
+	return SIZE_MAX;
+}
+
+static void probe_table_remove( prober_t* prober, size_t slot )
+{
+	/* Backward-shift deletion keeps probe sequences intact without tombstones. */
+	size_t hole = slot;
+	size_t next = (slot + 1) & prober->table_mask;
+
+	while( prober->table[ next ] != NU_PROBE_NONE )
+	{
+		const probe_t* probe = &prober->probes[ prober->table[ next ] ];
+		size_t home = probe_hash( prober, probe->dst, probe->id, probe->seq );
+
+		if( ((next - home) & prober->table_mask) >= ((next - hole) & prober->table_mask) )
+		{
+			prober->table[ hole ] = prober->table[ next ];
+			hole = next;
+		}
+
+		next = (next + 1) & prober->table_mask;
+	}
+
+	prober->table[ hole ] = NU_PROBE_NONE;
+}
+
+static void probe_release( prober_t* prober, uint32_t index )
+{
+	probe_t* probe = &prober->probes[ index ];
+
+	if( probe->prev != NU_PROBE_NONE ) prober->probes[ probe->prev ].next = probe->next;
+	else prober->oldest = probe->next;
+
+	if( probe->next != NU_PROBE_NONE ) prober->probes[ probe->next ].prev = probe->prev;
+	else prober->newest = probe->prev;
+
+	probe->next       = prober->free_list;
+	prober->free_list = index;
+	prober->in_flight -= 1;
+}
+
+static void prober_complete( prober_t* prober, const probe_result_t* result )
+{
+	if( prober->callback )
+	{
+		prober->callback( result, prober->context );
+		return;
+	}
+
+	if( prober->completions_count == prober->completions_capacity )
+	{
+		size_t capacity = prober->completions_capacity ? 2 * prober->completions_capacity : 64;
+		probe_result_t* completions = (probe_result_t*) malloc( capacity * sizeof(probe_result_t) );
+
+		if( !completions )
+		{
+			trace( "Dropping probe result; out of memory.\n" );
+			return;
+		}
+
+		for( size_t i = 0; i < prober->completions_count; i++ )
+		{
+			completions[ i ] = prober->completions[ (prober->completions_head + i) % prober->completions_capacity ];
+		}
+
+		free( prober->completions );
+		prober->completions          = completions;
+		prober->completions_capacity = capacity;
+		prober->completions_head     = 0;
+	}
+
+	size_t tail = (prober->completions_head + prober->completions_count) % prober->completions_capacity;
+	prober->completions[ tail ] = *result;
+	prober->completions_count += 1;
+}
+
+prober_t* nu_prober_create( size_t max_in_flight, uint32_t timeout, prober_callback_t callback, void* context )
+{
+	prober_t* prober = (prober_t*) calloc( 1, sizeof(prober_t) );
+
+	if( !prober )
+	{
+		return NULL;
+	}
+
+	if( max_in_flight == 0 ) max_in_flight = 1;
+	if( max_in_flight > NU_PROBER_MAX_IN_FLIGHT ) max_in_flight = NU_PROBER_MAX_IN_FLIGHT;
+
+	size_t table_size = 1;
+	while( table_size < 2 * max_in_flight ) table_size <<= 1;
+
+	prober->socket        = -1;
+	prober->event_fd      = -1;
+	prober->seq           = 0;
+	prober->timeout       = (uint64_t) timeout * 1000000ULL;
+	prober->callback      = callback;
+	prober->context       = context;
+	prober->max_in_flight = max_in_flight;
+	prober->probes        = (probe_t*) malloc( max_in_flight * sizeof(probe_t) );
+	prober->table         = (uint32_t*) malloc( table_size * sizeof(uint32_t) );
+	prober->table_mask    = table_size - 1;
+	prober->oldest        = NU_PROBE_NONE;
+	prober->newest        = NU_PROBE_NONE;
+	prober->ring          = nu_recv_ring_create( NU_PROBER_RING_SIZE, IP_MAXPACKET );
+	prober->packet        = nu_icmp_template_create( (struct in_addr) { .s_addr = INADDR_ANY }, (struct in_addr) { .s_addr = INADDR_ANY }, NULL, 0 );
+
+	if( !prober->probes || !prober->table || !prober->ring || !prober->packet )
+	{
+		goto failed;
+	}
+
+	for( size_t i = 0; i < max_in_flight; i++ )
+	{
+		prober->probes[ i ].next = (i + 1 < max_in_flight) ? (uint32_t) (i + 1) : NU_PROBE_NONE;
+	}
+	prober->free_list = 0;
+
+	for( size_t i = 0; i < table_size; i++ )
+	{
+		prober->table[ i ] = NU_PROBE_NONE;
+	}
+
+	prober->socket = nu_icmp_socket( true, &prober->datagram, &prober->id );
+
+	if( prober->socket < 0 )
+	{
+		trace( "Unable to create socket.\n" );
+		#if defined(DEBUG_NETUTILS)
+		perror( "ERROR" );
+		#endif
+		goto failed;
+	}
+
+	if( prober->datagram )
+	{
+		/* Replies come without an IP header; one is put in front of them.
+		 * TIME_EXCEEDED and UNREACH only arrive on the error queue. */
+		const int on = 1;
+
+		if( !nu_recv_ring_set_headroom( prober->ring, NU_IP4_HDRLEN ) ||
+		    setsockopt( prober->socket, IPPROTO_IP, IP_RECVERR, &on, sizeof(on) ) < 0 )
+		{
+			trace( "Unable to set up ping socket.\n" );
+			goto failed;
+		}
+	}
+
+	int flags = fcntl( prober->socket, F_GETFL, 0 );
+	if( flags < 0 || fcntl( prober->socket, F_SETFL, flags | O_NONBLOCK ) < 0 )
+	{
+		trace( "Unable to make socket non-blocking.\n" );
+		goto failed;
+	}
+
+	/* Replies can arrive in bursts when many probes are in flight. */
+	const int rcvbuf = NU_PROBER_RCVBUF;
+	setsockopt( prober->socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf) );
+
+	#if defined(__linux__)
+	prober->event_fd = epoll_create1( EPOLL_CLOEXEC );
+
+	if( prober->event_fd < 0 )
+	{
+		trace( "Unable to create epoll instance.\n" );
+		goto failed;
+	}
+
+	struct epoll_event event = { .events = EPOLLIN, .data.fd = prober->socket };
+
+	if( epoll_ctl( prober->event_fd, EPOLL_CTL_ADD, prober->socket, &event ) < 0 )
+	{
+		trace( "Unable to watch socket.\n" );
+		goto failed;
+	}
+	#else
+	prober->event_fd = prober->socket;
+	#endif
+
+	return prober;
+
+failed:
+	nu_prober_destroy( &prober );
+	return NULL;
+}
+
+void nu_prober_destroy( prober_t** p_prober )
+{
+	if( p_prober && *p_prober )
+	{
+		prober_t* prober = *p_prober;
+
+		if( prober->event_fd >= 0 && prober->event_fd != prober->socket ) close( prober->event_fd );
+		if( prober->socket >= 0 ) close( prober->socket );
+		nu_uring_destroy( &prober->uring );
+		nu_packet_ring_destroy( &prober->capture );
+		nu_recv_ring_destroy( &prober->ring );
+		nu_packet_destroy( &prober->packet );
+		free( prober->completions );
+		free( prober->tx_buffers );
+		free( prober->tx_table );
+		free( prober->table );
+		free( prober->probes );
+		free( prober );
+		*p_prober = NULL;
+	}
+}
+
+int nu_prober_fd( const prober_t* prober )
+{
+	return prober->event_fd;
+}
+
+size_t nu_prober_in_flight( const prober_t* prober )
+{
+	return prober->in_flight;
+}
+
+bool nu_prober_set_timestamping( prober_t* prober, bool enable )
+{
+	if( enable && !prober->tx_table )
+	{
+		prober->tx_table = (uint32_t*) malloc( (prober->table_mask + 1) * sizeof(uint32_t) );
+
+		if( !prober->tx_table )
+		{
+			return false;
+		}
+	}
+
+	if( !nu_set_timestamping( prober->socket, enable ) )
+	{
+		trace( "Unable to set socket option: SO_TIMESTAMPING.\n" );
+		#if defined(DEBUG_NETUTILS)
+		perror( "ERROR" );
+		#endif
+		return false;
+	}
+
+	/* The kernel restarts its send counter whenever timestamping is switched
+	 * on, and probes already in flight have no key to match against. */
+	for( size_t i = 0; enable && i <= prober->table_mask; i++ )
+	{
+		prober->tx_table[ i ] = NU_PROBE_NONE;
+	}
+
+	prober->timestamping = enable;
+	prober->tx_key       = 0;
+	return true;
+}
+
+static void prober_watch_socket( prober_t* prober, uint32_t events )
+{
+	#if defined(__linux__)
+	struct epoll_event event = { .events = events, .data.fd = prober->socket };
+
+	if( epoll_ctl( prober->event_fd, EPOLL_CTL_MOD, prober->socket, &event ) < 0 )
+	{
+		trace( "Unable to watch socket.\n" );
+	}
+	#endif
+}
+
+/* Hand every queued probe to the kernel. */
+static void prober_flush( prober_t* prober )
+{
+	if( prober->unsent == 0 )
+	{
+		return;
+	}
+
+	nu_uring_submit( prober->uring );
+
+	/* Latency counts from when the requests actually went out; the newest
+	 * probes are the queued ones, so the timeout list stays in order. */
+	uint64_t now   = nu_monotonic_ns( );
+	uint32_t index = prober->newest;
+
+	for( size_t i = 0; i < prober->unsent && index != NU_PROBE_NONE; i++ )
+	{
+		prober->probes[ index ].sent = now;
+		index = prober->probes[ index ].prev;
+	}
+
+	prober->unsent = 0;
+}
+
+static bool prober_arm_receive( prober_t* prober )
+{
+	nu_result_t result = nu_uring_recv_multishot( prober->uring, prober->socket, NU_PROBER_URING_RECV );
+
+	if( result == NU_TRYAGAIN )
+	{
+		prober_flush( prober );
+		nu_uring_submit( prober->uring );
+		result = nu_uring_recv_multishot( prober->uring, prober->socket, NU_PROBER_URING_RECV );
+	}
+
+	/* Replies may already be waiting; don't hold the receive back. */
+	return result == NU_SUCCESS && nu_uring_submit( prober->uring ) >= 0;
+}
+
+static int prober_reap( prober_t* prober );
+
+bool nu_prober_set_uring( prober_t* prober, bool enable )
+{
+	if( !enable )
+	{
+		if( prober->uring )
+		{
+			/* Replies already received are still delivered. */
+			prober_flush( prober );
+			prober_reap( prober );
+
+			#if defined(__linux__)
+			epoll_ctl( prober->event_fd, EPOLL_CTL_DEL, nu_uring_fd( prober->uring ), NULL );
+			#endif
+			nu_uring_destroy( &prober->uring );
+			free( prober->tx_buffers );
+			prober->tx_buffers = NULL;
+
+			if( prober->uring_recv )
+			{
+				prober->uring_recv = false;
+				prober_watch_socket( prober, EPOLLIN );
+			}
+		}
+
+		return true;
+	}
+
+	if( prober->uring )
+	{
+		return true;
+	}
+
+	if( prober->capture )
+	{
+		trace( "Replies already come from a packet ring.\n" );
+		return false;
+	}
+
+	/* One operation slot per probe in flight, plus the receive. */
+	unsigned entries = NU_PROBER_RING_SIZE;
+	while( entries < prober->max_in_flight + 1 && entries < 4096 ) entries <<= 1;
+
+	prober->tx_size    = nu_packet_ip_length( prober->packet ) - NU_IP4_HDRLEN;
+	prober->tx_buffers = (uint8_t*) malloc( prober->max_in_flight * prober->tx_size );
+	prober->uring      = nu_uring_create( entries );
+
+	if( !prober->uring || !prober->tx_buffers ||
+	    !nu_uring_register_files( prober->uring, &prober->socket, 1 ) ||
+	    !nu_uring_provide_buffers( prober->uring, NU_PROBER_URING_BUFFERS, NU_PROBER_URING_MTU ) ||
+	    !prober_arm_receive( prober ) )
+	{
+		trace( "Unable to set up io_uring.\n" );
+		goto failed;
+	}
+
+	#if defined(__linux__)
+	struct epoll_event event = { .events = EPOLLIN, .data.fd = nu_uring_fd( prober->uring ) };
+
+	if( epoll_ctl( prober->event_fd, EPOLL_CTL_ADD, event.data.fd, &event ) < 0 )
+	{
+		trace( "Unable to watch io_uring.\n" );
+		goto failed;
+	}
+	#endif
+
+	/* Only the error queue is still read directly. */
+	prober->uring_recv = true;
+	prober_watch_socket( prober, 0 );
+	return true;
+
+failed:
+	nu_uring_destroy( &prober->uring );
+	free( prober->tx_buffers );
+	prober->tx_buffers = NULL;
+	return false;
+}
+
+static bool prober_send( prober_t* prober, uint32_t index, uint16_t seq, const struct sockaddr_in* dst, uint8_t ttl )
+{
+	const void* data = prober->packet->payload;
+	size_t size      = nu_packet_ip_length( prober->packet ) - NU_IP4_HDRLEN;
+
+	if( prober->uring )
+	{
+		/* The request has to stay put until the ring is submitted. */
+		uint8_t* buffer    = prober->tx_buffers + (size_t) index * prober->tx_size;
+		uint64_t user_data = ((uint64_t) seq << 32) | index;
+		memcpy( buffer, data, size );
+
+		nu_result_t result = nu_uring_sendto_async( prober->uring, prober->socket, buffer, size, dst, ttl, user_data );
+
+		if( result == NU_TRYAGAIN )
+		{
+			prober_flush( prober );
+			result = nu_uring_sendto_async( prober->uring, prober->socket, buffer, size, dst, ttl, user_data );
+		}
+
+		if( result == NU_SUCCESS )
+		{
+			prober->unsent += 1;
+			return true;
+		}
+
+		/* Every operation slot is taken; this one goes out directly. */
+	}
+
+	return nu_icmp_sendto( prober->socket, prober->datagram, data, size, dst, ttl ) >= 0;
+}
+
+
+bool nu_prober_submit( prober_t* prober, struct in_addr dst, uint8_t ttl, void* user_data )
+{
+	if( prober->free_list == NU_PROBE_NONE )
+	{
+		trace( "Too many probes in flight.\n" );
+		return false;
+	}
+
+	uint16_t seq = prober->seq;
+
+	/* Skip sequence numbers still in flight to this destination. */
+	while( probe_lookup( prober, dst, prober->id, seq ) != SIZE_MAX )
+	{
+		seq += 1;
+	}
+
+	prober->seq = seq + 1;
+
+	uint64_t now = nu_monotonic_ns( );
+	struct timespec timestamp = { .tv_sec = now / 1000000000ULL, .tv_nsec = now % 1000000000ULL };
+	nu_icmp_template_stamp( prober->packet, prober->id, seq, &timestamp );
+
+	struct sockaddr_in dst_addr;
+	nu_set_ipaddress( &dst_addr, dst, 0 );
+
+	if( !prober_send( prober, prober->free_list, seq, &dst_addr, ttl ) )
+	{
+		trace( "Unable to send ICMP packet [errno = %d].\n", errno );
+		return false;
+	}
+
+	uint32_t index    = prober->free_list;
+	probe_t* probe    = &prober->probes[ index ];
+	prober->free_list = probe->next;
+
+	probe->dst       = dst;
+	probe->id        = prober->id;
+	probe->seq       = seq;
+	probe->ttl       = ttl;
+	probe->sent      = now;
+	probe->tx_stamp  = 0;
+	probe->tx_key    = prober->tx_key;
+	probe->user_data = user_data;
+	probe->next      = NU_PROBE_NONE;
+	probe->prev      = prober->newest;
+
+	if( prober->newest != NU_PROBE_NONE ) prober->probes[ prober->newest ].next = index;
+	else prober->oldest = index;
+	prober->newest = index;
+
+	size_t slot = probe_hash( prober, dst, probe->id, seq );
+	while( prober->table[ slot ] != NU_PROBE_NONE )
+	{
+		slot = (slot + 1) & prober->table_mask;
+	}
+	prober->table[ slot ] = index;
+
+	if( prober->timestamping )
+	{
+		prober->tx_table[ prober->tx_key & prober->table_mask ] = index;
+		prober->tx_key += 1;
+	}
+
+	prober->in_flight += 1;
+	return true;
+}
+
+static int prober_read_errors( prober_t* prober );
+
+/* Match one incoming ICMP message to its probe and complete it. */
+static bool prober_handle( prober_t* prober, const void* buffer, size_t length, uint64_t rx_stamp, uint64_t now )
+{
+	probe_result_t result;
+	packet_view_t view;
+
+	if( !nu_packet_view_init( &view, buffer, length ) ||
+	    !nu_icmp_parse_reply( &view, &result.from, &result.dst, &result.id, &result.seq, &result.icmp_type, &result.icmp_code ) )
+	{
+		return false;
+	}
+
+	size_t slot = probe_lookup( prober, result.dst, result.id, result.seq );
+
+	if( slot != SIZE_MAX && prober->timestamping && rx_stamp && !prober->probes[ prober->table[ slot ] ].tx_stamp )
+	{
+		/* The transmit timestamp is still on the error queue. */
+		prober_read_errors( prober );
+		slot = probe_lookup( prober, result.dst, result.id, result.seq );
+	}
+
+	if( slot == SIZE_MAX )
+	{
+		/* Not ours, a duplicate, or it already timed out. */
+		return false;
+	}
+
+	uint32_t index = prober->table[ slot ];
+	const probe_t* probe = &prober->probes[ index ];
+
+	result.ttl       = probe->ttl;
+	result.timed_out = false;
+	result.latency   = nu_latency_ms( probe->tx_stamp, rx_stamp, probe->sent, now );
+	result.user_data = probe->user_data;
+
+	probe_table_remove( prober, slot );
+	probe_release( prober, index );
+	prober_complete( prober, &result );
+	return true;
+}
+
+/*
+ * The error queue holds transmit timestamps and, on ping sockets, the ICMP
+ * errors (TIME_EXCEEDED, UNREACH) that raw sockets would have received.
+ */
+static int prober_read_errors( prober_t* prober )
+{
+	uint32_t buffer[ 1024 / sizeof(uint32_t) ];
+	int completed = 0;
+	uint32_t key;
+	uint64_t timestamp;
+	ssize_t length;
+
+	while( (length = nu_recv_error( prober->socket, buffer, sizeof(buffer), &key, &timestamp )) >= 0 )
+	{
+		if( length > 0 )
+		{
+			completed += prober_handle( prober, buffer, length, timestamp, nu_monotonic_ns( ) );
+		}
+		else if( prober->timestamping )
+		{
+			uint32_t index = prober->tx_table[ key & prober->table_mask ];
+
+			/* A probe may have completed (and its slot been reused) already. */
+			if( index != NU_PROBE_NONE && prober->probes[ index ].tx_key == key )
+			{
+				prober->probes[ index ].tx_stamp = timestamp;
+			}
+		}
+	}
+
+	return completed;
+}
+
+static int prober_receive( prober_t* prober )
+{
+	int completed = 0;
+	int received;
+
+	while( (received = nu_recv_batch( prober->socket, prober->ring, MSG_DONTWAIT )) > 0 )
+	{
+		uint64_t now = nu_monotonic_ns( );
+
+		for( int i = 0; i < received; i++ )
+		{
+			size_t length;
+			struct sockaddr_in from;
+			void* buffer = (void*) nu_recv_ring_buffer( prober->ring, i, &length, &from );
+
+			if( prober->datagram )
+			{
+				nu_icmp_dgram_header( buffer, length - NU_IP4_HDRLEN, from.sin_addr );
+			}
+
+			completed += prober_handle( prober, buffer, length, nu_recv_ring_timestamp( prober->ring, i ), now );
+		}
+
+		if( (size_t) received < nu_recv_ring_count( prober->ring ) )
+		{
+			break;
+		}
+	}
+
+	return completed;
+}
+
+static int prober_receive_capture( prober_t* prober )
+{
+	int completed = 0;
+
+	while( nu_packet_ring_block( prober->capture ) )
+	{
+		/* Frames carry their kernel receive time, which is what latency
+		 * should count to rather than when the block was handed over. */
+		struct timespec realtime;
+		clock_gettime( CLOCK_REALTIME, &realtime );
+		uint64_t now      = nu_monotonic_ns( );
+		uint64_t realnow  = (uint64_t) realtime.tv_sec * 1000000000ULL + realtime.tv_nsec;
+		packet_frame_t frame;
+
+		while( nu_packet_ring_frame( prober->capture, &frame ) )
+		{
+			uint64_t age = realnow > frame.timestamp ? realnow - frame.timestamp : 0;
+			completed += prober_handle( prober, frame.data, frame.length, frame.timestamp, age < now ? now - age : now );
+		}
+
+		nu_packet_ring_release( prober->capture );
+	}
+
+	return completed;
+}
+
+bool nu_prober_set_id( prober_t* prober, uint16_t id )
+{
+	/* A ping socket's id belongs to the kernel, and is unique already. */
+	if( prober->datagram || prober->in_flight > 0 )
+	{
+		return false;
+	}
+
+	prober->id = id;
+
+	if( prober->capture )
+	{
+		nu_icmp_set_filter( nu_packet_ring_fd( prober->capture ), id );
+	}
+	else
+	{
+		nu_icmp_set_filter( prober->socket, id );
+	}
+
+	return true;
+}
+
+bool nu_prober_set_packet_ring( prober_t* prober, bool enable, const char* interface )
+{
+	if( !enable )
+	{
+		if( prober->capture )
+		{
+			prober_receive_capture( prober );
+
+			#if defined(__linux__)
+			epoll_ctl( prober->event_fd, EPOLL_CTL_DEL, nu_packet_ring_fd( prober->capture ), NULL );
+			#endif
+			nu_packet_ring_destroy( &prober->capture );
+
+			/* Back to the socket, with the filter it had before. */
+			if( prober->datagram ) nu_set_drop_filter( prober->socket, false );
+			else nu_icmp_set_filter( prober->socket, prober->id );
+		}
+
+		return true;
+	}
+
+	if( prober->capture )
+	{
+		return true;
+	}
+
+	if( prober->uring_recv )
+	{
+		trace( "Replies already come through io_uring.\n" );
+		return false;
+	}
+
+	prober->capture = nu_packet_ring_create( interface, NU_PROBER_CAPTURE_BLOCK, NU_PROBER_CAPTURE_BLOCKS, NU_PROBER_CAPTURE_TIMEOUT );
+
+	/* The ring sees the same datagrams as a raw socket would, so the same
+	 * filter picks out our replies; ping sockets use their port as the id. */
+	if( !prober->capture || !nu_icmp_set_filter( nu_packet_ring_fd( prober->capture ), prober->id ) )
+	{
+		trace( "Unable to set up packet ring.\n" );
+		goto failed;
+	}
+
+	#if defined(__linux__)
+	struct epoll_event event = { .events = EPOLLIN, .data.fd = nu_packet_ring_fd( prober->capture ) };
+
+	if( epoll_ctl( prober->event_fd, EPOLL_CTL_ADD, event.data.fd, &event ) < 0 )
+	{
+		trace( "Unable to watch packet ring.\n" );
+		goto failed;
+	}
+	#endif
+
+	/* The socket keeps sending (and, for ping sockets, collecting errors),
+	 * but its copies of the replies are not needed any more. */
+	if( !nu_set_drop_filter( prober->socket, true ) )
+	{
+		trace( "Unable to set socket filter.\n" );
+		#if defined(__linux__)
+		epoll_ctl( prober->event_fd, EPOLL_CTL_DEL, nu_packet_ring_fd( prober->capture ), NULL );
+		#endif
+		goto failed;
+	}
+
+	prober_receive( prober );
+	return true;
+
+failed:
+	nu_packet_ring_destroy( &prober->capture );
+	return false;
+}
+
+/* A send failed after the fact; try once more unless the probe is gone. */
+static void prober_resend( prober_t* prober, const uring_completion_t* completion )
+{
+	uint32_t index = (uint32_t) completion->user_data;
+	uint16_t seq   = (uint16_t) (completion->user_data >> 32);
+	const probe_t* probe = &prober->probes[ index ];
+	size_t slot = probe_lookup( prober, probe->dst, probe->id, seq );
+
+	if( slot == SIZE_MAX || prober->table[ slot ] != index )
+	{
+		return;
+	}
+
+	struct sockaddr_in dst_addr;
+	nu_set_ipaddress( &dst_addr, probe->dst, 0 );
+
+	if( nu_icmp_sendto( prober->socket, prober->datagram, prober->tx_buffers + (size_t) index * prober->tx_size, prober->tx_size, &dst_addr, probe->ttl ) < 0 )
+	{
+		trace( "Unable to send ICMP packet [errno = %d].\n", errno );
+	}
+}
+
+static int prober_reap( prober_t* prober )
+{
+	uring_completion_t completions[ NU_PROBER_RING_SIZE ];
+	int completed = 0;
+	int count;
+
+	while( (count = nu_uring_wait( prober->uring, completions, NU_PROBER_RING_SIZE, 0 )) > 0 )
+	{
+		uint64_t now = nu_monotonic_ns( );
+
+		for( int i = 0; i < count; i++ )
+		{
+			const uring_completion_t* completion = &completions[ i ];
+
+			if( completion->user_data != NU_PROBER_URING_RECV )
+			{
+				if( completion->result < 0 ) prober_resend( prober, completion );
+				continue;
+			}
+
+			size_t length;
+			struct sockaddr_in from;
+			uint64_t timestamp;
+			uint8_t* buffer = (uint8_t*) nu_uring_buffer( prober->uring, completion, &length, &from, &timestamp );
+
+			if( buffer )
+			{
+				if( prober->datagram )
+				{
+					/* NU_URING_HEADROOM leaves room for the IP header. */
+					buffer -= NU_IP4_HDRLEN;
+					nu_icmp_dgram_header( buffer, length, from.sin_addr );
+					length += NU_IP4_HDRLEN;
+				}
+
+				completed += prober_handle( prober, buffer, length, timestamp, now );
+				nu_uring_release_buffer( prober->uring, completion );
+			}
+
+			if( !completion->more && prober->uring_recv )
+			{
+				/* Running out of buffers, or a pending socket error, ends a
+				 * multishot receive; kernels without it refuse outright. */
+				bool unsupported = completion->result == -EINVAL || completion->result == -EOPNOTSUPP;
+
+				if( unsupported || !prober_arm_receive( prober ) )
+				{
+					trace( "Multishot receive unavailable [result = %d].\n", completion->result );
+					prober->uring_recv = false;
+					prober_watch_socket( prober, EPOLLIN );
+				}
+			}
+		}
+
+		if( count < NU_PROBER_RING_SIZE )
+		{
+			break;
+		}
+	}
+
+	return completed;
+}
+
+static int prober_expire( prober_t* prober, uint64_t now )
+{
+	int expired = 0;
+
+	while( prober->oldest != NU_PROBE_NONE )
+	{
+		uint32_t index = prober->oldest;
+		const probe_t* probe = &prober->probes[ index ];
+
+		if( now - probe->sent < prober->timeout )
+		{
+			break;
+		}
+
+		probe_result_t result = {
+			.dst       = probe->dst,
+			.from      = { .s_addr = INADDR_ANY },
+			.id        = probe->id,
+			.seq       = probe->seq,
+			.ttl       = probe->ttl,
+			.icmp_type = 0,
+			.icmp_code = 0,
+			.timed_out = true,
+			.latency   = 0.0,
+			.user_data = probe->user_data
+		};
+
+		probe_table_remove( prober, probe_lookup( prober, probe->dst, probe->id, probe->seq ) );
+		probe_release( prober, index );
+		prober_complete( prober, &result );
+		expired += 1;
+	}
+
+	return expired;
+}
+
+int nu_prober_expire_all( prober_t* prober )
+{
+	return prober_expire( prober, UINT64_MAX );
+}
+
+int nu_prober_poll( prober_t* prober, uint32_t timeout )
+{
+	if( prober->uring )
+	{
+		prober_flush( prober );
+	}
+
+	uint64_t now  = nu_monotonic_ns( );
+	int wait_time = timeout;
+
+	/* Don't sleep past the next deadline. */
+	if( prober->oldest != NU_PROBE_NONE )
+	{
+		uint64_t deadline = prober->probes[ prober->oldest ].sent + prober->timeout;
+		uint64_t remaining = deadline > now ? (deadline - now + 999999ULL) / 1000000ULL : 0;
+
+		if( remaining < (uint64_t) wait_time ) wait_time = (int) remaining;
+	}
+
+	#if defined(__linux__)
+	struct epoll_event event;
+	int ready = epoll_wait( prober->event_fd, &event, 1, wait_time );
+	#else
+	struct pollfd fd = { .fd = prober->socket, .events = POLLIN, .revents = 0 };
+	int ready = poll( &fd, 1, wait_time );
+	#endif
+
+	if( ready < 0 && errno != EINTR )
+	{
+		trace( "Unable to wait for replies [errno = %d].\n", errno );
+		return -1;
+	}
+
+	int completed = 0;
+
+	if( ready > 0 )
+	{
+		if( prober->timestamping || prober->datagram )
+		{
+			/* Also keeps a full error queue from waking us up for nothing. */
+			completed += prober_read_errors( prober );
+		}
+
+		if( prober->uring )
+		{
+			completed += prober_reap( prober );
+		}
+
+		if( prober->capture )
+		{
+			completed += prober_receive_capture( prober );
+		}
+		else if( !prober->uring_recv )
+		{
+			completed += prober_receive( prober );
+		}
+	}
+
+	completed += prober_expire( prober, nu_monotonic_ns( ) );
+	return completed;
+}
+
+bool nu_prober_next( prober_t* prober, probe_result_t* result )
+{
+	if( prober->completions_count == 0 )
+	{
+		return false;
+	}
+
+	*result = prober->completions[ prober->completions_head ];
+	prober->completions_head   = (prober->completions_head + 1) % prober->completions_capacity;
+	prober->completions_count -= 1;
+	return true;
+}
@@ -21,7 +21,10 @@
 #include <stdint.h>
 #include <errno.h>
 #include <assert.h>
+#include <string.h>
+#include <sys/uio.h>
 #include "netutils.h"
+#include "netutils-internal.h"
 
 bool nu_recv( int socket, void* data, size_t size )
 {
@@ -70,3 +73,32 @@ nu_result_t nu_recv_async( int socket, void* data, size_t size )
 
     return NU_SUCCESS;
 }
+
+bool nu_recvv( int socket, const struct iovec iov[], int count )
+{
+	int index     = 0;
+	size_t offset = 0;
+
+	nu_iov_consume( iov, count, &index, &offset, 0 );
+
+	while( index < count )
+	{
+		struct iovec window[ NU_IOV_WINDOW ];
+		struct msghdr message;
+		memset( &message, 0, sizeof(message) );
+		message.msg_iov    = window;
+		message.msg_iovlen = nu_iov_window( window, iov, count, index, offset );
+
+		ssize_t rv = recvmsg( socket, &message, 0 );
+
+		if( rv <= 0 )
+		{
+			/* an error, or the tcp connection was closed by peer */
+			return false;
+		}
+
+		nu_iov_consume( iov, count, &index, &offset, (size_t) rv );
+	}
+
+	return true;
+}
@@ -0,0 +1,1127 @@
+/* Copyright (C) 2013 by Joseph A. Marrero, https://joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#endif
+#include "netutils.h"
+#include "netutils-internal.h"
+
+#define NU_RESOLVER_MAX_IN_FLIGHT  4096
+#define NU_RESOLVER_MAX_SERVERS    3          /* MAXNS */
+#define NU_RESOLVER_ATTEMPTS       2          /* per nameserver, unless resolv.conf says otherwise */
+#define NU_RESOLVER_NEGATIVE_TTL   60         /* for negative answers without an SOA record */
+#define NU_RESOLVER_MAX_TTL        86400
+#define NU_RESOLVER_CACHE_BUCKETS  4096
+#define NU_RESOLVER_CACHE_MAX      65536
+#define NU_RESOLVER_HOSTS_CHECK    5          /* seconds between looks at /etc/hosts */
+#define NU_RESOLVER_CONF           "/etc/resolv.conf"
+#define NU_RESOLVER_HOSTS          "/etc/hosts"
+#define NU_RESOLVER_MAX_REFUSED    64         /* refusals handled per nu_resolver_poll() */
+#define NU_QUERY_NONE              UINT32_MAX
+
+#define NU_DNS_PORT                53
+#define NU_DNS_HDRLEN              12
+#define NU_DNS_MAXPACKET           1500
+#define NU_DNS_TYPE_A              1
+#define NU_DNS_TYPE_SOA            6
+#define NU_DNS_CLASS_IN            1
+#define NU_DNS_FLAG_QR             0x8000
+#define NU_DNS_FLAG_TC             0x0200
+#define NU_DNS_FLAG_RD             0x0100
+#define NU_DNS_RCODE(flags)        ((flags) & 0x000f)
+#define NU_DNS_RCODE_NOERROR       0
+#define NU_DNS_RCODE_NXDOMAIN      3
+
+/*
+ * The cache.  Answers from every resolver in the process land in one hash
+ * table, each with its expiry time; /etc/hosts is parsed into a second table
+ * that never expires but is re-read when the file changes.
+ */
+typedef struct cache_entry {
+	struct cache_entry* next;
+	uint64_t expires;   /* CLOCK_MONOTONIC, in nanoseconds */
+	struct in_addr address;
+	bool found;
+	char name[];
+} cache_entry_t;
+
+static struct {
+	pthread_mutex_t lock;
+	cache_entry_t* entries[ NU_RESOLVER_CACHE_BUCKETS ];
+	size_t count;
+	cache_entry_t* hosts[ NU_RESOLVER_CACHE_BUCKETS ];
+	uint64_t hosts_checked;
+	struct timespec hosts_mtime;
+	off_t hosts_size;
+} cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Queries in flight.  A query owns a random DNS id for as long as it waits;
+ * by_id maps ids back to queries.  A duplicate name doesn't get a query of
+ * its own but follows the one already in flight and completes with it.
+ */
+typedef struct query {
+	char name[ NU_HOSTNAME_MAX + 1 ];
+	void* user_data;
+	uint64_t retry;     /* next resend, or the deadline on the last attempt */
+	uint16_t id;
+	uint8_t attempt;
+	bool active;
+	bool primary;       /* sends queries; otherwise a follower */
+	uint32_t followers;
+	uint32_t next;      /* free list, or the follower chain */
+} query_t;
+
+struct resolver {
+	int socket;
+	uint64_t timeout;   /* in nanoseconds, over all attempts */
+	unsigned attempts;
+	struct sockaddr_in servers[ NU_RESOLVER_MAX_SERVERS ];
+	size_t server_count;
+	resolver_callback_t callback;
+	void* context;
+
+	query_t* queries;
+	size_t max_in_flight;
+	size_t in_flight;
+	uint32_t free_list;
+	uint16_t* by_id;    /* query index + 1, or 0 */
+
+	resolve_result_t* completions;
+	size_t completions_capacity;
+	size_t completions_head;
+	size_t completions_count;
+};
+
+static size_t name_hash( const char* name )
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261u;
+
+	while( *name )
+	{
+		hash = (hash ^ (uint8_t) *name++) * 16777619u;
+	}
+
+	return hash % NU_RESOLVER_CACHE_BUCKETS;
+}
+
+/* Lower case, without a trailing dot; false unless it's a valid name. */
+static bool name_normalize( const char* hostname, char name[ NU_HOSTNAME_MAX + 1 ] )
+{
+	size_t length = strlen( hostname );
+	size_t label  = 0;
+
+	if( length > 0 && hostname[ length - 1 ] == '.' )
+	{
+		length -= 1;
+	}
+
+	if( length == 0 || length > NU_HOSTNAME_MAX )
+	{
+		return false;
+	}
+
+	for( size_t i = 0; i < length; i++ )
+	{
+		char c = hostname[ i ];
+
+		if( c == '.' )
+		{
+			if( label == 0 ) return false;
+			label = 0;
+		}
+		else if( ++label > 63 || c == '\0' || isspace( (unsigned char) c ) )
+		{
+			return false;
+		}
+
+		name[ i ] = (char) tolower( (unsigned char) c );
+	}
+
+	name[ length ] = '\0';
+	return true;
+}
+
+static void cache_free_table( cache_entry_t* table[] )
+{
+	for( size_t i = 0; i < NU_RESOLVER_CACHE_BUCKETS; i++ )
+	{
+		while( table[ i ] )
+		{
+			cache_entry_t* entry = table[ i ];
+			table[ i ] = entry->next;
+			free( entry );
+		}
+	}
+}
+
+static cache_entry_t* cache_find( cache_entry_t* table[], const char* name )
+{
+	for( cache_entry_t* entry = table[ name_hash( name ) ]; entry; entry = entry->next )
+	{
+		if( strcmp( entry->name, name ) == 0 )
+		{
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static cache_entry_t* cache_entry_create( const char* name, bool found, struct in_addr address, uint64_t expires )
+{
+	size_t length = strlen( name ) + 1;
+	cache_entry_t* entry = (cache_entry_t*) malloc( sizeof(cache_entry_t) + length );
+
+	if( entry )
+	{
+		entry->next    = NULL;
+		entry->expires = expires;
+		entry->address = address;
+		entry->found   = found;
+		memcpy( entry->name, name, length );
+	}
+
+	return entry;
+}
+
+/* Called with the cache locked. */
+static void hosts_reload( uint64_t now )
+{
+	if( cache.hosts_checked && now - cache.hosts_checked < NU_RESOLVER_HOSTS_CHECK * 1000000000ULL )
+	{
+		return;
+	}
+
+	cache.hosts_checked = now;
+
+	struct stat info;
+	if( stat( NU_RESOLVER_HOSTS, &info ) < 0 )
+	{
+		memset( &info, 0, sizeof(info) );
+	}
+
+	if( info.st_mtim.tv_sec == cache.hosts_mtime.tv_sec && info.st_mtim.tv_nsec == cache.hosts_mtime.tv_nsec && info.st_size == cache.hosts_size )
+	{
+		return;
+	}
+
+	cache.hosts_mtime = info.st_mtim;
+	cache.hosts_size  = info.st_size;
+	cache_free_table( cache.hosts );
+
+	FILE* file = fopen( NU_RESOLVER_HOSTS, "r" );
+	char line[ 1024 ];
+
+	while( file && fgets( line, sizeof(line), file ) )
+	{
+		char* comment = strchr( line, '#' );
+		if( comment ) *comment = '\0';
+
+		char* save    = NULL;
+		char* address = strtok_r( line, " \t\r\n", &save );
+		struct in_addr ip;
+
+		/* IPv6 lines are skipped, like everything else that isn't IPv4. */
+		if( !address || inet_pton( AF_INET, address, &ip ) != 1 )
+		{
+			continue;
+		}
+
+		for( char* alias = strtok_r( NULL, " \t\r\n", &save ); alias; alias = strtok_r( NULL, " \t\r\n", &save ) )
+		{
+			char name[ NU_HOSTNAME_MAX + 1 ];
+
+			/* The first line naming a host wins. */
+			if( !name_normalize( alias, name ) || cache_find( cache.hosts, name ) )
+			{
+				continue;
+			}
+
+			cache_entry_t* entry = cache_entry_create( name, true, ip, UINT64_MAX );
+
+			if( entry )
+			{
+				size_t bucket = name_hash( name );
+				entry->next = cache.hosts[ bucket ];
+				cache.hosts[ bucket ] = entry;
+			}
+		}
+	}
+
+	if( file ) fclose( file );
+}
+
+static bool cache_lookup( resolve_result_t* result )
+{
+	uint64_t now = nu_monotonic_ns( );
+	bool hit     = false;
+
+	pthread_mutex_lock( &cache.lock );
+	hosts_reload( now );
+
+	cache_entry_t* entry = cache_find( cache.hosts, result->hostname );
+
+	if( !entry )
+	{
+		size_t bucket = name_hash( result->hostname );
+
+		for( cache_entry_t** p_entry = &cache.entries[ bucket ]; *p_entry; p_entry = &(*p_entry)->next )
+		{
+			if( strcmp( (*p_entry)->name, result->hostname ) != 0 )
+			{
+				continue;
+			}
+
+			if( (*p_entry)->expires <= now )
+			{
+				cache_entry_t* expired = *p_entry;
+				*p_entry = expired->next;
+				free( expired );
+				cache.count -= 1;
+				break;
+			}
+
+			entry = *p_entry;
+			break;
+		}
+	}
+
+	if( entry )
+	{
+		result->found     = entry->found;
+		result->address   = entry->address;
+		result->timed_out = false;
+		result->ttl       = entry->expires == UINT64_MAX ? UINT32_MAX : (uint32_t) ((entry->expires - now) / 1000000000ULL);
+		hit = true;
+	}
+
+	pthread_mutex_unlock( &cache.lock );
+	return hit;
+}
+
+/* Called with the cache locked. */
+static void cache_prune( uint64_t now )
+{
+	for( size_t i = 0; i < NU_RESOLVER_CACHE_BUCKETS; i++ )
+	{
+		for( cache_entry_t** p_entry = &cache.entries[ i ]; *p_entry; )
+		{
+			if( (*p_entry)->expires <= now )
+			{
+				cache_entry_t* expired = *p_entry;
+				*p_entry = expired->next;
+				free( expired );
+				cache.count -= 1;
+			}
+			else
+			{
+				p_entry = &(*p_entry)->next;
+			}
+		}
+	}
+}
+
+static void cache_store( const resolve_result_t* result )
+{
+	if( result->ttl == 0 )
+	{
+		return;
+	}
+
+	uint64_t now     = nu_monotonic_ns( );
+	uint64_t expires = now + (uint64_t) result->ttl * 1000000000ULL;
+	size_t bucket    = name_hash( result->hostname );
+
+	pthread_mutex_lock( &cache.lock );
+
+	cache_entry_t* entry = cache_find( cache.entries, result->hostname );
+
+	if( entry )
+	{
+		entry->expires = expires;
+		entry->address = result->address;
+		entry->found   = result->found;
+	}
+	else
+	{
+		if( cache.count >= NU_RESOLVER_CACHE_MAX )
+		{
+			cache_prune( now );
+		}
+
+		/* Still full of live entries: this one isn't kept. */
+		if( cache.count < NU_RESOLVER_CACHE_MAX && (entry = cache_entry_create( result->hostname, result->found, result->address, expires )) )
+		{
+			entry->next = cache.entries[ bucket ];
+			cache.entries[ bucket ] = entry;
+			cache.count += 1;
+		}
+	}
+
+	pthread_mutex_unlock( &cache.lock );
+}
+
+void nu_resolver_cache_clear( void )
+{
+	pthread_mutex_lock( &cache.lock );
+	cache_free_table( cache.entries );
+	cache_free_table( cache.hosts );
+	cache.count         = 0;
+	cache.hosts_checked = 0;
+	cache.hosts_size    = 0;
+	memset( &cache.hosts_mtime, 0, sizeof(cache.hosts_mtime) );
+	pthread_mutex_unlock( &cache.lock );
+}
+
+static void resolver_read_conf( resolver_t* resolver )
+{
+	FILE* file = fopen( NU_RESOLVER_CONF, "r" );
+	char line[ 1024 ];
+
+	while( file && fgets( line, sizeof(line), file ) )
+	{
+		char* save    = NULL;
+		char* keyword = strtok_r( line, " \t\r\n", &save );
+
+		if( !keyword || *keyword == '#' || *keyword == ';' )
+		{
+			continue;
+		}
+
+		if( strcmp( keyword, "nameserver" ) == 0 )
+		{
+			char* address = strtok_r( NULL, " \t\r\n", &save );
+			struct in_addr ip;
+
+			if( address && inet_pton( AF_INET, address, &ip ) == 1 && resolver->server_count < NU_RESOLVER_MAX_SERVERS )
+			{
+				nu_set_ipaddress( &resolver->servers[ resolver->server_count++ ], ip, NU_DNS_PORT );
+			}
+		}
+		else if( strcmp( keyword, "options" ) == 0 )
+		{
+			for( char* option = strtok_r( NULL, " \t\r\n", &save ); option; option = strtok_r( NULL, " \t\r\n", &save ) )
+			{
+				if( strncmp( option, "attempts:", 9 ) == 0 && atoi( option + 9 ) > 0 )
+				{
+					resolver->attempts = (unsigned) atoi( option + 9 );
+				}
+			}
+		}
+	}
+
+	if( file ) fclose( file );
+
+	if( resolver->server_count == 0 )
+	{
+		/* What resolv.conf(5) says to use without a nameserver line. */
+		nu_set_ipaddress( &resolver->servers[ 0 ], (struct in_addr) { .s_addr = htonl( INADDR_LOOPBACK ) }, NU_DNS_PORT );
+		resolver->server_count = 1;
+	}
+}
+
+resolver_t* nu_resolver_create( size_t max_in_flight, uint32_t timeout, resolver_callback_t callback, void* context )
+{
+	resolver_t* resolver = (resolver_t*) calloc( 1, sizeof(resolver_t) );
+
+	if( !resolver )
+	{
+		return NULL;
+	}
+
+	if( max_in_flight == 0 ) max_in_flight = 1;
+	if( max_in_flight > NU_RESOLVER_MAX_IN_FLIGHT ) max_in_flight = NU_RESOLVER_MAX_IN_FLIGHT;
+
+	resolver->socket        = -1;
+	resolver->timeout       = (uint64_t) timeout * 1000000ULL;
+	resolver->attempts      = NU_RESOLVER_ATTEMPTS;
+	resolver->callback      = callback;
+	resolver->context       = context;
+	resolver->max_in_flight = max_in_flight;
+	resolver->queries       = (query_t*) malloc( max_in_flight * sizeof(query_t) );
+	resolver->by_id         = (uint16_t*) calloc( UINT16_MAX + 1, sizeof(uint16_t) );
+
+	if( !resolver->queries || !resolver->by_id )
+	{
+		goto failed;
+	}
+
+	for( size_t i = 0; i < max_in_flight; i++ )
+	{
+		resolver->queries[ i ].active = false;
+		resolver->queries[ i ].next   = (i + 1 < max_in_flight) ? (uint32_t) (i + 1) : NU_QUERY_NONE;
+	}
+	resolver->free_list = 0;
+
+	resolver_read_conf( resolver );
+
+	resolver->socket = nu_udp_socket( );
+
+	if( resolver->socket < 0 )
+	{
+		trace( "Unable to create socket.\n" );
+		#if defined(DEBUG_NETUTILS)
+		perror( "ERROR" );
+		#endif
+		goto failed;
+	}
+
+	int flags = fcntl( resolver->socket, F_GETFL, 0 );
+	if( flags < 0 || fcntl( resolver->socket, F_SETFL, flags | O_NONBLOCK ) < 0 )
+	{
+		trace( "Unable to make socket non-blocking.\n" );
+		goto failed;
+	}
+
+	#if defined(__linux__)
+	/* An unconnected socket only hears that a nameserver is not listening
+	 * (port unreachable) through the error queue. */
+	const int on = 1;
+	setsockopt( resolver->socket, IPPROTO_IP, IP_RECVERR, &on, sizeof(on) );
+	#endif
+
+	return resolver;
+
+failed:
+	nu_resolver_destroy( &resolver );
+	return NULL;
+}
+
+void nu_resolver_destroy( resolver_t** p_resolver )
+{
+	if( p_resolver && *p_resolver )
+	{
+		resolver_t* resolver = *p_resolver;
+
+		if( resolver->socket >= 0 ) close( resolver->socket );
+		free( resolver->completions );
+		free( resolver->by_id );
+		free( resolver->queries );
+		free( resolver );
+		*p_resolver = NULL;
+	}
+}
+
+int nu_resolver_fd( const resolver_t* resolver )
+{
+	return resolver->socket;
+}
+
+size_t nu_resolver_in_flight( const resolver_t* resolver )
+{
+	return resolver->in_flight;
+}
+
+bool nu_resolver_set_nameservers( resolver_t* resolver, const struct sockaddr_in servers[], size_t count )
+{
+	if( count == 0 || count > NU_RESOLVER_MAX_SERVERS )
+	{
+		return false;
+	}
+
+	memcpy( resolver->servers, servers, count * sizeof(struct sockaddr_in) );
+	resolver->server_count = count;
+	return true;
+}
+
+/* Results are queued here, and handed to the callback from nu_resolver_poll(). */
+static void resolver_complete( resolver_t* resolver, const resolve_result_t* result )
+{
+	if( resolver->completions_count == resolver->completions_capacity )
+	{
+		size_t capacity = resolver->completions_capacity ? 2 * resolver->completions_capacity : 64;
+		resolve_result_t* completions = (resolve_result_t*) malloc( capacity * sizeof(resolve_result_t) );
+
+		if( !completions )
+		{
+			trace( "Dropping resolver result; out of memory.\n" );
+			return;
+		}
+
+		for( size_t i = 0; i < resolver->completions_count; i++ )
+		{
+			completions[ i ] = resolver->completions[ (resolver->completions_head + i) % resolver->completions_capacity ];
+		}
+
+		free( resolver->completions );
+		resolver->completions          = completions;
+		resolver->completions_capacity = capacity;
+		resolver->completions_head     = 0;
+	}
+
+	size_t tail = (resolver->completions_head + resolver->completions_count) % resolver->completions_capacity;
+	resolver->completions[ tail ] = *result;
+	resolver->completions_count += 1;
+}
+
+static void query_release( resolver_t* resolver, uint32_t index )
+{
+	query_t* query = &resolver->queries[ index ];
+
+	query->active       = false;
+	query->next         = resolver->free_list;
+	resolver->free_list = index;
+	resolver->in_flight -= 1;
+}
+
+/* Complete a query and everything following it. */
+static void query_finish( resolver_t* resolver, uint32_t index, resolve_result_t* result )
+{
+	query_t* query = &resolver->queries[ index ];
+	uint32_t follower = query->followers;
+
+	resolver->by_id[ query->id ] = 0;
+	result->user_data = query->user_data;
+	resolver_complete( resolver, result );
+	query_release( resolver, index );
+
+	while( follower != NU_QUERY_NONE )
+	{
+		uint32_t next = resolver->queries[ follower ].next;
+
+		result->user_data = resolver->queries[ follower ].user_data;
+		resolver_complete( resolver, result );
+		query_release( resolver, follower );
+		follower = next;
+	}
+}
+
+static size_t dns_query( uint8_t packet[], uint16_t id, const char* name )
+{
+	const uint16_t header[ 6 ] = { htons( id ), htons( NU_DNS_FLAG_RD ), htons( 1 ), 0, 0, 0 };
+	size_t length = NU_DNS_HDRLEN;
+
+	memcpy( packet, header, NU_DNS_HDRLEN );
+
+	while( *name )
+	{
+		const char* dot = strchr( name, '.' );
+		size_t label    = dot ? (size_t) (dot - name) : strlen( name );
+
+		packet[ length++ ] = (uint8_t) label;
+		memcpy( packet + length, name, label );
+		length += label;
+		name   += dot ? label + 1 : label;
+	}
+
+	packet[ length++ ] = 0;
+	packet[ length++ ] = 0;
+	packet[ length++ ] = NU_DNS_TYPE_A;
+	packet[ length++ ] = 0;
+	packet[ length++ ] = NU_DNS_CLASS_IN;
+	return length;
+}
+
+static bool query_send( resolver_t* resolver, query_t* query )
+{
+	uint8_t packet[ NU_DNS_HDRLEN + NU_HOSTNAME_MAX + 2 + 4 ];
+	size_t length = dns_query( packet, query->id, query->name );
+	size_t tries  = resolver->attempts * resolver->server_count;
+	const struct sockaddr_in* server = &resolver->servers[ query->attempt % resolver->server_count ];
+
+	query->retry = nu_monotonic_ns( ) + resolver->timeout / tries;
+
+	ssize_t sent = sendto( resolver->socket, packet, length, 0, (const struct sockaddr*) server, sizeof(*server) );
+
+	if( sent < 0 && errno == ECONNREFUSED )
+	{
+		/* A refusal of an earlier query, reported here once; this one wasn't sent. */
+		sent = sendto( resolver->socket, packet, length, 0, (const struct sockaddr*) server, sizeof(*server) );
+	}
+
+	if( sent < 0 )
+	{
+		/* The retry timer tries the next server. */
+		trace( "Unable to send DNS query [errno = %d].\n", errno );
+		return false;
+	}
+
+	return true;
+}
+
+/* Move on to the next attempt, or give up. */
+static int query_retry( resolver_t* resolver, uint32_t index )
+{
+	query_t* query = &resolver->queries[ index ];
+
+	if( query->attempt + 1u < resolver->attempts * resolver->server_count )
+	{
+		query->attempt += 1;
+		query_send( resolver, query );
+		return 0;
+	}
+
+	resolve_result_t result;
+	memset( &result, 0, sizeof(result) );
+	memcpy( result.hostname, query->name, sizeof(result.hostname) );
+	result.timed_out = true;
+	query_finish( resolver, index, &result );
+	return 1;
+}
+
+bool nu_resolver_submit( resolver_t* resolver, const char* hostname, void* user_data )
+{
+	resolve_result_t result;
+	memset( &result, 0, sizeof(result) );
+	result.user_data = user_data;
+
+	if( !name_normalize( hostname, result.hostname ) )
+	{
+		trace( "Invalid hostname.\n" );
+		return false;
+	}
+
+	/* Addresses and cached names complete at once. */
+	if( inet_pton( AF_INET, result.hostname, &result.address ) == 1 )
+	{
+		result.found = true;
+		result.ttl   = UINT32_MAX;
+		resolver_complete( resolver, &result );
+		return true;
+	}
+
+	if( cache_lookup( &result ) )
+	{
+		resolver_complete( resolver, &result );
+		return true;
+	}
+
+	if( resolver->free_list == NU_QUERY_NONE )
+	{
+		trace( "Too many names in flight.\n" );
+		return false;
+	}
+
+	uint32_t index      = resolver->free_list;
+	query_t* query      = &resolver->queries[ index ];
+	resolver->free_list = query->next;
+	resolver->in_flight += 1;
+
+	memcpy( query->name, result.hostname, sizeof(query->name) );
+	query->user_data = user_data;
+	query->active    = true;
+	query->primary   = false;
+	query->followers = NU_QUERY_NONE;
+	query->next      = NU_QUERY_NONE;
+
+	for( size_t i = 0; i < resolver->max_in_flight; i++ )
+	{
+		query_t* primary = &resolver->queries[ i ];
+
+		if( primary->active && primary->primary && strcmp( primary->name, query->name ) == 0 )
+		{
+			query->next        = primary->followers;
+			primary->followers = index;
+			return true;
+		}
+	}
+
+	uint16_t id;
+	do {
+		id = (uint16_t) nu_random( );
+	} while( resolver->by_id[ id ] != 0 );
+
+	query->id      = id;
+	query->attempt = 0;
+	query->primary = true;
+	resolver->by_id[ id ] = (uint16_t) (index + 1);
+
+	query_send( resolver, query );
+	return true;
+}
+
+/*
+ * Read a domain name, following compression pointers, into name (lower case,
+ * dotted) if given.  Returns the offset just past the name where it started,
+ * or 0 if it is malformed.
+ */
+static size_t dns_read_name( const uint8_t* packet, size_t length, size_t offset, char* name, size_t size )
+{
+	size_t end = 0;
+	size_t out = 0;
+	int jumps  = 0;
+
+	for( ;; )
+	{
+		if( offset >= length )
+		{
+			return 0;
+		}
+
+		uint8_t label = packet[ offset ];
+
+		if( (label & 0xc0) == 0xc0 )
+		{
+			if( offset + 1 >= length || ++jumps > 32 )
+			{
+				return 0;
+			}
+
+			if( !end ) end = offset + 2;
+			offset = ((size_t) (label & 0x3f) << 8) | packet[ offset + 1 ];
+			continue;
+		}
+		else if( label & 0xc0 )
+		{
+			return 0;
+		}
+		else if( label == 0 )
+		{
+			if( name ) name[ out ] = '\0';
+			return end ? end : offset + 1;
+		}
+
+		if( offset + 1 + label > length )
+		{
+			return 0;
+		}
+
+		if( name )
+		{
+			if( out + label + 2 > size )
+			{
+				return 0;
+			}
+
+			if( out > 0 ) name[ out++ ] = '.';
+
+			for( size_t i = 0; i < label; i++ )
+			{
+				name[ out++ ] = (char) tolower( packet[ offset + 1 + i ] );
+			}
+		}
+
+		offset += 1 + (size_t) label;
+	}
+}
+
+static inline uint16_t dns_read16( const uint8_t* p )
+{
+	return (uint16_t) ((p[ 0 ] << 8) | p[ 1 ]);
+}
+
+static inline uint32_t dns_read32( const uint8_t* p )
+{
+	return ((uint32_t) p[ 0 ] << 24) | ((uint32_t) p[ 1 ] << 16) | ((uint32_t) p[ 2 ] << 8) | p[ 3 ];
+}
+
+static bool resolver_known_server( const resolver_t* resolver, const struct sockaddr_in* from )
+{
+	for( size_t i = 0; i < resolver->server_count; i++ )
+	{
+		if( resolver->servers[ i ].sin_addr.s_addr == from->sin_addr.s_addr && resolver->servers[ i ].sin_port == from->sin_port )
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Match a response to its query and complete it; returns the results. */
+static int resolver_answer( resolver_t* resolver, const uint8_t* packet, size_t length, const struct sockaddr_in* from )
+{
+	if( length < NU_DNS_HDRLEN || !resolver_known_server( resolver, from ) )
+	{
+		return 0;
+	}
+
+	uint16_t id    = dns_read16( packet );
+	uint16_t flags = dns_read16( packet + 2 );
+	uint16_t slot  = resolver->by_id[ id ];
+
+	if( slot == 0 || !(flags & NU_DNS_FLAG_QR) || dns_read16( packet + 4 ) != 1 )
+	{
+		/* Not ours, or an answer to a query that already finished. */
+		return 0;
+	}
+
+	uint32_t index = slot - 1u;
+	query_t* query = &resolver->queries[ index ];
+	char name[ NU_HOSTNAME_MAX + 2 ];
+	size_t offset = dns_read_name( packet, length, NU_DNS_HDRLEN, name, sizeof(name) );
+
+	if( offset == 0 || offset + 4 > length || strcmp( name, query->name ) != 0 ||
+	    dns_read16( packet + offset ) != NU_DNS_TYPE_A || dns_read16( packet + offset + 2 ) != NU_DNS_CLASS_IN )
+	{
+		return 0;
+	}
+
+	offset += 4;
+
+	uint16_t rcode = NU_DNS_RCODE(flags);
+
+	if( rcode != NU_DNS_RCODE_NOERROR && rcode != NU_DNS_RCODE_NXDOMAIN )
+	{
+		/* SERVFAIL, REFUSED and the like: another server may do better. */
+		return query_retry( resolver, index );
+	}
+
+	resolve_result_t result;
+	memset( &result, 0, sizeof(result) );
+	memcpy( result.hostname, query->name, sizeof(result.hostname) );
+
+	uint32_t ttl          = NU_RESOLVER_MAX_TTL;
+	uint32_t negative_ttl = NU_RESOLVER_NEGATIVE_TTL;
+	size_t answers        = dns_read16( packet + 6 );
+	size_t authorities    = dns_read16( packet + 8 );
+
+	for( size_t i = 0; i < answers + authorities; i++ )
+	{
+		offset = dns_read_name( packet, length, offset, NULL, 0 );
+
+		if( offset == 0 || offset + 10 > length )
+		{
+			break;
+		}
+
+		uint16_t type      = dns_read16( packet + offset );
+		uint16_t rr_class  = dns_read16( packet + offset + 2 );
+		uint32_t rr_ttl    = dns_read32( packet + offset + 4 );
+		size_t   rd_length = dns_read16( packet + offset + 8 );
+		const uint8_t* rd  = packet + offset + 10;
+
+		offset += 10 + rd_length;
+
+		if( offset > length )
+		{
+			break;
+		}
+
+		if( i < answers )
+		{
+			/* The answer is only as fresh as the CNAMEs leading to it. */
+			if( rr_ttl < ttl ) ttl = rr_ttl;
+
+			if( type == NU_DNS_TYPE_A && rr_class == NU_DNS_CLASS_IN && rd_length == 4 && !result.found )
+			{
+				memcpy( &result.address, rd, 4 );
+				result.found = true;
+			}
+		}
+		else if( type == NU_DNS_TYPE_SOA && rd_length >= 20 )
+		{
+			/* RFC 2308: the lesser of the SOA's own TTL and its MINIMUM. */
+			uint32_t minimum = dns_read32( rd + rd_length - 4 );
+			negative_ttl = rr_ttl < minimum ? rr_ttl : minimum;
+		}
+	}
+
+	if( !result.found && (flags & NU_DNS_FLAG_TC) )
+	{
+		/* The address didn't fit; no TCP fallback here. */
+		return query_retry( resolver, index );
+	}
+
+	result.ttl = result.found ? ttl : negative_ttl;
+	if( result.ttl > NU_RESOLVER_MAX_TTL ) result.ttl = NU_RESOLVER_MAX_TTL;
+
+	cache_store( &result );
+	query_finish( resolver, index, &result );
+	return 1;
+}
+
+/*
+ * Read the error queue.  A query that a nameserver refused (ICMP port
+ * unreachable) moves on to its next attempt straight away instead of
+ * waiting out its retry timer.  The error hands back the query that caused
+ * it, so its DNS id, and where it went; a refusal of an earlier attempt is
+ * ignored.  Retries are sent once the queue is empty, since a send fails
+ * while an error is pending.
+ */
+static void resolver_read_errors( resolver_t* resolver )
+{
+	#if defined(__linux__)
+	uint32_t refused[ NU_RESOLVER_MAX_REFUSED ];
+	size_t refused_count = 0;
+
+	for( ;; )
+	{
+		uint8_t packet[ NU_DNS_MAXPACKET ];
+		union {
+			struct cmsghdr align;
+			uint8_t buffer[ CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in)) ];
+		} control;
+		struct sockaddr_in to;
+		struct iovec iov = { .iov_base = packet, .iov_len = sizeof(packet) };
+		struct msghdr message;
+		memset( &message, 0, sizeof(message) );
+		memset( &to, 0, sizeof(to) );
+		message.msg_name       = &to;
+		message.msg_namelen    = sizeof(to);
+		message.msg_iov        = &iov;
+		message.msg_iovlen     = 1;
+		message.msg_control    = control.buffer;
+		message.msg_controllen = sizeof(control.buffer);
+
+		ssize_t length = recvmsg( resolver->socket, &message, MSG_ERRQUEUE | MSG_DONTWAIT );
+
+		if( length < 0 )
+		{
+			break;
+		}
+
+		for( struct cmsghdr* cmsg = CMSG_FIRSTHDR( &message ); cmsg; cmsg = CMSG_NXTHDR( &message, cmsg ) )
+		{
+			struct sock_extended_err error;
+
+			if( cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR || length < NU_DNS_HDRLEN )
+			{
+				continue;
+			}
+
+			memcpy( &error, CMSG_DATA(cmsg), sizeof(error) );
+			uint16_t slot = resolver->by_id[ dns_read16( packet ) ];
+
+			if( error.ee_errno != ECONNREFUSED || slot == 0 )
+			{
+				continue;
+			}
+
+			const query_t* query = &resolver->queries[ slot - 1u ];
+			const struct sockaddr_in* server = &resolver->servers[ query->attempt % resolver->server_count ];
+			size_t i = 0;
+
+			if( to.sin_addr.s_addr != server->sin_addr.s_addr || to.sin_port != server->sin_port )
+			{
+				continue;
+			}
+
+			while( i < refused_count && refused[ i ] != slot - 1u ) i++;
+
+			if( i == refused_count && refused_count < NU_RESOLVER_MAX_REFUSED )
+			{
+				refused[ refused_count++ ] = slot - 1u;
+			}
+		}
+	}
+
+	for( size_t i = 0; i < refused_count; i++ )
+	{
+		/* Queries can't finish while the queue is read, so every index is still in flight. */
+		query_retry( resolver, refused[ i ] );
+	}
+	#endif
+}
+
+int nu_resolver_poll( resolver_t* resolver, uint32_t timeout )
+{
+	uint64_t now  = nu_monotonic_ns( );
+	int wait_time = timeout;
+
+	/* Don't sleep past the next resend, or on results already here. */
+	if( resolver->completions_count > 0 )
+	{
+		wait_time = 0;
+	}
+
+	for( size_t i = 0; i < resolver->max_in_flight; i++ )
+	{
+		const query_t* query = &resolver->queries[ i ];
+
+		if( query->active && query->primary )
+		{
+			uint64_t remaining = query->retry > now ? (query->retry - now + 999999ULL) / 1000000ULL : 0;
+			if( remaining < (uint64_t) wait_time ) wait_time = (int) remaining;
+		}
+	}
+
+	struct pollfd fd = { .fd = resolver->socket, .events = POLLIN, .revents = 0 };
+	int ready = poll( &fd, 1, wait_time );
+
+	if( ready < 0 && errno != EINTR )
+	{
+		trace( "Unable to wait for answers [errno = %d].\n", errno );
+		return -1;
+	}
+
+	if( ready > 0 && (fd.revents & POLLERR) )
+	{
+		resolver_read_errors( resolver );
+	}
+
+	while( ready > 0 )
+	{
+		uint8_t packet[ NU_DNS_MAXPACKET ];
+		struct sockaddr_in from;
+		socklen_t from_length = sizeof(from);
+		ssize_t length = recvfrom( resolver->socket, packet, sizeof(packet), MSG_DONTWAIT, (struct sockaddr*) &from, &from_length );
+
+		if( length < 0 )
+		{
+			break;
+		}
+
+		resolver_answer( resolver, packet, (size_t) length, &from );
+	}
+
+	now = nu_monotonic_ns( );
+
+	for( size_t i = 0; i < resolver->max_in_flight; i++ )
+	{
+		const query_t* query = &resolver->queries[ i ];
+
+		if( query->active && query->primary && query->retry <= now )
+		{
+			query_retry( resolver, (uint32_t) i );
+		}
+	}
+
+	int completed = (int) resolver->completions_count;
+
+	if( resolver->callback )
+	{
+		resolve_result_t result;
+
+		while( nu_resolver_next( resolver, &result ) )
+		{
+			resolver->callback( &result, resolver->context );
+		}
+	}
+
+	return completed;
+}
+
+bool nu_resolver_next( resolver_t* resolver, resolve_result_t* result )
+{
+	if( resolver->completions_count == 0 )
+	{
+		return false;
+	}
+
+	*result = resolver->completions[ resolver->completions_head ];
+	resolver->completions_head   = (resolver->completions_head + 1) % resolver->completions_capacity;
+	resolver->completions_count -= 1;
+	return true;
+}
@@ -21,7 +21,10 @@
 #include <stdint.h>
 #include <errno.h>
 #include <assert.h>
+#include <string.h>
+#include <sys/uio.h>
 #include "netutils.h"
+#include "netutils-internal.h"
 
 bool nu_send( int socket, const uint8_t* data, size_t size )
 {
@@ -70,3 +73,87 @@ nu_result_t nu_send_async( int socket, const void* data, size_t size )
     return NU_SUCCESS;
 }
 
+
+static bool nu_sendv_flags( int socket, const struct iovec iov[], int count, int flags, zerocopy_t* zerocopy )
+{
+	int index     = 0;
+	size_t offset = 0;
+
+	nu_iov_consume( iov, count, &index, &offset, 0 );
+
+	while( index < count )
+	{
+		struct iovec window[ NU_IOV_WINDOW ];
+		struct msghdr message;
+		memset( &message, 0, sizeof(message) );
+		message.msg_iov    = window;
+		message.msg_iovlen = nu_iov_window( window, iov, count, index, offset );
+
+		ssize_t sent_bytes = sendmsg( socket, &message, flags );
+
+		if( sent_bytes < 0 && zerocopy && errno == ENOBUFS )
+		{
+			/* Too many sends waiting on notifications (optmem_max).  With
+			 * none of ours pending, waiting would not free anything. */
+			if( zerocopy->sent == zerocopy->completed )
+			{
+				errno = ENOBUFS;
+				return false;
+			}
+
+			if( nu_zerocopy_reap( socket, zerocopy, -1 ) < 0 )
+			{
+				return false;
+			}
+			continue;
+		}
+
+		if( sent_bytes <= 0 )
+		{
+			return false;
+		}
+
+		if( zerocopy )
+		{
+			zerocopy->sent += 1;
+		}
+
+		nu_iov_consume( iov, count, &index, &offset, (size_t) sent_bytes );
+	}
+
+	return true;
+}
+
+bool nu_sendv( int socket, const struct iovec iov[], int count )
+{
+	return nu_sendv_flags( socket, iov, count, 0, NULL );
+}
+
+bool nu_set_zerocopy( int socket, bool enable )
+{
+	#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+	const int option = enable;
+	return setsockopt( socket, SOL_SOCKET, SO_ZEROCOPY, &option, sizeof(option) ) == 0;
+	#else
+	return !enable;
+	#endif
+}
+
+bool nu_sendv_zerocopy( int socket, const struct iovec iov[], int count, zerocopy_t* zerocopy )
+{
+	#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+	/* Without SO_ZEROCOPY the kernel ignores MSG_ZEROCOPY and never reports
+	 * back, so those sends must not be counted as pending. */
+	int enabled      = 0;
+	socklen_t length = sizeof(enabled);
+
+	if( getsockopt( socket, SOL_SOCKET, SO_ZEROCOPY, &enabled, &length ) < 0 || !enabled )
+	{
+		return nu_sendv_flags( socket, iov, count, 0, NULL );
+	}
+
+	return nu_sendv_flags( socket, iov, count, MSG_ZEROCOPY, zerocopy );
+	#else
+	return nu_sendv_flags( socket, iov, count, 0, NULL );
+	#endif
+}
@@ -0,0 +1,277 @@
+/* Copyright (C) 2013 by Joseph A. Marrero, https://joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* splice, pipe2, F_SETPIPE_SZ */
+#endif
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+#include "netutils.h"
+
+#define NU_SEND_FILE_CHUNK  (64 * 1024)       /* per read() without sendfile() */
+#define NU_SPLICE_PIPE_SIZE (1024 * 1024)
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+/*
+ * One step of a file send: returns the bytes sent, 0 at the end of the file,
+ * or -1 with errno set.
+ */
+static ssize_t send_file_chunk( int socket, int fd, off_t offset, size_t size, int flags )
+{
+	#if defined(__linux__)
+	(void) flags; /* sendfile() honours the socket's O_NONBLOCK only */
+	return sendfile( socket, fd, &offset, size );
+	#else
+	uint8_t buffer[ NU_SEND_FILE_CHUNK ];
+	ssize_t length = pread( fd, buffer, size < sizeof(buffer) ? size : sizeof(buffer), offset );
+
+	if( length <= 0 )
+	{
+		return length;
+	}
+
+	/* Whatever the socket doesn't take is read again next time. */
+	return send( socket, buffer, (size_t) length, flags | MSG_NOSIGNAL );
+	#endif
+}
+
+bool nu_send_file( int socket, int fd, off_t offset, size_t size )
+{
+	while( size > 0 )
+	{
+		ssize_t sent_bytes = send_file_chunk( socket, fd, offset, size, 0 );
+
+		if( sent_bytes < 0 && errno == EINTR )
+		{
+			continue;
+		}
+
+		if( sent_bytes <= 0 )
+		{
+			/* an error, or the file is shorter than size */
+			return false;
+		}
+
+		offset += sent_bytes;
+		size   -= (size_t) sent_bytes;
+	}
+
+	return true;
+}
+
+nu_result_t nu_send_file_async( int socket, int fd, off_t* p_offset, size_t* p_remaining )
+{
+	while( *p_remaining > 0 )
+	{
+		ssize_t sent_bytes = send_file_chunk( socket, fd, *p_offset, *p_remaining, MSG_DONTWAIT );
+
+		if( sent_bytes > 0 )
+		{
+			*p_offset    += sent_bytes;
+			*p_remaining -= (size_t) sent_bytes;
+			continue;
+		}
+
+		if( sent_bytes == 0 )
+		{
+			/* the file is shorter than expected */
+			errno = 0;
+			return NU_FAILED;
+		}
+
+		switch( errno )
+		{
+			case EINTR: // interrupted by signal...
+				continue;
+			case EAGAIN: // EWOULDBLOCK
+				return NU_TRYAGAIN;
+			case ENOTSOCK: // client socket is not a socket.
+			case EINVAL: // invalid argument passed, or fd can't be mmap()ed.
+			case EBADF:  // bad socket/file descriptor
+				assert( false ); // these are programming errors
+			case EPIPE:
+			default:
+				return NU_FAILED;
+		}
+	}
+
+	return NU_SUCCESS;
+}
+
+bool nu_splice_init( splice_cursor_t* cursor, int in, int out, size_t size )
+{
+	cursor->in          = in;
+	cursor->out         = out;
+	cursor->pipe[ 0 ]   = -1;
+	cursor->pipe[ 1 ]   = -1;
+	cursor->size        = size;
+	cursor->offset      = 0;
+	cursor->buffered    = 0;
+	cursor->wait_fd     = in;
+	cursor->wait_events = POLLIN;
+
+	#if defined(__linux__)
+	struct stat info;
+
+	if( fstat( in, &info ) < 0 )
+	{
+		return false;
+	}
+
+	if( !S_ISFIFO(info.st_mode) )
+	{
+		if( pipe2( cursor->pipe, O_NONBLOCK | O_CLOEXEC ) < 0 )
+		{
+			trace( "Unable to create pipe [errno = %d].\n", errno );
+			return false;
+		}
+
+		/* A bigger pipe means fewer trips through it; it's only a hint. */
+		fcntl( cursor->pipe[ 1 ], F_SETPIPE_SZ, NU_SPLICE_PIPE_SIZE );
+	}
+
+	return true;
+	#else
+	errno = ENOSYS;
+	return false;
+	#endif
+}
+
+void nu_splice_destroy( splice_cursor_t* cursor )
+{
+	if( cursor->pipe[ 0 ] >= 0 ) close( cursor->pipe[ 0 ] );
+	if( cursor->pipe[ 1 ] >= 0 ) close( cursor->pipe[ 1 ] );
+	cursor->pipe[ 0 ] = -1;
+	cursor->pipe[ 1 ] = -1;
+}
+
+#if defined(__linux__)
+static nu_result_t splice_blocked( splice_cursor_t* cursor, int fd, short events )
+{
+	if( errno == EINTR )
+	{
+		return NU_SUCCESS; /* go round again */
+	}
+	else if( errno != EAGAIN )
+	{
+		return NU_FAILED;
+	}
+
+	cursor->wait_fd     = fd;
+	cursor->wait_events = events;
+	return NU_TRYAGAIN;
+}
+#endif
+
+nu_result_t nu_splice( splice_cursor_t* cursor )
+{
+	#if defined(__linux__)
+	const unsigned flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+
+	while( cursor->offset < cursor->size )
+	{
+		size_t remaining = cursor->size - cursor->offset;
+		unsigned more    = remaining > cursor->buffered ? SPLICE_F_MORE : 0;
+		nu_result_t result;
+		ssize_t rv;
+
+		if( cursor->pipe[ 0 ] < 0 )
+		{
+			rv = splice( cursor->in, NULL, cursor->out, NULL, remaining, flags | SPLICE_F_MORE );
+
+			if( rv > 0 )
+			{
+				cursor->offset += (size_t) rv;
+				continue;
+			}
+			else if( rv < 0 )
+			{
+				/* Either side may be the one that would block. */
+				struct pollfd fd = { .fd = cursor->in, .events = POLLIN, .revents = 0 };
+				bool readable    = poll( &fd, 1, 0 ) > 0;
+
+				result = readable ? splice_blocked( cursor, cursor->out, POLLOUT ) : splice_blocked( cursor, cursor->in, POLLIN );
+				if( result == NU_SUCCESS ) continue;
+				return result;
+			}
+		}
+		else if( cursor->buffered > 0 )
+		{
+			/* The pipe is emptied before it's refilled, so that refilling
+			 * only blocks on in, and emptying only on out. */
+			rv = splice( cursor->pipe[ 0 ], NULL, cursor->out, NULL, cursor->buffered, flags | more );
+
+			if( rv > 0 )
+			{
+				cursor->buffered -= (size_t) rv;
+				cursor->offset   += (size_t) rv;
+				continue;
+			}
+
+			result = splice_blocked( cursor, cursor->out, POLLOUT );
+			if( result == NU_SUCCESS ) continue;
+			return result;
+		}
+		else
+		{
+			rv = splice( cursor->in, NULL, cursor->pipe[ 1 ], NULL, remaining, flags );
+
+			if( rv > 0 )
+			{
+				cursor->buffered += (size_t) rv;
+				continue;
+			}
+			else if( rv < 0 )
+			{
+				result = splice_blocked( cursor, cursor->in, POLLIN );
+				if( result == NU_SUCCESS ) continue;
+				return result;
+			}
+		}
+
+		/* in ran dry before size bytes */
+		errno = 0;
+		return NU_FAILED;
+	}
+
+	return NU_SUCCESS;
+	#else
+	(void) cursor;
+	errno = ENOSYS;
+	return NU_FAILED;
+	#endif
+}
+
+short nu_splice_events( const splice_cursor_t* cursor, int* p_fd )
+{
+	*p_fd = cursor->wait_fd;
+	return cursor->wait_events;
+}
@@ -0,0 +1,371 @@
+/* Copyright (C) 2013 by Joseph A. Marrero, https://joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* pthread_setaffinity_np, sched_getaffinity */
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+#include "netutils.h"
+#include "netutils-internal.h"
+
+#define NU_SWEEP_CHUNK          256
+#define NU_SWEEP_MAX_IN_FLIGHT  1024
+#define NU_SWEEP_POLL           10  /* milliseconds to wait for replies before trying to send again */
+
+/*
+ * Every worker owns a run of chunks, packed into one word as
+ * (next chunk << 32 | end).  The owner takes chunks from the front and
+ * thieves take them from the back, both with a compare-and-swap on that
+ * word, so taking work never blocks.
+ */
+typedef struct sweep_worker {
+	struct sweep* sweep;
+	pthread_t thread;
+	size_t index;
+	int cpu;            /* to pin to, or -1 */
+	uint64_t chunks;
+	size_t probed;      /* targets this worker has dealt with */
+	ping_stats_t stats;
+} sweep_worker_t;
+
+typedef struct sweep {
+	const struct in_addr* targets;
+	size_t count;
+	size_t chunk_size;
+	size_t max_in_flight;
+	uint32_t timeout;
+	uint8_t ttl;
+	uint16_t id;        /* worker i sends with id + i on a raw socket */
+	probe_result_t* results;
+	sweep_worker_t* workers;
+	size_t worker_count;
+} sweep_t;
+
+static bool sweep_take( sweep_worker_t* worker, bool steal, uint32_t* p_chunk )
+{
+	uint64_t range = __atomic_load_n( &worker->chunks, __ATOMIC_ACQUIRE );
+
+	for( ;; )
+	{
+		uint32_t head = (uint32_t) (range >> 32);
+		uint32_t tail = (uint32_t) range;
+
+		if( head >= tail )
+		{
+			return false;
+		}
+
+		uint64_t taken = steal ? ((uint64_t) head << 32) | (tail - 1) : ((uint64_t) (head + 1) << 32) | tail;
+
+		/* On failure range is reloaded, and we try again. */
+		if( __atomic_compare_exchange_n( &worker->chunks, &range, taken, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+		{
+			*p_chunk = steal ? tail - 1 : head;
+			return true;
+		}
+	}
+}
+
+static bool sweep_next_chunk( sweep_worker_t* worker, uint32_t* p_chunk )
+{
+	if( sweep_take( worker, false, p_chunk ) )
+	{
+		return true;
+	}
+
+	/* Out of work: steal from whoever has the most left. */
+	sweep_t* sweep = worker->sweep;
+
+	for( ;; )
+	{
+		sweep_worker_t* victim = NULL;
+		uint32_t most = 0;
+
+		for( size_t i = 0; i < sweep->worker_count; i++ )
+		{
+			uint64_t range = __atomic_load_n( &sweep->workers[ i ].chunks, __ATOMIC_RELAXED );
+			uint32_t head  = (uint32_t) (range >> 32);
+			uint32_t tail  = (uint32_t) range;
+
+			if( tail > head && tail - head > most )
+			{
+				most   = tail - head;
+				victim = &sweep->workers[ i ];
+			}
+		}
+
+		if( !victim )
+		{
+			return false;
+		}
+
+		if( sweep_take( victim, true, p_chunk ) )
+		{
+			return true;
+		}
+	}
+}
+
+static void sweep_callback( const probe_result_t* result, void* context )
+{
+	sweep_worker_t* worker = (sweep_worker_t*) context;
+	size_t index           = (size_t) (uintptr_t) result->user_data;
+
+	/* Each target is probed by exactly one worker, which is the only one to write its result. */
+	probe_result_t* slot = &worker->sweep->results[ index ];
+	*slot           = *result;
+	slot->user_data = NULL;
+
+	if( !result->timed_out && result->icmp_type == ICMP_ECHOREPLY )
+	{
+		nu_ping_stats_record( &worker->stats, result->latency );
+	}
+}
+
+/* The result for a target that could not be probed. */
+static void sweep_timed_out( sweep_t* sweep, size_t index )
+{
+	probe_result_t* slot = &sweep->results[ index ];
+	memset( slot, 0, sizeof(probe_result_t) );
+	slot->dst       = sweep->targets[ index ];
+	slot->ttl       = sweep->ttl;
+	slot->timed_out = true;
+}
+
+static void* sweep_worker( void* argument )
+{
+	sweep_worker_t* worker = (sweep_worker_t*) argument;
+	sweep_t* sweep         = worker->sweep;
+
+	#if defined(__linux__)
+	if( worker->cpu >= 0 )
+	{
+		cpu_set_t cpus;
+		CPU_ZERO( &cpus );
+		CPU_SET( worker->cpu, &cpus );
+
+		if( pthread_setaffinity_np( pthread_self( ), sizeof(cpus), &cpus ) != 0 )
+		{
+			trace( "Unable to pin worker %zu to CPU %d.\n", worker->index, worker->cpu );
+		}
+	}
+	#endif
+
+	/* Created here, so that its packets come from this thread's cache. */
+	prober_t* prober = nu_prober_create( sweep->max_in_flight, sweep->timeout, sweep_callback, worker );
+
+	if( !prober )
+	{
+		/* The others will take over this worker's chunks. */
+		trace( "Unable to create prober for worker %zu.\n", worker->index );
+		return NULL;
+	}
+
+	nu_prober_set_id( prober, (uint16_t) (sweep->id + worker->index) );
+
+	size_t next = 0;
+	size_t end  = 0;
+	bool more   = true;
+
+	while( more || nu_prober_in_flight( prober ) > 0 )
+	{
+		while( more && nu_prober_in_flight( prober ) < sweep->max_in_flight )
+		{
+			if( next == end )
+			{
+				uint32_t chunk;
+
+				if( !sweep_next_chunk( worker, &chunk ) )
+				{
+					more = false;
+					break;
+				}
+
+				next = (size_t) chunk * sweep->chunk_size;
+				end  = next + sweep->chunk_size < sweep->count ? next + sweep->chunk_size : sweep->count;
+			}
+
+			if( !nu_prober_submit( prober, sweep->targets[ next ], sweep->ttl, (void*) (uintptr_t) next ) )
+			{
+				/* A full transmit queue clears up as replies are read;
+				 * anything else is reported as a timeout. */
+				if( errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS )
+				{
+					break;
+				}
+
+				sweep_timed_out( sweep, next );
+			}
+
+			next           += 1;
+			worker->probed += 1;
+		}
+
+		/* The window is full, sends are held up, or all the work is out. */
+		if( nu_prober_poll( prober, NU_SWEEP_POLL ) < 0 )
+		{
+			/* Give up on what this worker holds; its other chunks are left
+			 * for the others to steal. */
+			trace( "Worker %zu stopped; its probes are reported as timeouts.\n", worker->index );
+
+			for( ; next < end; next++ )
+			{
+				sweep_timed_out( sweep, next );
+				worker->probed += 1;
+			}
+
+			nu_prober_expire_all( prober );
+			break;
+		}
+	}
+
+	nu_prober_destroy( &prober );
+	return NULL;
+}
+
+static size_t sweep_cpus( int cpus[], size_t max )
+{
+	size_t count = 0;
+
+	#if defined(__linux__)
+	cpu_set_t allowed;
+
+	if( sched_getaffinity( 0, sizeof(allowed), &allowed ) == 0 )
+	{
+		for( int cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++ )
+		{
+			if( CPU_ISSET( cpu, &allowed ) ) cpus[ count++ ] = cpu;
+		}
+	}
+	#endif
+
+	if( count == 0 )
+	{
+		long online = sysconf( _SC_NPROCESSORS_ONLN );
+
+		for( long cpu = 0; cpu < online && count < max; cpu++ )
+		{
+			cpus[ count++ ] = (int) cpu;
+		}
+	}
+
+	return count;
+}
+
+bool nu_sweep( const struct in_addr* targets, size_t count, const sweep_options_t* options, probe_result_t* results, ping_stats_t* stats )
+{
+	sweep_t sweep;
+	int cpus[ 1024 ];
+	size_t cpu_count = sweep_cpus( cpus, sizeof(cpus) / sizeof(cpus[0]) );
+	bool result      = false;
+
+	memset( &sweep, 0, sizeof(sweep) );
+	sweep.targets       = targets;
+	sweep.count         = count;
+	sweep.chunk_size    = options->chunk_size ? options->chunk_size : NU_SWEEP_CHUNK;
+	sweep.max_in_flight = options->max_in_flight ? options->max_in_flight : NU_SWEEP_MAX_IN_FLIGHT;
+	sweep.timeout       = options->timeout;
+	sweep.ttl           = options->ttl ? options->ttl : MAXTTL;
+	sweep.id            = (uint16_t) nu_random( );
+	sweep.results       = results;
+	sweep.worker_count  = options->workers ? options->workers : (cpu_count ? cpu_count : 1);
+
+	size_t chunk_count = (count + sweep.chunk_size - 1) / sweep.chunk_size;
+
+	if( chunk_count > UINT32_MAX )
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	memset( results, 0, count * sizeof(probe_result_t) );
+	sweep.workers = (sweep_worker_t*) calloc( sweep.worker_count, sizeof(sweep_worker_t) );
+
+	if( !sweep.workers )
+	{
+		return false;
+	}
+
+	/* Every worker starts with an equal share of the chunks. */
+	for( size_t i = 0; i < sweep.worker_count; i++ )
+	{
+		sweep_worker_t* worker = &sweep.workers[ i ];
+		uint64_t head = chunk_count * i / sweep.worker_count;
+		uint64_t tail = chunk_count * (i + 1) / sweep.worker_count;
+
+		worker->sweep  = &sweep;
+		worker->index  = i;
+		worker->cpu    = options->pin_workers && cpu_count > 0 ? cpus[ i % cpu_count ] : -1;
+		worker->chunks = (head << 32) | tail;
+	}
+
+	size_t started = 0;
+
+	for( ; started < sweep.worker_count; started++ )
+	{
+		if( pthread_create( &sweep.workers[ started ].thread, NULL, sweep_worker, &sweep.workers[ started ] ) != 0 )
+		{
+			trace( "Unable to start worker %zu.\n", started );
+			break;
+		}
+	}
+
+	/* Chunks of workers that never started are left for the others to steal. */
+	size_t probed = 0;
+
+	if( stats )
+	{
+		memset( stats, 0, sizeof(ping_stats_t) );
+	}
+
+	for( size_t i = 0; i < started; i++ )
+	{
+		pthread_join( sweep.workers[ i ].thread, NULL );
+	}
+
+	for( size_t i = 0; i < sweep.worker_count; i++ )
+	{
+		sweep_worker_t* worker = &sweep.workers[ i ];
+
+		worker->stats.count = (uint32_t) worker->probed;
+		worker->stats.lost  = worker->stats.count - worker->stats.received;
+		probed += worker->probed;
+
+		if( stats )
+		{
+			nu_ping_stats_merge( stats, &worker->stats );
+		}
+	}
+
+	/* Every target was probed, unless no worker got going at all. */
+	result = probed == count;
+
+	free( sweep.workers );
+	return result;
+}
@@ -0,0 +1,907 @@
+/* Copyright (C) 2013 by Joseph A. Marrero, https://joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#include "netutils.h"
+#include "netutils-internal.h"
+
+#define NU_TCP_PROBER_MAX_IN_FLIGHT  UINT16_MAX
+#define NU_TCP_PROBER_EVENTS         64
+#define NU_TCP_PROBER_RING_SIZE      64
+#define NU_TCP_PROBER_SNAPLEN        128   /* enough for the IP and TCP headers, with options */
+#define NU_TCP_PROBER_RCVBUF         (4 * 1024 * 1024)
+#define NU_TCP_PROBER_WINDOW         65535
+#define NU_TCP_PROBE_NONE            UINT32_MAX
+#define NU_TCP_PROBE_RAW             UINT64_MAX  /* epoll data of the raw socket */
+
+packet_t* nu_tcp_create( struct in_addr ip_src, uint16_t sport, struct in_addr ip_dst, uint16_t dport, uint32_t seq, uint32_t ack, uint8_t flags,
+                         const void* tcp_payload, size_t tcp_payload_size )
+{
+	size_t ip_payload_size = NU_TCP_HDRLEN + tcp_payload_size;
+	packet_t* packet       = nu_packet_create( IPPROTO_TCP, ip_src, ip_dst, ip_payload_size );
+
+	if( packet )
+	{
+		struct tcphdr* tcp_header = (struct tcphdr*) packet->payload;
+		tcp_header->th_sport = htons( sport );
+		tcp_header->th_dport = htons( dport );
+		tcp_header->th_seq   = htonl( seq );
+		tcp_header->th_ack   = htonl( ack );
+		tcp_header->th_off   = NU_TCP_HDRLEN >> 2;
+		tcp_header->th_flags = flags;
+		tcp_header->th_win   = htons( NU_TCP_PROBER_WINDOW );
+
+		if( tcp_payload )
+		{
+			memcpy( packet->payload + NU_TCP_HDRLEN, tcp_payload, tcp_payload_size );
+		}
+
+		nu_tcp_recalc_checksum( packet, tcp_payload_size );
+	}
+
+	return packet;
+}
+
+void nu_tcp_recalc_checksum( packet_t* packet, size_t tcp_payload_size )
+{
+	struct tcphdr* tcp_header = nu_tcp_header( packet );
+	size_t ip_payload_size    = (tcp_header->th_off << 2) + tcp_payload_size;
+
+	tcp_header->th_sum = 0;
+
+	uint64_t sum = nu_checksum_pseudo_header( packet->ip_header.ip_src, packet->ip_header.ip_dst, IPPROTO_TCP, (uint16_t) ip_payload_size );
+	tcp_header->th_sum = nu_checksum_fold( nu_checksum_partial( tcp_header, ip_payload_size, sum ) );
+
+	nu_packet_recalc_checksum( packet, ip_payload_size );
+}
+
+struct tcphdr* nu_tcp_header( const packet_t* packet )
+{
+	return (struct tcphdr*) ((uint8_t*) &packet->ip_header + (packet->ip_header.ip_hl << 2));
+}
+
+/*
+ * Outstanding probes live in a fixed pool, on a list ordered by send time
+ * (and so by deadline), as in prober.c.  Connect probes are found through
+ * their epoll data; SYN probes through an open-addressed hash table keyed
+ * by destination, port and initial sequence number.
+ */
+typedef struct tcp_probe {
+	struct in_addr dst;
+	uint16_t port;
+	uint32_t isn;         /* SYN mode */
+	int socket;           /* connect mode */
+	uint32_t generation;  /* tells a stale epoll event from one for the probe now in this slot */
+	uint64_t sent;        /* CLOCK_MONOTONIC, in nanoseconds */
+	void* user_data;
+	uint32_t prev;
+	uint32_t next;
+} tcp_probe_t;
+
+struct tcp_prober {
+	tcp_probe_mode_t mode;
+	int socket;           /* SYN mode: the raw socket */
+	int port_socket;      /* SYN mode: holds on to the source port */
+	uint16_t sport;
+	int event_fd;
+	uint64_t timeout;     /* in nanoseconds */
+	tcp_prober_callback_t callback;
+	void* context;
+
+	tcp_probe_t* probes;
+	size_t max_in_flight;
+	size_t in_flight;
+	uint32_t free_list;
+	uint32_t oldest;
+	uint32_t newest;
+
+	uint32_t* table;      /* SYN mode: pool indices, or NU_TCP_PROBE_NONE */
+	size_t table_mask;
+
+	tcp_probe_result_t* completions;
+	size_t completions_capacity;
+	size_t completions_head;
+	size_t completions_count;
+
+	packet_t* packet;     /* SYN mode: the segment template */
+	recv_ring_t* ring;
+	struct in_addr route_dst;
+	struct in_addr route_src;
+	bool route_valid;
+};
+
+static inline size_t tcp_probe_hash( const tcp_prober_t* prober, struct in_addr dst, uint16_t port, uint32_t isn )
+{
+	uint64_t key = ((uint64_t) dst.s_addr << 32) ^ ((uint64_t) port << 16) ^ isn;
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return (size_t) key & prober->table_mask;
+}
+
+static size_t tcp_probe_lookup( const tcp_prober_t* prober, struct in_addr dst, uint16_t port, uint32_t isn )
+{
+	size_t slot = tcp_probe_hash( prober, dst, port, isn );
+
+	while( prober->table[ slot ] != NU_TCP_PROBE_NONE )
+	{
+		const tcp_probe_t* probe = &prober->probes[ prober->table[ slot ] ];
+
+		if( probe->dst.s_addr == dst.s_addr && probe->port == port && probe->isn == isn )
+		{
+			return slot;
+		}
+
+		slot = (slot + 1) & prober->table_mask;
+	}
+
+	return SIZE_MAX;
+}
+
+static void tcp_probe_table_remove( tcp_prober_t* prober, size_t slot )
+{
+	/* Backward-shift deletion, as in prober.c. */
+	size_t hole = slot;
+	size_t next = (slot + 1) & prober->table_mask;
+
+	while( prober->table[ next ] != NU_TCP_PROBE_NONE )
+	{
+		const tcp_probe_t* probe = &prober->probes[ prober->table[ next ] ];
+		size_t home = tcp_probe_hash( prober, probe->dst, probe->port, probe->isn );
+
+		if( ((next - home) & prober->table_mask) >= ((next - hole) & prober->table_mask) )
+		{
+			prober->table[ hole ] = prober->table[ next ];
+			hole = next;
+		}
+
+		next = (next + 1) & prober->table_mask;
+	}
+
+	prober->table[ hole ] = NU_TCP_PROBE_NONE;
+}
+
+static void tcp_probe_release( tcp_prober_t* prober, uint32_t index )
+{
+	tcp_probe_t* probe = &prober->probes[ index ];
+
+	if( prober->mode == NU_TCP_PROBE_CONNECT )
+	{
+		/* Also takes it out of the epoll set; the linger setting turns this
+		 * into a RST if the handshake completed. */
+		close( probe->socket );
+		probe->socket = -1;
+	}
+	else
+	{
+		tcp_probe_table_remove( prober, tcp_probe_lookup( prober, probe->dst, probe->port, probe->isn ) );
+	}
+
+	if( probe->prev != NU_TCP_PROBE_NONE ) prober->probes[ probe->prev ].next = probe->next;
+	else prober->oldest = probe->next;
+
+	if( probe->next != NU_TCP_PROBE_NONE ) prober->probes[ probe->next ].prev = probe->prev;
+	else prober->newest = probe->prev;
+
+	probe->generation += 1;
+	probe->next        = prober->free_list;
+	prober->free_list  = index;
+	prober->in_flight -= 1;
+}
+
+static void tcp_prober_complete( tcp_prober_t* prober, const tcp_probe_result_t* result )
+{
+	if( prober->callback )
+	{
+		prober->callback( result, prober->context );
+		return;
+	}
+
+	if( prober->completions_count == prober->completions_capacity )
+	{
+		size_t capacity = prober->completions_capacity ? 2 * prober->completions_capacity : 64;
+		tcp_probe_result_t* completions = (tcp_probe_result_t*) malloc( capacity * sizeof(tcp_probe_result_t) );
+
+		if( !completions )
+		{
+			trace( "Dropping probe result; out of memory.\n" );
+			return;
+		}
+
+		for( size_t i = 0; i < prober->completions_count; i++ )
+		{
+			completions[ i ] = prober->completions[ (prober->completions_head + i) % prober->completions_capacity ];
+		}
+
+		free( prober->completions );
+		prober->completions          = completions;
+		prober->completions_capacity = capacity;
+		prober->completions_head     = 0;
+	}
+
+	size_t tail = (prober->completions_head + prober->completions_count) % prober->completions_capacity;
+	prober->completions[ tail ] = *result;
+	prober->completions_count += 1;
+}
+
+/* Complete a probe and give its slot back. */
+static void tcp_probe_finish( tcp_prober_t* prober, uint32_t index, bool open, bool refused, int error, uint64_t now )
+{
+	const tcp_probe_t* probe = &prober->probes[ index ];
+	tcp_probe_result_t result = {
+		.dst       = probe->dst,
+		.port      = probe->port,
+		.open      = open,
+		.refused   = refused,
+		.timed_out = false,
+		.error     = error,
+		.latency   = (now - probe->sent) / 1000000.0,
+		.user_data = probe->user_data
+	};
+
+	tcp_probe_release( prober, index );
+	tcp_prober_complete( prober, &result );
+}
+
+static bool tcp_prober_open_raw( tcp_prober_t* prober )
+{
+	/* A bound (but not listening) socket keeps the port out of everyone
+	 * else's hands, and the kernel answers anything sent to it with a RST
+	 * of its own, which only helps the teardown. */
+	struct sockaddr_in address;
+	socklen_t address_length = sizeof(address);
+
+	prober->port_socket = nu_tcp_socket( );
+	nu_set_ipaddress( &address, (struct in_addr) { .s_addr = INADDR_ANY }, 0 );
+
+	if( prober->port_socket < 0 ||
+	    bind( prober->port_socket, (struct sockaddr*) &address, sizeof(address) ) < 0 ||
+	    getsockname( prober->port_socket, (struct sockaddr*) &address, &address_length ) < 0 )
+	{
+		trace( "Unable to reserve a source port.\n" );
+		return false;
+	}
+
+	prober->sport  = ntohs( address.sin_port );
+	prober->socket = nu_raw_socket( IPPROTO_TCP );
+
+	if( prober->socket < 0 )
+	{
+		trace( "Unable to create socket.\n" );
+		#if defined(DEBUG_NETUTILS)
+		perror( "ERROR" );
+		#endif
+		return false;
+	}
+
+	if( !nu_tcp_set_filter( prober->socket, prober->sport ) )
+	{
+		/* Everything still works, just with more wakeups. */
+		trace( "Unable to attach TCP filter.\n" );
+	}
+
+	int flags = fcntl( prober->socket, F_GETFL, 0 );
+	if( flags < 0 || fcntl( prober->socket, F_SETFL, flags | O_NONBLOCK ) < 0 )
+	{
+		trace( "Unable to make socket non-blocking.\n" );
+		return false;
+	}
+
+	const int rcvbuf = NU_TCP_PROBER_RCVBUF;
+	setsockopt( prober->socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf) );
+
+	size_t table_size = 1;
+	while( table_size < 2 * prober->max_in_flight ) table_size <<= 1;
+
+	prober->table      = (uint32_t*) malloc( table_size * sizeof(uint32_t) );
+	prober->table_mask = table_size - 1;
+	prober->ring       = nu_recv_ring_create( NU_TCP_PROBER_RING_SIZE, NU_TCP_PROBER_SNAPLEN );
+	prober->packet     = nu_tcp_create( (struct in_addr) { .s_addr = INADDR_ANY }, prober->sport, (struct in_addr) { .s_addr = INADDR_ANY }, 0, 0, 0, TH_SYN, NULL, 0 );
+
+	if( !prober->table || !prober->ring || !prober->packet )
+	{
+		return false;
+	}
+
+	for( size_t i = 0; i < table_size; i++ )
+	{
+		prober->table[ i ] = NU_TCP_PROBE_NONE;
+	}
+
+	return true;
+}
+
+tcp_prober_t* nu_tcp_prober_create( tcp_probe_mode_t mode, size_t max_in_flight, uint32_t timeout, tcp_prober_callback_t callback, void* context )
+{
+	tcp_prober_t* prober = (tcp_prober_t*) calloc( 1, sizeof(tcp_prober_t) );
+
+	if( !prober )
+	{
+		return NULL;
+	}
+
+	if( max_in_flight == 0 ) max_in_flight = 1;
+	if( max_in_flight > NU_TCP_PROBER_MAX_IN_FLIGHT ) max_in_flight = NU_TCP_PROBER_MAX_IN_FLIGHT;
+
+	prober->mode          = mode;
+	prober->socket        = -1;
+	prober->port_socket   = -1;
+	prober->event_fd      = -1;
+	prober->timeout       = (uint64_t) timeout * 1000000ULL;
+	prober->callback      = callback;
+	prober->context       = context;
+	prober->max_in_flight = max_in_flight;
+	prober->probes        = (tcp_probe_t*) calloc( max_in_flight, sizeof(tcp_probe_t) );
+	prober->oldest        = NU_TCP_PROBE_NONE;
+	prober->newest        = NU_TCP_PROBE_NONE;
+
+	if( !prober->probes )
+	{
+		goto failed;
+	}
+
+	for( size_t i = 0; i < max_in_flight; i++ )
+	{
+		prober->probes[ i ].socket = -1;
+		prober->probes[ i ].next   = (i + 1 < max_in_flight) ? (uint32_t) (i + 1) : NU_TCP_PROBE_NONE;
+	}
+	prober->free_list = 0;
+
+	if( mode == NU_TCP_PROBE_SYN && !tcp_prober_open_raw( prober ) )
+	{
+		goto failed;
+	}
+
+	#if defined(__linux__)
+	prober->event_fd = epoll_create1( EPOLL_CLOEXEC );
+
+	if( prober->event_fd < 0 )
+	{
+		trace( "Unable to create epoll instance.\n" );
+		goto failed;
+	}
+
+	if( mode == NU_TCP_PROBE_SYN )
+	{
+		struct epoll_event event = { .events = EPOLLIN, .data.u64 = NU_TCP_PROBE_RAW };
+
+		if( epoll_ctl( prober->event_fd, EPOLL_CTL_ADD, prober->socket, &event ) < 0 )
+		{
+			trace( "Unable to watch socket.\n" );
+			goto failed;
+		}
+	}
+	#else
+	/* Connect probes are polled one by one; there is no single descriptor. */
+	prober->event_fd = prober->socket;
+	#endif
+
+	return prober;
+
+failed:
+	nu_tcp_prober_destroy( &prober );
+	return NULL;
+}
+
+void nu_tcp_prober_destroy( tcp_prober_t** p_prober )
+{
+	if( p_prober && *p_prober )
+	{
+		tcp_prober_t* prober = *p_prober;
+
+		if( prober->probes )
+		{
+			for( size_t i = 0; i < prober->max_in_flight; i++ )
+			{
+				if( prober->probes[ i ].socket >= 0 ) close( prober->probes[ i ].socket );
+			}
+		}
+
+		if( prober->event_fd >= 0 && prober->event_fd != prober->socket ) close( prober->event_fd );
+		if( prober->socket >= 0 ) close( prober->socket );
+		if( prober->port_socket >= 0 ) close( prober->port_socket );
+		nu_recv_ring_destroy( &prober->ring );
+		nu_packet_destroy( &prober->packet );
+		free( prober->completions );
+		free( prober->table );
+		free( prober->probes );
+		free( prober );
+		*p_prober = NULL;
+	}
+}
+
+int nu_tcp_prober_fd( const tcp_prober_t* prober )
+{
+	return prober->event_fd;
+}
+
+size_t nu_tcp_prober_in_flight( const tcp_prober_t* prober )
+{
+	return prober->in_flight;
+}
+
+static bool tcp_prober_source( tcp_prober_t* prober, struct in_addr dst, struct in_addr* p_src )
+{
+	if( !prober->route_valid || prober->route_dst.s_addr != dst.s_addr )
+	{
+		if( !nu_source_address( dst, &prober->route_src ) )
+		{
+			prober->route_valid = false;
+			return false;
+		}
+
+		prober->route_dst   = dst;
+		prober->route_valid = true;
+	}
+
+	*p_src = prober->route_src;
+	return true;
+}
+
+/* Send a bare segment from the prober's port; the kernel adds the IP header. */
+static bool tcp_prober_send( tcp_prober_t* prober, struct in_addr src, struct in_addr dst, uint16_t port, uint32_t seq, uint8_t flags )
+{
+	packet_t* packet          = prober->packet;
+	struct tcphdr* tcp_header = nu_tcp_header( packet );
+	struct sockaddr_in address;
+
+	packet->ip_header.ip_src = src;
+	packet->ip_header.ip_dst = dst;
+	tcp_header->th_dport     = htons( port );
+	tcp_header->th_seq       = htonl( seq );
+	tcp_header->th_flags     = flags;
+	nu_tcp_recalc_checksum( packet, 0 );
+
+	nu_set_ipaddress( &address, dst, 0 );
+	return sendto( prober->socket, tcp_header, NU_TCP_HDRLEN, 0, (struct sockaddr*) &address, sizeof(address) ) == NU_TCP_HDRLEN;
+}
+
+/* Start a non-blocking connect.  *p_done is set if it finished on the spot. */
+static bool tcp_prober_connect( tcp_prober_t* prober, tcp_probe_t* probe, uint32_t index, bool* p_done, bool* p_open )
+{
+	struct sockaddr_in address;
+
+	probe->socket = nu_tcp_probe_socket( );
+
+	if( probe->socket < 0 )
+	{
+		return false;
+	}
+
+	nu_set_ipaddress( &address, probe->dst, probe->port );
+	probe->sent = nu_monotonic_ns( );
+
+	bool connected = connect( probe->socket, (struct sockaddr*) &address, sizeof(address) ) == 0;
+
+	if( connected || errno == ECONNREFUSED )
+	{
+		/* Loopback can answer on the spot. */
+		*p_done = true;
+		*p_open = connected;
+		return true;
+	}
+
+	if( errno != EINPROGRESS )
+	{
+		trace( "Unable to connect [errno = %d].\n", errno );
+		goto failed;
+	}
+
+	#if defined(__linux__)
+	struct epoll_event event = {
+		.events   = EPOLLOUT,
+		.data.u64 = ((uint64_t) probe->generation << 32) | index
+	};
+
+	if( epoll_ctl( prober->event_fd, EPOLL_CTL_ADD, probe->socket, &event ) < 0 )
+	{
+		trace( "Unable to watch socket.\n" );
+		goto failed;
+	}
+	#else
+	(void) prober;
+	(void) index;
+	#endif
+
+	*p_done = false;
+	return true;
+
+failed:
+	{
+		int error = errno;
+		close( probe->socket );
+		probe->socket = -1;
+		errno = error;
+	}
+	return false;
+}
+
+bool nu_tcp_prober_submit( tcp_prober_t* prober, struct in_addr dst, uint16_t port, void* user_data )
+{
+	if( prober->free_list == NU_TCP_PROBE_NONE )
+	{
+		trace( "Too many probes in flight.\n" );
+		return false;
+	}
+
+	uint32_t index     = prober->free_list;
+	tcp_probe_t* probe = &prober->probes[ index ];
+	bool done          = false;
+	bool open          = false;
+
+	probe->dst       = dst;
+	probe->port      = port;
+	probe->user_data = user_data;
+
+	if( prober->mode == NU_TCP_PROBE_CONNECT )
+	{
+		if( !tcp_prober_connect( prober, probe, index, &done, &open ) )
+		{
+			return false;
+		}
+	}
+	else
+	{
+		struct in_addr src;
+		uint32_t isn = (uint32_t) nu_random( );
+
+		/* Replies are matched on the sequence number they acknowledge. */
+		while( tcp_probe_lookup( prober, dst, port, isn ) != SIZE_MAX )
+		{
+			isn += 1;
+		}
+
+		probe->isn  = isn;
+		probe->sent = nu_monotonic_ns( );
+
+		if( !tcp_prober_source( prober, dst, &src ) ||
+		    !tcp_prober_send( prober, src, dst, port, isn, TH_SYN ) )
+		{
+			trace( "Unable to send TCP SYN [errno = %d].\n", errno );
+			return false;
+		}
+
+		size_t slot = tcp_probe_hash( prober, dst, port, isn );
+		while( prober->table[ slot ] != NU_TCP_PROBE_NONE )
+		{
+			slot = (slot + 1) & prober->table_mask;
+		}
+		prober->table[ slot ] = index;
+	}
+
+	prober->free_list = probe->next;
+	probe->next       = NU_TCP_PROBE_NONE;
+	probe->prev       = prober->newest;
+
+	if( prober->newest != NU_TCP_PROBE_NONE ) prober->probes[ prober->newest ].next = index;
+	else prober->oldest = index;
+	prober->newest = index;
+
+	prober->in_flight += 1;
+
+	if( done )
+	{
+		tcp_probe_finish( prober, index, open, !open, 0, nu_monotonic_ns( ) );
+	}
+
+	return true;
+}
+
+/* A connect probe's socket became writable: the handshake is over, one way or another. */
+static int tcp_prober_connected( tcp_prober_t* prober, uint32_t index, uint64_t now )
+{
+	int error = 0;
+	socklen_t error_size = sizeof(error);
+
+	if( getsockopt( prober->probes[ index ].socket, SOL_SOCKET, SO_ERROR, &error, &error_size ) < 0 )
+	{
+		error = errno;
+	}
+
+	tcp_probe_finish( prober, index, error == 0, error == ECONNREFUSED, (error == 0 || error == ECONNREFUSED) ? 0 : error, now );
+	return 1;
+}
+
+/* Match SYN/ACKs and RSTs sent to our port with their probes. */
+static int tcp_prober_receive( tcp_prober_t* prober )
+{
+	int completed = 0;
+	int received;
+
+	while( (received = nu_recv_batch( prober->socket, prober->ring, MSG_DONTWAIT )) > 0 )
+	{
+		uint64_t now = nu_monotonic_ns( );
+
+		for( int i = 0; i < received; i++ )
+		{
+			size_t length;
+			packet_view_t view;
+			const void* buffer = nu_recv_ring_buffer( prober->ring, i, &length, NULL );
+
+			if( !nu_packet_view_init( &view, buffer, length ) )
+			{
+				continue;
+			}
+
+			const struct tcphdr* tcp_header = nu_packet_view_tcp_header( &view );
+
+			if( !tcp_header || ntohs( tcp_header->th_dport ) != prober->sport || !(tcp_header->th_flags & TH_ACK) )
+			{
+				continue;
+			}
+
+			bool open = (tcp_header->th_flags & (TH_SYN | TH_RST)) == TH_SYN;
+			bool refused = (tcp_header->th_flags & TH_RST) != 0;
+
+			if( !open && !refused )
+			{
+				continue;
+			}
+
+			struct in_addr dst = view.ip_header->ip_src;
+			uint16_t port      = ntohs( tcp_header->th_sport );
+			uint32_t ack       = ntohl( tcp_header->th_ack );
+			size_t slot        = tcp_probe_lookup( prober, dst, port, ack - 1 );
+
+			if( slot == SIZE_MAX )
+			{
+				/* Not ours, a retransmission, or it already timed out. */
+				continue;
+			}
+
+			if( open )
+			{
+				/* Tear down the half-open connection (RFC 793: a reset's
+				 * sequence number is the acknowledgement it answers). */
+				tcp_prober_send( prober, view.ip_header->ip_dst, dst, port, ack, TH_RST );
+			}
+
+			tcp_probe_finish( prober, prober->table[ slot ], open, refused, 0, now );
+			completed += 1;
+		}
+
+		if( (size_t) received < nu_recv_ring_count( prober->ring ) )
+		{
+			break;
+		}
+	}
+
+	return completed;
+}
+
+static int tcp_prober_expire( tcp_prober_t* prober, uint64_t now )
+{
+	int expired = 0;
+
+	while( prober->oldest != NU_TCP_PROBE_NONE )
+	{
+		uint32_t index = prober->oldest;
+		const tcp_probe_t* probe = &prober->probes[ index ];
+
+		if( now - probe->sent < prober->timeout )
+		{
+			break;
+		}
+
+		tcp_probe_result_t result = {
+			.dst       = probe->dst,
+			.port      = probe->port,
+			.open      = false,
+			.refused   = false,
+			.timed_out = true,
+			.error     = 0,
+			.latency   = 0.0,
+			.user_data = probe->user_data
+		};
+
+		tcp_probe_release( prober, index );
+		tcp_prober_complete( prober, &result );
+		expired += 1;
+	}
+
+	return expired;
+}
+
+int nu_tcp_prober_poll( tcp_prober_t* prober, uint32_t timeout )
+{
+	uint64_t now  = nu_monotonic_ns( );
+	int wait_time = timeout;
+
+	/* Don't sleep past the next deadline. */
+	if( prober->oldest != NU_TCP_PROBE_NONE )
+	{
+		uint64_t deadline = prober->probes[ prober->oldest ].sent + prober->timeout;
+		uint64_t remaining = deadline > now ? (deadline - now + 999999ULL) / 1000000ULL : 0;
+
+		if( remaining < (uint64_t) wait_time ) wait_time = (int) remaining;
+	}
+
+	int completed = 0;
+
+	#if defined(__linux__)
+	struct epoll_event events[ NU_TCP_PROBER_EVENTS ];
+	int ready = epoll_wait( prober->event_fd, events, NU_TCP_PROBER_EVENTS, wait_time );
+
+	if( ready < 0 && errno != EINTR )
+	{
+		trace( "Unable to wait for replies [errno = %d].\n", errno );
+		return -1;
+	}
+
+	now = nu_monotonic_ns( );
+
+	for( int i = 0; i < ready; i++ )
+	{
+		if( events[ i ].data.u64 == NU_TCP_PROBE_RAW )
+		{
+			completed += tcp_prober_receive( prober );
+			continue;
+		}
+
+		/* A callback may have reused the slot since the event was queued. */
+		uint32_t index      = (uint32_t) events[ i ].data.u64;
+		uint32_t generation = (uint32_t) (events[ i ].data.u64 >> 32);
+
+		if( prober->probes[ index ].generation == generation && prober->probes[ index ].socket >= 0 )
+		{
+			completed += tcp_prober_connected( prober, index, now );
+		}
+	}
+	#else
+	if( prober->mode == NU_TCP_PROBE_SYN )
+	{
+		struct pollfd fd = { .fd = prober->socket, .events = POLLIN, .revents = 0 };
+		int ready = poll( &fd, 1, wait_time );
+
+		if( ready < 0 && errno != EINTR )
+		{
+			trace( "Unable to wait for replies [errno = %d].\n", errno );
+			return -1;
+		}
+
+		if( ready > 0 )
+		{
+			completed += tcp_prober_receive( prober );
+		}
+	}
+	else
+	{
+		struct pollfd* fds = (struct pollfd*) malloc( (prober->in_flight + 1) * sizeof(struct pollfd) );
+		uint32_t* indices  = (uint32_t*) malloc( (prober->in_flight + 1) * sizeof(uint32_t) );
+		nfds_t count = 0;
+
+		if( !fds || !indices )
+		{
+			free( fds );
+			free( indices );
+			return -1;
+		}
+
+		for( uint32_t index = prober->oldest; index != NU_TCP_PROBE_NONE; index = prober->probes[ index ].next )
+		{
+			fds[ count ].fd      = prober->probes[ index ].socket;
+			fds[ count ].events  = POLLOUT;
+			fds[ count ].revents = 0;
+			indices[ count++ ]   = index;
+		}
+
+		int ready = poll( fds, count, wait_time );
+
+		if( ready < 0 && errno != EINTR )
+		{
+			trace( "Unable to wait for replies [errno = %d].\n", errno );
+			free( fds );
+			free( indices );
+			return -1;
+		}
+
+		now = nu_monotonic_ns( );
+
+		for( nfds_t i = 0; ready > 0 && i < count; i++ )
+		{
+			/* Finishing a probe never reuses a slot, and callbacks only
+			 * submit new probes, which are not in this array. */
+			if( fds[ i ].revents && prober->probes[ indices[ i ] ].socket == fds[ i ].fd )
+			{
+				completed += tcp_prober_connected( prober, indices[ i ], now );
+			}
+		}
+
+		free( fds );
+		free( indices );
+	}
+	#endif
+
+	completed += tcp_prober_expire( prober, nu_monotonic_ns( ) );
+	return completed;
+}
+
+bool nu_tcp_prober_next( tcp_prober_t* prober, tcp_probe_result_t* result )
+{
+	if( prober->completions_count == 0 )
+	{
+		return false;
+	}
+
+	*result = prober->completions[ prober->completions_head ];
+	prober->completions_head   = (prober->completions_head + 1) % prober->completions_capacity;
+	prober->completions_count -= 1;
+	return true;
+}
+
+bool nu_tcp_ping( struct in_addr dst, uint16_t port, tcp_probe_mode_t mode, uint32_t timeout, uint32_t count, ping_stats_t* stats )
+{
+	tcp_prober_t* prober = nu_tcp_prober_create( mode, 1, timeout, NULL, NULL );
+	tcp_probe_result_t result;
+	bool ok = false;
+
+	if( !prober )
+	{
+		return false;
+	}
+
+	if( stats )
+	{
+		memset( stats, 0, sizeof(ping_stats_t) );
+		stats->count = count;
+	}
+
+	while( count-- )
+	{
+		if( !nu_tcp_prober_submit( prober, dst, port, NULL ) )
+		{
+			goto done;
+		}
+
+		while( !nu_tcp_prober_next( prober, &result ) )
+		{
+			if( nu_tcp_prober_poll( prober, timeout ) < 0 )
+			{
+				goto done;
+			}
+		}
+
+		if( stats && (result.open || result.refused) )
+		{
+			nu_ping_stats_record( stats, result.latency );
+		}
+	}
+
+	ok = true;
+
+done:
+	if( stats )
+	{
+		stats->lost = stats->count - stats->received;
+	}
+
+	nu_tcp_prober_destroy( &prober );
+	return ok;
+}
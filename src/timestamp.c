@@ -0,0 +1,146 @@
+/* Copyright (C) 2013 by Joseph A. Marrero, https://joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+#include <linux/net_tstamp.h>
+#endif
+#include "netutils.h"
+#include "netutils-internal.h"
+
+/*
+ * Kernel timestamps.
+ *
+ * Linux can stamp datagrams in the network stack as they leave (reported on
+ * the socket's error queue) and as they arrive (reported in a control
+ * message).  Both are software timestamps on CLOCK_REALTIME, so latency is
+ * only ever computed between two kernel timestamps; if either one is
+ * missing the caller falls back to CLOCK_MONOTONIC readings of its own.
+ */
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+# define NU_KERNEL_TIMESTAMPS 1
+#endif
+
+bool nu_set_timestamping( int socket, bool enable )
+{
+	#ifdef NU_KERNEL_TIMESTAMPS
+	const int flags = enable ? (SOF_TIMESTAMPING_SOFTWARE |
+	                            SOF_TIMESTAMPING_RX_SOFTWARE |
+	                            SOF_TIMESTAMPING_TX_SOFTWARE |
+	                            SOF_TIMESTAMPING_OPT_ID |
+	                            SOF_TIMESTAMPING_OPT_TSONLY) : 0;
+
+	return setsockopt( socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags) ) == 0;
+	#else
+	return !enable;
+	#endif
+}
+
+static inline uint64_t timespec_ns( const struct timespec* ts )
+{
+	return (uint64_t) ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+uint64_t nu_timestamp_from_cmsg( const struct msghdr* message )
+{
+	#ifdef NU_KERNEL_TIMESTAMPS
+	for( struct cmsghdr* cmsg = CMSG_FIRSTHDR( (struct msghdr*) message ); cmsg; cmsg = CMSG_NXTHDR( (struct msghdr*) message, cmsg ) )
+	{
+		if( cmsg->cmsg_level != SOL_SOCKET )
+		{
+			continue;
+		}
+
+		if( cmsg->cmsg_type == SCM_TIMESTAMPING )
+		{
+			struct timespec ts[ 3 ];
+			memcpy( ts, CMSG_DATA(cmsg), sizeof(ts) );
+			return timespec_ns( &ts[ 0 ] ); /* software timestamp */
+		}
+		else if( cmsg->cmsg_type == SCM_TIMESTAMPNS )
+		{
+			struct timespec ts;
+			memcpy( &ts, CMSG_DATA(cmsg), sizeof(ts) );
+			return timespec_ns( &ts );
+		}
+	}
+	#endif
+
+	return 0;
+}
+
+ssize_t nu_recv_timestamp( int socket, void* buffer, size_t size, int flags, struct sockaddr_in* p_from, uint64_t* p_timestamp )
+{
+	struct iovec iov = { .iov_base = buffer, .iov_len = size };
+	union {
+		struct cmsghdr align;
+		uint8_t buffer[ NU_TIMESTAMP_CONTROL_SIZE ];
+	} control;
+	struct msghdr message = {
+		.msg_name       = p_from,
+		.msg_namelen    = p_from ? sizeof(*p_from) : 0,
+		.msg_iov        = &iov,
+		.msg_iovlen     = 1,
+		.msg_control    = control.buffer,
+		.msg_controllen = sizeof(control.buffer),
+		.msg_flags      = 0
+	};
+
+	ssize_t rv = recvmsg( socket, &message, flags );
+	*p_timestamp = rv >= 0 ? nu_timestamp_from_cmsg( &message ) : 0;
+	return rv;
+}
+
+bool nu_read_tx_timestamp( int socket, uint32_t* p_id, uint64_t* p_timestamp )
+{
+	uint32_t buffer[ 128 ];
+	ssize_t rv;
+
+	/* ICMP errors queued ahead of the timestamp are read and dropped; callers
+	 * that want them must use nu_recv_error() instead. */
+	while( (rv = nu_recv_error( socket, buffer, sizeof(buffer), p_id, p_timestamp )) > 0 )
+	{
+	}
+
+	return rv == 0;
+}
+
+uint64_t nu_drain_tx_timestamps( int socket, uint32_t id )
+{
+	uint64_t result = 0;
+	uint32_t tx_id;
+	uint64_t timestamp;
+
+	/* Older entries belong to sends whose replies never came. */
+	while( nu_read_tx_timestamp( socket, &tx_id, &timestamp ) )
+	{
+		if( tx_id == id )
+		{
+			result = timestamp;
+		}
+	}
+
+	return result;
+}
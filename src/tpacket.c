@@ -0,0 +1,520 @@
+/* Copyright (C) 2013 by Joseph A. Marrero, https://joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include "libnu-config.h"
+#if defined(HAVE_LINUX_IF_PACKET_H)
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#endif
+#include "netutils.h"
+#include "netutils-internal.h"
+
+#if defined(HAVE_LINUX_IF_PACKET_H) && defined(TPACKET3_HDRLEN)
+# define NU_TPACKET 1
+#endif
+
+#if defined(NU_TPACKET)
+#define NU_TPACKET_FRAME_SIZE  2048  /* only a sanity check for the kernel; V3 frames are packed */
+
+struct packet_ring {
+	int socket;
+	uint8_t* map;
+	size_t block_size;
+	size_t block_count;
+	size_t block;                        /* next block to take */
+	struct tpacket_block_desc* current;  /* block being read, or NULL */
+	const uint8_t* frame;                /* next frame in it */
+	uint32_t frames_left;
+	uint64_t received;
+	uint64_t dropped;
+};
+
+packet_ring_t* nu_packet_ring_create( const char* interface, size_t block_size, size_t block_count, uint32_t block_timeout )
+{
+	packet_ring_t* ring = (packet_ring_t*) calloc( 1, sizeof(packet_ring_t) );
+
+	if( !ring )
+	{
+		return NULL;
+	}
+
+	/* Blocks are whole pages; the kernel rejects anything else. */
+	long page_size = sysconf( _SC_PAGESIZE );
+	block_size = (block_size + page_size - 1) & ~((size_t) page_size - 1);
+	if( block_size < NU_TPACKET_FRAME_SIZE ) block_size = page_size;
+	if( block_count == 0 ) block_count = 1;
+
+	ring->map         = MAP_FAILED;
+	ring->block_size  = block_size;
+	ring->block_count = block_count;
+
+	/* Datagram packet sockets strip the link-layer header, so frames start
+	 * at the IP header, just like on a raw socket. */
+	ring->socket = socket( AF_PACKET, SOCK_DGRAM, htons( ETH_P_IP ) );
+
+	if( ring->socket < 0 )
+	{
+		trace( "Unable to create packet socket.\n" );
+		#if defined(DEBUG_NETUTILS)
+		perror( "ERROR" );
+		#endif
+		goto failed;
+	}
+
+	const int version = TPACKET_V3;
+	struct tpacket_req3 request = {
+		.tp_block_size       = (unsigned) block_size,
+		.tp_block_nr         = (unsigned) block_count,
+		.tp_frame_size       = NU_TPACKET_FRAME_SIZE,
+		.tp_frame_nr         = (unsigned) (block_size / NU_TPACKET_FRAME_SIZE * block_count),
+		.tp_retire_blk_tov   = block_timeout,
+		.tp_sizeof_priv      = 0,
+		.tp_feature_req_word = 0
+	};
+
+	if( setsockopt( ring->socket, SOL_PACKET, PACKET_VERSION, &version, sizeof(version) ) < 0 ||
+	    setsockopt( ring->socket, SOL_PACKET, PACKET_RX_RING, &request, sizeof(request) ) < 0 )
+	{
+		trace( "Unable to set up TPACKET_V3 ring [errno = %d].\n", errno );
+		goto failed;
+	}
+
+	ring->map = (uint8_t*) mmap( NULL, block_size * block_count, PROT_READ | PROT_WRITE, MAP_SHARED, ring->socket, 0 );
+
+	if( ring->map == MAP_FAILED )
+	{
+		trace( "Unable to map packet ring [errno = %d].\n", errno );
+		goto failed;
+	}
+
+	struct sockaddr_ll address;
+	memset( &address, 0, sizeof(address) );
+	address.sll_family   = AF_PACKET;
+	address.sll_protocol = htons( ETH_P_IP );
+	address.sll_ifindex  = interface ? (int) if_nametoindex( interface ) : 0;
+
+	if( (interface && address.sll_ifindex == 0) ||
+	    bind( ring->socket, (struct sockaddr*) &address, sizeof(address) ) < 0 )
+	{
+		trace( "Unable to bind packet socket to %s [errno = %d].\n", interface ? interface : "all interfaces", errno );
+		goto failed;
+	}
+
+	return ring;
+
+failed:
+	nu_packet_ring_destroy( &ring );
+	return NULL;
+}
+
+void nu_packet_ring_destroy( packet_ring_t** p_ring )
+{
+	if( p_ring && *p_ring )
+	{
+		packet_ring_t* ring = *p_ring;
+
+		if( ring->map != MAP_FAILED ) munmap( ring->map, ring->block_size * ring->block_count );
+		if( ring->socket >= 0 ) close( ring->socket );
+		free( ring );
+		*p_ring = NULL;
+	}
+}
+
+int nu_packet_ring_fd( const packet_ring_t* ring )
+{
+	return ring->socket;
+}
+
+bool nu_packet_ring_set_filter( packet_ring_t* ring, bool icmp, bool udp )
+{
+	/* Frames start at the IP header; what this host sends is skipped. */
+	struct sock_filter code[] = {
+		/* 0 */ BPF_STMT( BPF_LD | BPF_B | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE ),
+		/* 1 */ BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 4, 0 ),
+		/* 2 */ BPF_STMT( BPF_LD | BPF_B | BPF_ABS, 9 ),                     /* a = ip protocol */
+		/* 3 */ BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, icmp ? IPPROTO_ICMP : 0x100, 2, 0 ),
+		/* 4 */ BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, udp ? IPPROTO_UDP : 0x100, 1, 0 ),
+		/* 5 */ BPF_STMT( BPF_RET | BPF_K, 0 ),
+		/* 6 */ BPF_STMT( BPF_RET | BPF_K, IP_MAXPACKET ),
+	};
+	struct sock_fprog program = {
+		.len    = sizeof(code) / sizeof(code[ 0 ]),
+		.filter = code
+	};
+
+	return setsockopt( ring->socket, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program) ) == 0;
+}
+
+bool nu_packet_ring_block( packet_ring_t* ring )
+{
+	if( ring->current )
+	{
+		return true;
+	}
+
+	struct tpacket_block_desc* block = (struct tpacket_block_desc*) (ring->map + ring->block * ring->block_size);
+
+	if( !(__atomic_load_n( &block->hdr.bh1.block_status, __ATOMIC_ACQUIRE ) & TP_STATUS_USER) )
+	{
+		return false;
+	}
+
+	ring->current     = block;
+	ring->frame       = (const uint8_t*) block + block->hdr.bh1.offset_to_first_pkt;
+	ring->frames_left = block->hdr.bh1.num_pkts;
+	return true;
+}
+
+bool nu_packet_ring_frame( packet_ring_t* ring, packet_frame_t* frame )
+{
+	if( !ring->current || ring->frames_left == 0 )
+	{
+		return false;
+	}
+
+	const struct tpacket3_hdr* header = (const struct tpacket3_hdr*) ring->frame;
+
+	frame->data      = ring->frame + header->tp_net;
+	frame->length    = header->tp_snaplen;
+	frame->original  = header->tp_len;
+	frame->timestamp = (uint64_t) header->tp_sec * 1000000000ULL + header->tp_nsec;
+
+	ring->frame       += header->tp_next_offset;
+	ring->frames_left -= 1;
+	return true;
+}
+
+void nu_packet_ring_release( packet_ring_t* ring )
+{
+	if( ring->current )
+	{
+		__atomic_store_n( &ring->current->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE );
+		ring->current = NULL;
+		ring->block   = (ring->block + 1) % ring->block_count;
+	}
+}
+
+void nu_packet_ring_stats( packet_ring_t* ring, uint64_t* p_received, uint64_t* p_dropped )
+{
+	/* The kernel resets its counters every time they are read. */
+	struct tpacket_stats_v3 stats;
+	socklen_t length = sizeof(stats);
+
+	if( getsockopt( ring->socket, SOL_PACKET, PACKET_STATISTICS, &stats, &length ) == 0 )
+	{
+		ring->received += stats.tp_packets;
+		ring->dropped  += stats.tp_drops;
+	}
+
+	if( p_received ) *p_received = ring->received;
+	if( p_dropped ) *p_dropped = ring->dropped;
+}
+
+#define NU_TX_RING_FRAME_SIZE  2048
+#define NU_TX_RING_BLOCK_SIZE  (64 * 1024)
+#define NU_TX_RING_MAC         (TPACKET_ALIGN(sizeof(struct tpacket2_hdr)) + 2) /* puts the IP header 16-byte aligned */
+#define NU_TX_RING_DATA        (NU_TX_RING_MAC + ETH_HLEN)
+
+struct tx_ring {
+	int socket;
+	uint8_t* map;
+	size_t frame_count;
+	size_t mtu;         /* largest datagram a frame can take */
+	size_t head;        /* next frame to fill */
+	size_t queued;      /* committed since the last flush */
+};
+
+static inline struct tpacket2_hdr* tx_ring_frame( const tx_ring_t* ring, size_t index )
+{
+	/* Blocks are a whole number of frames, so frames are evenly spaced. */
+	return (struct tpacket2_hdr*) (ring->map + index * NU_TX_RING_FRAME_SIZE);
+}
+
+tx_ring_t* nu_tx_ring_create( const char* interface, const uint8_t dst_mac[ 6 ], size_t frame_count )
+{
+	tx_ring_t* ring = (tx_ring_t*) calloc( 1, sizeof(tx_ring_t) );
+
+	if( !ring )
+	{
+		return NULL;
+	}
+
+	const size_t frames_per_block = NU_TX_RING_BLOCK_SIZE / NU_TX_RING_FRAME_SIZE;
+	size_t block_count = (frame_count + frames_per_block - 1) / frames_per_block;
+	if( block_count == 0 ) block_count = 1;
+
+	ring->map         = MAP_FAILED;
+	ring->frame_count = block_count * frames_per_block;
+	ring->socket      = socket( AF_PACKET, SOCK_RAW, htons( ETH_P_IP ) );
+
+	if( ring->socket < 0 )
+	{
+		trace( "Unable to create packet socket.\n" );
+		#if defined(DEBUG_NETUTILS)
+		perror( "ERROR" );
+		#endif
+		goto failed;
+	}
+
+	struct ifreq request;
+	memset( &request, 0, sizeof(request) );
+
+	if( !interface || strlen( interface ) >= sizeof(request.ifr_name) )
+	{
+		errno = EINVAL;
+		goto failed;
+	}
+
+	strcpy( request.ifr_name, interface );
+
+	if( ioctl( ring->socket, SIOCGIFMTU, &request ) < 0 )
+	{
+		trace( "Unable to read the MTU of %s [errno = %d].\n", interface, errno );
+		goto failed;
+	}
+
+	ring->mtu = NU_TX_RING_FRAME_SIZE - NU_TX_RING_DATA;
+	if( (size_t) request.ifr_mtu < ring->mtu ) ring->mtu = request.ifr_mtu;
+
+	if( ioctl( ring->socket, SIOCGIFHWADDR, &request ) < 0 )
+	{
+		trace( "Unable to read the hardware address of %s [errno = %d].\n", interface, errno );
+		goto failed;
+	}
+
+	/* Malformed frames are skipped rather than stalling the ring, and
+	 * data starts where each frame says (tp_mac) so it can be aligned. */
+	const int version = TPACKET_V2;
+	const int on      = 1;
+	struct tpacket_req tx_request = {
+		.tp_block_size = NU_TX_RING_BLOCK_SIZE,
+		.tp_block_nr   = (unsigned) block_count,
+		.tp_frame_size = NU_TX_RING_FRAME_SIZE,
+		.tp_frame_nr   = (unsigned) ring->frame_count
+	};
+
+	if( setsockopt( ring->socket, SOL_PACKET, PACKET_VERSION, &version, sizeof(version) ) < 0 ||
+	    setsockopt( ring->socket, SOL_PACKET, PACKET_LOSS, &on, sizeof(on) ) < 0 ||
+	    setsockopt( ring->socket, SOL_PACKET, PACKET_TX_HAS_OFF, &on, sizeof(on) ) < 0 ||
+	    setsockopt( ring->socket, SOL_PACKET, PACKET_TX_RING, &tx_request, sizeof(tx_request) ) < 0 )
+	{
+		trace( "Unable to set up PACKET_TX_RING [errno = %d].\n", errno );
+		goto failed;
+	}
+
+	#if defined(PACKET_QDISC_BYPASS)
+	setsockopt( ring->socket, SOL_PACKET, PACKET_QDISC_BYPASS, &on, sizeof(on) );
+	#endif
+
+	ring->map = (uint8_t*) mmap( NULL, ring->frame_count * NU_TX_RING_FRAME_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ring->socket, 0 );
+
+	if( ring->map == MAP_FAILED )
+	{
+		trace( "Unable to map packet ring [errno = %d].\n", errno );
+		goto failed;
+	}
+
+	struct sockaddr_ll address;
+	memset( &address, 0, sizeof(address) );
+	address.sll_family   = AF_PACKET;
+	address.sll_protocol = htons( ETH_P_IP );
+	address.sll_ifindex  = (int) if_nametoindex( interface );
+
+	if( address.sll_ifindex == 0 || bind( ring->socket, (struct sockaddr*) &address, sizeof(address) ) < 0 )
+	{
+		trace( "Unable to bind packet socket to %s [errno = %d].\n", interface, errno );
+		goto failed;
+	}
+
+	/* The Ethernet header is the same for every frame; write it once. */
+	struct ethhdr ethernet;
+	if( dst_mac ) memcpy( ethernet.h_dest, dst_mac, ETH_ALEN );
+	else memset( ethernet.h_dest, 0, ETH_ALEN );
+	memcpy( ethernet.h_source, request.ifr_hwaddr.sa_data, ETH_ALEN );
+	ethernet.h_proto = htons( ETH_P_IP );
+
+	for( size_t i = 0; i < ring->frame_count; i++ )
+	{
+		memcpy( (uint8_t*) tx_ring_frame( ring, i ) + NU_TX_RING_MAC, &ethernet, ETH_HLEN );
+	}
+
+	return ring;
+
+failed:
+	nu_tx_ring_destroy( &ring );
+	return NULL;
+}
+
+void nu_tx_ring_destroy( tx_ring_t** p_ring )
+{
+	if( p_ring && *p_ring )
+	{
+		tx_ring_t* ring = *p_ring;
+
+		if( ring->map != MAP_FAILED ) munmap( ring->map, ring->frame_count * NU_TX_RING_FRAME_SIZE );
+		if( ring->socket >= 0 ) close( ring->socket );
+		free( ring );
+		*p_ring = NULL;
+	}
+}
+
+int nu_tx_ring_fd( const tx_ring_t* ring )
+{
+	return ring->socket;
+}
+
+/* Ask the kernel to send every frame marked for sending; with wait set,
+ * also wait until the frames it was still sending are released. */
+static bool tx_ring_kick( tx_ring_t* ring, bool wait )
+{
+	ssize_t rv;
+
+	do
+	{
+		rv = send( ring->socket, NULL, 0, wait ? 0 : MSG_DONTWAIT );
+	} while( rv < 0 && errno == EINTR );
+
+	/* A full device queue leaves the frames marked; the next kick retries. */
+	if( rv < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS )
+	{
+		trace( "Unable to send from packet ring [errno = %d].\n", errno );
+		return false;
+	}
+
+	ring->queued = 0;
+	return true;
+}
+
+void* nu_tx_ring_slot( tx_ring_t* ring, size_t* p_size )
+{
+	struct tpacket2_hdr* header = tx_ring_frame( ring, ring->head );
+
+	while( __atomic_load_n( &header->tp_status, __ATOMIC_ACQUIRE ) != TP_STATUS_AVAILABLE )
+	{
+		/* The ring is full. */
+		if( !tx_ring_kick( ring, true ) )
+		{
+			return NULL;
+		}
+	}
+
+	*p_size = ring->mtu;
+	return (uint8_t*) header + NU_TX_RING_DATA;
+}
+
+void nu_tx_ring_commit( tx_ring_t* ring, size_t length )
+{
+	struct tpacket2_hdr* header = tx_ring_frame( ring, ring->head );
+
+	assert( length <= ring->mtu );
+	header->tp_len = (uint32_t) (ETH_HLEN + length);
+	header->tp_mac = NU_TX_RING_MAC;
+	header->tp_net = NU_TX_RING_DATA;
+	__atomic_store_n( &header->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE );
+
+	ring->head    = (ring->head + 1) % ring->frame_count;
+	ring->queued += 1;
+}
+
+bool nu_tx_ring_flush( tx_ring_t* ring )
+{
+	return ring->queued == 0 || tx_ring_kick( ring, false );
+}
+
+#else /* !NU_TPACKET */
+
+packet_ring_t* nu_packet_ring_create( const char* interface, size_t block_size, size_t block_count, uint32_t block_timeout )
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void nu_packet_ring_destroy( packet_ring_t** p_ring )
+{
+}
+
+int nu_packet_ring_fd( const packet_ring_t* ring )
+{
+	return -1;
+}
+
+bool nu_packet_ring_set_filter( packet_ring_t* ring, bool icmp, bool udp )
+{
+	return false;
+}
+
+bool nu_packet_ring_block( packet_ring_t* ring )
+{
+	return false;
+}
+
+bool nu_packet_ring_frame( packet_ring_t* ring, packet_frame_t* frame )
+{
+	return false;
+}
+
+void nu_packet_ring_release( packet_ring_t* ring )
+{
+}
+
+void nu_packet_ring_stats( packet_ring_t* ring, uint64_t* p_received, uint64_t* p_dropped )
+{
+	if( p_received ) *p_received = 0;
+	if( p_dropped ) *p_dropped = 0;
+}
+
+tx_ring_t* nu_tx_ring_create( const char* interface, const uint8_t dst_mac[ 6 ], size_t frame_count )
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void nu_tx_ring_destroy( tx_ring_t** p_ring )
+{
+}
+
+int nu_tx_ring_fd( const tx_ring_t* ring )
+{
+	return -1;
+}
+
+void* nu_tx_ring_slot( tx_ring_t* ring, size_t* p_size )
+{
+	return NULL;
+}
+
+void nu_tx_ring_commit( tx_ring_t* ring, size_t length )
+{
+}
+
+bool nu_tx_ring_flush( tx_ring_t* ring )
+{
+	return false;
+}
+
+#endif /* NU_TPACKET */
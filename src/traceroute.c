@@ -0,0 +1,152 @@
+/* Copyright (C) 2013 by Joseph A. Marrero, https://joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <assert.h>
+#include "netutils.h"
+#include "netutils-internal.h"
+
+typedef struct traceroute {
+	struct in_addr dst;
+	traceroute_hop_t* hops;
+	uint8_t max_hops;
+	uint8_t dst_ttl;      /* lowest TTL the destination answered at, or 0 */
+	uint32_t* pending;    /* probes outstanding per TTL */
+} traceroute_t;
+
+static void traceroute_result( const probe_result_t* result, void* context )
+{
+	traceroute_t* trace = (traceroute_t*) context;
+	uint8_t index = result->ttl - 1;
+	traceroute_hop_t* hop = &trace->hops[ index ];
+
+	assert( result->ttl >= 1 && result->ttl <= trace->max_hops );
+	trace->pending[ index ] -= 1;
+
+	if( result->timed_out )
+	{
+		hop->stats.lost += 1;
+		return;
+	}
+
+	if( hop->addr.s_addr == INADDR_ANY )
+	{
+		hop->addr      = result->from;
+		hop->icmp_type = result->icmp_type;
+		hop->icmp_code = result->icmp_code;
+	}
+
+	nu_ping_stats_record( &hop->stats, result->latency );
+
+	/* An echo reply, or the destination refusing us, ends the path. */
+	if( result->icmp_type == ICMP_ECHOREPLY || result->icmp_type == ICMP_UNREACH )
+	{
+		if( trace->dst_ttl == 0 || result->ttl < trace->dst_ttl )
+		{
+			trace->dst_ttl = result->ttl;
+		}
+	}
+}
+
+static bool traceroute_done( const traceroute_t* trace )
+{
+	uint8_t last = trace->dst_ttl ? trace->dst_ttl : trace->max_hops;
+
+	for( uint8_t ttl = 1; ttl <= last; ttl++ )
+	{
+		if( trace->pending[ ttl - 1 ] > 0 )
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool nu_traceroute( struct in_addr dst, uint8_t max_hops /* max = MAXTTL */, uint32_t count, uint32_t timeout, traceroute_hop_t hops[], uint8_t* p_hop_count )
+{
+	bool result      = false;
+	prober_t* prober = NULL;
+	traceroute_t trace = {
+		.dst      = dst,
+		.hops     = hops,
+		.max_hops = max_hops,
+		.dst_ttl  = 0,
+		.pending  = (uint32_t*) calloc( max_hops, sizeof(uint32_t) )
+	};
+
+	if( !trace.pending || max_hops == 0 || count == 0 )
+	{
+		goto done;
+	}
+
+	memset( hops, 0, max_hops * sizeof(traceroute_hop_t) );
+
+	prober = nu_prober_create( (size_t) max_hops * count, timeout, traceroute_result, &trace );
+
+	if( !prober )
+	{
+		goto done;
+	}
+
+	/* Fire every probe up front, interleaving TTLs so that each round
+	 * covers the whole path. */
+	for( uint32_t i = 0; i < count; i++ )
+	{
+		for( uint8_t ttl = 1; ttl <= max_hops; ttl++ )
+		{
+			hops[ ttl - 1 ].stats.count += 1;
+
+			if( nu_prober_submit( prober, dst, ttl, NULL ) )
+			{
+				trace.pending[ ttl - 1 ] += 1;
+			}
+			else
+			{
+				hops[ ttl - 1 ].stats.lost += 1;
+			}
+		}
+	}
+
+	/* Probes beyond the destination's TTL are abandoned once the hops in
+	 * front of it are accounted for. */
+	while( !traceroute_done( &trace ) )
+	{
+		if( nu_prober_poll( prober, timeout ) < 0 )
+		{
+			goto done;
+		}
+	}
+
+	if( p_hop_count )
+	{
+		*p_hop_count = trace.dst_ttl ? trace.dst_ttl : max_hops;
+	}
+
+	result = true;
+
+done:
+	nu_prober_destroy( &prober );
+	free( trace.pending );
+	return result;
+}
@@ -0,0 +1,99 @@
+/* Copyright (C) 2013 by Joseph A. Marrero, https://joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <poll.h>
+#include "netutils.h"
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+void nu_transfer_init( transfer_t* transfer, bool send, void* data, size_t size )
+{
+	transfer->data   = (uint8_t*) data;
+	transfer->size   = size;
+	transfer->offset = 0;
+	transfer->send   = send;
+}
+
+nu_result_t nu_transfer_resume( int socket, transfer_t* transfer )
+{
+	while( transfer->offset < transfer->size )
+	{
+		uint8_t* data = transfer->data + transfer->offset;
+		size_t size   = transfer->size - transfer->offset;
+		ssize_t rv;
+
+		/* MSG_DONTWAIT so a cursor never blocks, even on a blocking socket. */
+		if( transfer->send )
+		{
+			rv = send( socket, data, size, MSG_DONTWAIT | MSG_NOSIGNAL );
+		}
+		else
+		{
+			rv = recv( socket, data, size, MSG_DONTWAIT );
+		}
+
+		if( rv > 0 )
+		{
+			transfer->offset += (size_t) rv;
+			continue;
+		}
+
+		if( rv == 0 )
+		{
+			/* tcp connection closed by peer */
+			errno = 0;
+			return NU_FAILED;
+		}
+
+		switch( errno )
+		{
+			case EINTR: // interrupted by signal...
+				continue;
+			case EAGAIN: // EWOULDBLOCK
+				return NU_TRYAGAIN;
+			case ENOTSOCK: // client socket is not a socket.
+			case EINVAL: // invalid argument passed.
+			case EFAULT: // the buffer is outside process's address space
+			case EBADF:  // bad socket/file descriptor
+				assert( false ); // these are programming errors
+			case ECONNRESET: // connection reset by peer
+			case EPIPE:
+			default:
+				return NU_FAILED;
+		}
+	}
+
+	return NU_SUCCESS;
+}
+
+short nu_transfer_events( const transfer_t* transfer )
+{
+	return transfer->send ? POLLOUT : POLLIN;
+}
+
+size_t nu_transfer_remaining( const transfer_t* transfer )
+{
+	return transfer->size - transfer->offset;
+}
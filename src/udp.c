@@ -18,18 +18,57 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* sendmmsg */
+#endif
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/time.h>
 #include <errno.h>
 #include <assert.h>
+#include "libnu-config.h"
 #include "netutils.h"
+#include "netutils-internal.h"
+
+#define NU_UDP_GENERATOR_RING  64 /* prebuilt packets, and probes per sendmmsg() call */
+
+struct udp_generator {
+	int socket;
+	struct in_addr src;          /* INADDR_ANY: looked up for every destination */
+	struct in_addr route_dst;    /* last lookup */
+	struct in_addr route_src;
+	bool route_valid;
+	packet_t* packets[ NU_UDP_GENERATOR_RING ];
+	#if defined(HAVE_SENDMMSG)
+	struct mmsghdr messages[ NU_UDP_GENERATOR_RING ];
+	#endif
+	struct iovec iovecs[ NU_UDP_GENERATOR_RING ];
+	struct sockaddr_in addresses[ NU_UDP_GENERATOR_RING ];
+};
 
 packet_t* nu_udp_create( struct in_addr ip_src, uint16_t sport, struct in_addr ip_dst, uint16_t dport, const void* udp_payload, size_t udp_payload_size )
+{
+	size_t packet_size = nu_packet_size( NU_UDP_HDRLEN + udp_payload_size );
+	packet_t* packet   = nu_packet_alloc( packet_size );
+
+	if( packet )
+	{
+		nu_udp_init( packet, packet_size, ip_src, sport, ip_dst, dport, udp_payload, udp_payload_size );
+
+		#ifdef DEBUG_NETUTILS
+		trace( "UDP packet created.\n" );
+		#endif
+	}
+
+	return packet;
+}
+
+packet_t* nu_udp_init( void* buffer, size_t buffer_size, struct in_addr ip_src, uint16_t sport, struct in_addr ip_dst, uint16_t dport,
+                       const void* udp_payload, size_t udp_payload_size )
 {
 	size_t ip_payload_size = NU_UDP_HDRLEN + udp_payload_size;
-	packet_t* packet       = nu_packet_create( IPPROTO_UDP, ip_src, ip_dst, ip_payload_size );
+	packet_t* packet       = nu_packet_init( buffer, buffer_size, IPPROTO_UDP, ip_src, ip_dst, ip_payload_size );
 
 	if( packet )
 	{
@@ -47,10 +86,6 @@ packet_t* nu_udp_create( struct in_addr ip_src, uint16_t sport, struct in_addr i
 
 			nu_udp_recalc_checksum( packet, udp_payload_size );
 		}
-
-		#ifdef DEBUG_NETUTILS
-		trace( "UDP packet created.\n" );
-		#endif
 	}
 
 	return packet;
@@ -58,13 +93,493 @@ packet_t* nu_udp_create( struct in_addr ip_src, uint16_t sport, struct in_addr i
 
 void nu_udp_recalc_checksum( packet_t* packet, size_t udp_payload_size )
 {
-	struct icmp* udp_header = (struct icmp*) packet->payload;
-	size_t ip_payload_size   = NU_UDP_HDRLEN + udp_payload_size;
+	struct udphdr* udp_header = nu_udp_header( packet );
+	size_t ip_payload_size    = NU_UDP_HDRLEN + udp_payload_size;
+
+	udp_header->uh_ulen = htons( (uint16_t) ip_payload_size );
+	udp_header->uh_sum  = 0; /* UDP checksum (16 bits): set to 0 when calculating checksum */
+
+	uint64_t sum = nu_checksum_pseudo_header( packet->ip_header.ip_src, packet->ip_header.ip_dst, IPPROTO_UDP, (uint16_t) ip_payload_size );
+	sum = nu_checksum_partial( udp_header, ip_payload_size, sum );
 
-	/* Calculate UDP header checksum */
-	udp_header->icmp_cksum = 0; /* UDP header checksum (16 bits): set to 0 when calculating checksum */
-	udp_header->icmp_cksum = nu_checksum( packet->payload, ip_payload_size );
+	uint16_t checksum  = nu_checksum_fold( sum );
+	udp_header->uh_sum = checksum ? checksum : 0xffff; /* 0 would mean no checksum at all */
 
 	nu_packet_recalc_checksum( packet, ip_payload_size );
 }
 
+struct udphdr* nu_udp_header( const packet_t* packet )
+{
+	return (struct udphdr*) ((uint8_t*) &packet->ip_header + (packet->ip_header.ip_hl << 2));
+}
+
+uint8_t* nu_udp_payload( const packet_t* packet )
+{
+	return (uint8_t*) nu_udp_header( packet ) + NU_UDP_HDRLEN;
+}
+
+void nu_udp_stamp( packet_t* packet, struct in_addr ip_src, struct in_addr ip_dst, uint16_t sport, uint16_t dport, uint8_t ttl )
+{
+	struct udphdr* udp_header = nu_udp_header( packet );
+
+	/* The addresses are contiguous in the pseudo-header, and so are the
+	 * ports in the UDP header, so each pair is adjusted in one go. */
+	struct in_addr old_addresses[ 2 ] = { packet->ip_header.ip_src, packet->ip_header.ip_dst };
+	struct in_addr new_addresses[ 2 ] = { ip_src, ip_dst };
+	uint16_t old_ports[ 2 ] = { udp_header->uh_sport, udp_header->uh_dport };
+	uint16_t new_ports[ 2 ] = { htons( sport ), htons( dport ) };
+
+	uint16_t checksum = udp_header->uh_sum;
+	checksum = nu_checksum_adjust( checksum, old_addresses, new_addresses, sizeof(old_addresses) );
+	checksum = nu_checksum_adjust( checksum, old_ports, new_ports, sizeof(old_ports) );
+
+	udp_header->uh_sport = new_ports[ 0 ];
+	udp_header->uh_dport = new_ports[ 1 ];
+	udp_header->uh_sum   = checksum ? checksum : 0xffff;
+
+	packet->ip_header.ip_src = ip_src;
+	packet->ip_header.ip_dst = ip_dst;
+	packet->ip_header.ip_ttl = ttl;
+	nu_packet_recalc_checksum( packet, nu_packet_ip_length( packet ) - (packet->ip_header.ip_hl << 2) );
+}
+
+bool nu_udp_parse_error( const packet_view_t* view, struct in_addr* p_from, udp_probe_t* p_probe, uint8_t* p_type, uint8_t* p_code )
+{
+	const struct icmp* icmp_header = nu_packet_view_icmp_header( view );
+	packet_view_t quoted;
+
+	if( !icmp_header || !nu_icmp_view_quoted( view, &quoted ) )
+	{
+		return false;
+	}
+
+	const struct udphdr* udp_header = nu_packet_view_udp_header( &quoted );
+
+	if( !udp_header )
+	{
+		return false;
+	}
+
+	*p_from        = view->ip_header->ip_src;
+	*p_type        = icmp_header->icmp_type;
+	*p_code        = icmp_header->icmp_code;
+	p_probe->dst   = quoted.ip_header->ip_dst;
+	p_probe->sport = ntohs( udp_header->uh_sport );
+	p_probe->dport = ntohs( udp_header->uh_dport );
+	p_probe->ttl   = 0;
+	return true;
+}
+
+udp_generator_t* nu_udp_generator_create( struct in_addr src, const void* payload, size_t payload_size )
+{
+	udp_generator_t* generator = (udp_generator_t*) calloc( 1, sizeof(udp_generator_t) );
+
+	if( !generator )
+	{
+		return NULL;
+	}
+
+	generator->src    = src;
+	generator->socket = socket( AF_INET, SOCK_RAW, IPPROTO_RAW );
+
+	if( generator->socket < 0 || !nu_set_include_header( generator->socket, true ) )
+	{
+		trace( "Unable to create raw socket.\n" );
+		#if defined(DEBUG_NETUTILS)
+		perror( "ERROR" );
+		#endif
+		goto failed;
+	}
+
+	for( size_t i = 0; i < NU_UDP_GENERATOR_RING; i++ )
+	{
+		packet_t* packet = nu_udp_create( src, 0, src, 0, payload, payload_size );
+
+		if( !packet )
+		{
+			goto failed;
+		}
+
+		/* The messages never change; sending only rewrites the packets and
+		 * the destination addresses. */
+		generator->packets[ i ]          = packet;
+		generator->iovecs[ i ].iov_base  = &packet->ip_header;
+		generator->iovecs[ i ].iov_len   = nu_packet_ip_length( packet );
+		nu_set_ipaddress( &generator->addresses[ i ], src, 0 );
+		#if defined(HAVE_SENDMMSG)
+		generator->messages[ i ].msg_hdr.msg_name    = &generator->addresses[ i ];
+		generator->messages[ i ].msg_hdr.msg_namelen = sizeof(generator->addresses[ i ]);
+		generator->messages[ i ].msg_hdr.msg_iov     = &generator->iovecs[ i ];
+		generator->messages[ i ].msg_hdr.msg_iovlen  = 1;
+		#endif
+	}
+
+	return generator;
+
+failed:
+	nu_udp_generator_destroy( &generator );
+	return NULL;
+}
+
+void nu_udp_generator_destroy( udp_generator_t** p_generator )
+{
+	if( p_generator && *p_generator )
+	{
+		udp_generator_t* generator = *p_generator;
+
+		if( generator->socket >= 0 )
+		{
+			close( generator->socket );
+		}
+
+		for( size_t i = 0; i < NU_UDP_GENERATOR_RING; i++ )
+		{
+			if( generator->packets[ i ] )
+			{
+				nu_packet_destroy( &generator->packets[ i ] );
+			}
+		}
+
+		free( generator );
+		*p_generator = NULL;
+	}
+}
+
+int nu_udp_generator_fd( const udp_generator_t* generator )
+{
+	return generator->socket;
+}
+
+static bool udp_generator_source( udp_generator_t* generator, struct in_addr dst, struct in_addr* p_src )
+{
+	if( generator->src.s_addr != INADDR_ANY )
+	{
+		*p_src = generator->src;
+		return true;
+	}
+
+	if( !generator->route_valid || generator->route_dst.s_addr != dst.s_addr )
+	{
+		if( !nu_source_address( dst, &generator->route_src ) )
+		{
+			generator->route_valid = false;
+			return false;
+		}
+
+		generator->route_dst   = dst;
+		generator->route_valid = true;
+	}
+
+	*p_src = generator->route_src;
+	return true;
+}
+
+size_t nu_udp_generator_send( udp_generator_t* generator, const udp_probe_t probes[], size_t count )
+{
+	size_t sent = 0;
+	bool stop   = false;
+
+	while( sent < count && !stop )
+	{
+		size_t batch_size = count - sent;
+		if( batch_size > NU_UDP_GENERATOR_RING ) batch_size = NU_UDP_GENERATOR_RING;
+
+		for( size_t i = 0; i < batch_size; i++ )
+		{
+			const udp_probe_t* probe = &probes[ sent + i ];
+			struct in_addr src;
+
+			if( !udp_generator_source( generator, probe->dst, &src ) )
+			{
+				batch_size = i;
+				stop       = true;
+				break;
+			}
+
+			nu_udp_stamp( generator->packets[ i ], src, probe->dst, probe->sport, probe->dport, probe->ttl ? probe->ttl : IPDEFTTL );
+			generator->addresses[ i ].sin_addr = probe->dst;
+		}
+
+		#if defined(HAVE_SENDMMSG)
+		size_t batch_sent = 0;
+
+		while( batch_sent < batch_size )
+		{
+			int rv = sendmmsg( generator->socket, &generator->messages[ batch_sent ], batch_size - batch_sent, 0 );
+
+			if( rv < 0 )
+			{
+				if( errno == EINTR ) continue;
+				trace( "Unable to send UDP probes [errno = %d].\n", errno );
+				stop = true;
+				break;
+			}
+
+			batch_sent += rv;
+		}
+		#else
+		size_t batch_sent = 0;
+
+		for( ; batch_sent < batch_size; batch_sent++ )
+		{
+			if( sendto( generator->socket, generator->iovecs[ batch_sent ].iov_base, generator->iovecs[ batch_sent ].iov_len, 0,
+			            (struct sockaddr*) &generator->addresses[ batch_sent ], sizeof(generator->addresses[ batch_sent ]) ) < 0 )
+			{
+				trace( "Unable to send UDP probes [errno = %d].\n", errno );
+				stop = true;
+				break;
+			}
+		}
+		#endif
+
+		sent += batch_sent;
+	}
+
+	return sent;
+}
+
+#define NU_UDP_MAX_PAYLOAD  (IP_MAXPACKET - NU_IP4_HDRLEN - NU_UDP_HDRLEN)
+
+static bool udp_send_datagrams( int socket, const uint8_t* data, size_t size, size_t segment_size, const struct sockaddr_in* dst )
+{
+	size_t offset = 0;
+
+	#if defined(HAVE_SENDMMSG)
+	struct mmsghdr messages[ NU_UDP_MAX_SEGMENTS ];
+	struct iovec iovecs[ NU_UDP_MAX_SEGMENTS ];
+
+	while( offset < size )
+	{
+		size_t count = 0;
+
+		for( size_t o = offset; o < size && count < NU_UDP_MAX_SEGMENTS; o += segment_size, count++ )
+		{
+			iovecs[ count ].iov_base = (void*) (data + o);
+			iovecs[ count ].iov_len  = (size - o < segment_size) ? size - o : segment_size;
+
+			memset( &messages[ count ], 0, sizeof(messages[ count ]) );
+			messages[ count ].msg_hdr.msg_name    = (void*) dst;
+			messages[ count ].msg_hdr.msg_namelen = dst ? sizeof(*dst) : 0;
+			messages[ count ].msg_hdr.msg_iov     = &iovecs[ count ];
+			messages[ count ].msg_hdr.msg_iovlen  = 1;
+		}
+
+		int rv = sendmmsg( socket, messages, count, 0 );
+
+		if( rv < 0 )
+		{
+			if( errno == EINTR ) continue;
+			trace( "Unable to send datagrams [errno = %d].\n", errno );
+			return false;
+		}
+
+		offset += rv * segment_size;
+	}
+	#else
+	for( ; offset < size; offset += segment_size )
+	{
+		size_t length = (size - offset < segment_size) ? size - offset : segment_size;
+
+		ssize_t rv;
+
+		do
+		{
+			rv = sendto( socket, data + offset, length, 0, (const struct sockaddr*) dst, dst ? sizeof(*dst) : 0 );
+		} while( rv < 0 && errno == EINTR );
+
+		if( rv < 0 )
+		{
+			trace( "Unable to send datagrams [errno = %d].\n", errno );
+			return false;
+		}
+	}
+	#endif
+
+	return true;
+}
+
+#if defined(UDP_SEGMENT)
+static bool udp_gso_supported( int socket )
+{
+	/* Kernels before 4.18 would quietly ignore the UDP_SEGMENT control
+	 * message and send one oversized datagram, so ask first; once. */
+	static int supported = -1;
+
+	if( supported < 0 )
+	{
+		int segment_size;
+		socklen_t length = sizeof(segment_size);
+		supported = getsockopt( socket, SOL_UDP, UDP_SEGMENT, &segment_size, &length ) == 0;
+	}
+
+	return supported;
+}
+#endif
+
+bool nu_udp_send_segments( int socket, const void* data, size_t size, size_t segment_size, const struct sockaddr_in* dst )
+{
+	const uint8_t* bytes = (const uint8_t*) data;
+
+	if( segment_size == 0 || segment_size > NU_UDP_MAX_PAYLOAD )
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	#if defined(UDP_SEGMENT)
+	if( !udp_gso_supported( socket ) )
+	{
+		return udp_send_datagrams( socket, bytes, size, segment_size, dst );
+	}
+
+	/* A GSO send is still a single UDP datagram until the kernel splits it,
+	 * so it is limited to 64K and NU_UDP_MAX_SEGMENTS segments. */
+	size_t segments = NU_UDP_MAX_PAYLOAD / segment_size;
+	if( segments > NU_UDP_MAX_SEGMENTS ) segments = NU_UDP_MAX_SEGMENTS;
+
+	size_t chunk  = segments * segment_size;
+	size_t offset = 0;
+
+	while( offset < size )
+	{
+		size_t length = (size - offset < chunk) ? size - offset : chunk;
+
+		if( length <= segment_size )
+		{
+			return udp_send_datagrams( socket, bytes + offset, length, segment_size, dst );
+		}
+
+		union {
+			struct cmsghdr align;
+			uint8_t buffer[ CMSG_SPACE(sizeof(uint16_t)) ];
+		} control;
+		struct iovec iov = { .iov_base = (void*) (bytes + offset), .iov_len = length };
+		struct msghdr message;
+
+		memset( &message, 0, sizeof(message) );
+		memset( &control, 0, sizeof(control) );
+		message.msg_name       = (void*) dst;
+		message.msg_namelen    = dst ? sizeof(*dst) : 0;
+		message.msg_iov        = &iov;
+		message.msg_iovlen     = 1;
+		message.msg_control    = control.buffer;
+		message.msg_controllen = sizeof(control.buffer);
+
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR( &message );
+		uint16_t gso_size    = (uint16_t) segment_size;
+		cmsg->cmsg_level     = SOL_UDP;
+		cmsg->cmsg_type      = UDP_SEGMENT;
+		cmsg->cmsg_len       = CMSG_LEN(sizeof(gso_size));
+		memcpy( CMSG_DATA(cmsg), &gso_size, sizeof(gso_size) );
+
+		if( sendmsg( socket, &message, 0 ) < 0 )
+		{
+			if( errno == EINTR ) continue;
+
+			if( errno == EIO )
+			{
+				/* The device cannot checksum the segments for us. */
+				return udp_send_datagrams( socket, bytes + offset, size - offset, segment_size, dst );
+			}
+
+			trace( "Unable to send segmented datagram [errno = %d].\n", errno );
+			return false;
+		}
+
+		offset += length;
+	}
+
+	return true;
+	#else
+	return udp_send_datagrams( socket, bytes, size, segment_size, dst );
+	#endif
+}
+
+bool nu_udp_set_gro( int socket, bool enable )
+{
+	#if defined(UDP_GRO)
+	const int on = enable;
+	return setsockopt( socket, SOL_UDP, UDP_GRO, &on, sizeof(on) ) == 0;
+	#else
+	errno = ENOPROTOOPT;
+	return !enable;
+	#endif
+}
+
+int nu_udp_recv_segments( int socket, void* buffer, size_t size, int flags, struct sockaddr_in* p_from, struct iovec segments[], size_t max_segments )
+{
+	union {
+		struct cmsghdr align;
+		uint8_t buffer[ CMSG_SPACE(sizeof(int)) ];
+	} control;
+	struct sockaddr_in from;
+	struct iovec iov = { .iov_base = buffer, .iov_len = size };
+	struct msghdr message;
+	ssize_t length;
+
+	memset( &message, 0, sizeof(message) );
+	message.msg_name       = &from;
+	message.msg_namelen    = sizeof(from);
+	message.msg_iov        = &iov;
+	message.msg_iovlen     = 1;
+	message.msg_control    = control.buffer;
+	message.msg_controllen = sizeof(control.buffer);
+
+	do
+	{
+		length = recvmsg( socket, &message, flags );
+	} while( length < 0 && errno == EINTR );
+
+	if( length < 0 )
+	{
+		if( errno != EAGAIN && errno != EWOULDBLOCK )
+		{
+			trace( "Unable to receive datagram [errno = %d].\n", errno );
+		}
+		return -1;
+	}
+
+	/* Without a UDP_GRO control message this is a single datagram. */
+	size_t segment_size = (size_t) length;
+
+	#if defined(UDP_GRO)
+	for( struct cmsghdr* cmsg = CMSG_FIRSTHDR( &message ); cmsg; cmsg = CMSG_NXTHDR( &message, cmsg ) )
+	{
+		if( cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO )
+		{
+			int gso_size;
+			memcpy( &gso_size, CMSG_DATA(cmsg), sizeof(gso_size) );
+			if( gso_size > 0 ) segment_size = (size_t) gso_size;
+		}
+	}
+	#endif
+
+	if( p_from )
+	{
+		*p_from = from;
+	}
+
+	if( length == 0 )
+	{
+		if( max_segments == 0 ) return 0;
+		segments[ 0 ].iov_base = buffer;
+		segments[ 0 ].iov_len  = 0;
+		return 1;
+	}
+
+	size_t count  = 0;
+	size_t offset = 0;
+
+	for( ; offset < (size_t) length && count < max_segments; offset += segment_size, count++ )
+	{
+		segments[ count ].iov_base = (uint8_t*) buffer + offset;
+		segments[ count ].iov_len  = ((size_t) length - offset < segment_size) ? (size_t) length - offset : segment_size;
+	}
+
+	if( offset < (size_t) length )
+	{
+		trace( "Dropped %zu bytes of coalesced datagrams.\n", (size_t) length - offset );
+	}
+
+	return (int) count;
+}
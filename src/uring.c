@@ -0,0 +1,728 @@
+/* Copyright (C) 2013 by Joseph A. Marrero, https://joemarrero.com/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "libnu-config.h"
+#if defined(HAVE_LINUX_IO_URING_H)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#include "netutils.h"
+#include "netutils-internal.h"
+
+/*
+ * io_uring, driven through the raw system calls so there is no dependency on
+ * liburing.  Multishot receive needs the provided buffer rings of Linux 5.19
+ * and IORING_RECV_MULTISHOT of 6.0; builds against older headers leave the
+ * backend out entirely.
+ */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+# define NU_URING 1
+#endif
+
+#if defined(NU_URING)
+#define NU_URING_BUFFER_GROUP  0
+#define NU_URING_OP_NONE       UINT32_MAX
+
+/*
+ * Every queued operation owns a slot until its last completion; the slot
+ * keeps the caller's user_data and whatever the kernel may still read
+ * (a sendmsg() header and its control message, for example).
+ */
+typedef struct uring_op {
+	uint64_t user_data;
+	uint32_t next;      /* free list */
+	struct msghdr message;
+	struct iovec iov;
+	struct sockaddr_in address;
+	union {
+		struct cmsghdr align;
+		uint8_t buffer[ CMSG_SPACE(sizeof(int)) ];
+	} control;
+} uring_op_t;
+
+struct uring {
+	int fd;
+	unsigned features;
+
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned  sq_mask;
+	unsigned  sq_entries;
+	unsigned* sq_array;
+	unsigned  sq_local_tail;   /* queued but not yet published */
+	unsigned  sq_submitted;    /* published to the kernel */
+	struct io_uring_sqe* sqes;
+
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned  cq_mask;
+	struct io_uring_cqe* cqes;
+
+	void*  sq_ring;
+	size_t sq_ring_size;
+	void*  cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+
+	uring_op_t* ops;
+	uint32_t free_ops;
+
+	int* files;
+	unsigned file_count;
+	struct iovec* buffers;
+	unsigned buffer_count;
+
+	struct io_uring_buf_ring* buffer_ring;
+	size_t buffer_ring_size;
+	uint8_t* buffer_memory;
+	unsigned provided_count;
+	size_t provided_size;
+	struct msghdr recv_message;   /* shape of multishot recvmsg() output */
+};
+
+static inline int uring_setup( unsigned entries, struct io_uring_params* params )
+{
+	return (int) syscall( __NR_io_uring_setup, entries, params );
+}
+
+static inline int uring_enter( int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void* arg, size_t arg_size )
+{
+	return (int) syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size );
+}
+
+static inline int uring_register( int fd, unsigned opcode, const void* arg, unsigned count )
+{
+	return (int) syscall( __NR_io_uring_register, fd, opcode, arg, count );
+}
+#endif
+
+uring_t* nu_uring_create( unsigned entries )
+{
+	#if defined(NU_URING)
+	struct io_uring_params params;
+	memset( &params, 0, sizeof(params) );
+	params.flags = IORING_SETUP_CLAMP;
+
+	int fd = uring_setup( entries ? entries : 1, &params );
+
+	if( fd < 0 )
+	{
+		trace( "Unable to create io_uring [errno = %d].\n", errno );
+		return NULL;
+	}
+
+	uring_t* ring = (uring_t*) calloc( 1, sizeof(uring_t) );
+
+	if( !ring )
+	{
+		close( fd );
+		return NULL;
+	}
+
+	ring->fd           = fd;
+	ring->features     = params.features;
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if( params.features & IORING_FEAT_SINGLE_MMAP )
+	{
+		if( ring->cq_ring_size > ring->sq_ring_size ) ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap( NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+	ring->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring->sq_ring :
+	                mmap( NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+	ring->sqes    = (struct io_uring_sqe*) mmap( NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+
+	if( ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED )
+	{
+		if( ring->sq_ring == MAP_FAILED ) ring->sq_ring = NULL;
+		if( ring->cq_ring == MAP_FAILED ) ring->cq_ring = NULL;
+		if( ring->sqes == MAP_FAILED ) ring->sqes = NULL;
+		goto failed;
+	}
+
+	uint8_t* sq = (uint8_t*) ring->sq_ring;
+	uint8_t* cq = (uint8_t*) ring->cq_ring;
+
+	ring->sq_head    = (unsigned*) (sq + params.sq_off.head);
+	ring->sq_tail    = (unsigned*) (sq + params.sq_off.tail);
+	ring->sq_mask    = *(unsigned*) (sq + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_array   = (unsigned*) (sq + params.sq_off.array);
+	ring->cq_head    = (unsigned*) (cq + params.cq_off.head);
+	ring->cq_tail    = (unsigned*) (cq + params.cq_off.tail);
+	ring->cq_mask    = *(unsigned*) (cq + params.cq_off.ring_mask);
+	ring->cqes       = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->sq_submitted  = ring->sq_local_tail;
+
+	/* As many operations can be outstanding as there is room for completions. */
+	ring->ops = (uring_op_t*) malloc( params.cq_entries * sizeof(uring_op_t) );
+
+	if( !ring->ops )
+	{
+		goto failed;
+	}
+
+	for( uint32_t i = 0; i < params.cq_entries; i++ )
+	{
+		ring->ops[ i ].next = (i + 1 < params.cq_entries) ? i + 1 : NU_URING_OP_NONE;
+	}
+	ring->free_ops = 0;
+
+	return ring;
+
+failed:
+	nu_uring_destroy( &ring );
+	return NULL;
+	#else
+	return NULL;
+	#endif
+}
+
+void nu_uring_destroy( uring_t** p_ring )
+{
+	#if defined(NU_URING)
+	if( p_ring && *p_ring )
+	{
+		uring_t* ring = *p_ring;
+
+		if( ring->sqes ) munmap( ring->sqes, ring->sqes_size );
+		if( ring->cq_ring && ring->cq_ring != ring->sq_ring ) munmap( ring->cq_ring, ring->cq_ring_size );
+		if( ring->sq_ring ) munmap( ring->sq_ring, ring->sq_ring_size );
+		if( ring->buffer_ring ) munmap( ring->buffer_ring, ring->buffer_ring_size );
+		if( ring->fd >= 0 ) close( ring->fd );
+		free( ring->buffer_memory );
+		free( ring->buffers );
+		free( ring->files );
+		free( ring->ops );
+		free( ring );
+		*p_ring = NULL;
+	}
+	#endif
+}
+
+int nu_uring_fd( const uring_t* ring )
+{
+	#if defined(NU_URING)
+	return ring->fd;
+	#else
+	return -1;
+	#endif
+}
+
+bool nu_uring_register_files( uring_t* ring, const int sockets[], unsigned count )
+{
+	#if defined(NU_URING)
+	int* files = (int*) malloc( count * sizeof(int) );
+
+	if( !files )
+	{
+		return false;
+	}
+
+	if( ring->files )
+	{
+		uring_register( ring->fd, IORING_UNREGISTER_FILES, NULL, 0 );
+	}
+
+	free( ring->files );
+	ring->files      = NULL;
+	ring->file_count = 0;
+
+	if( uring_register( ring->fd, IORING_REGISTER_FILES, sockets, count ) < 0 )
+	{
+		trace( "Unable to register files [errno = %d].\n", errno );
+		free( files );
+		return false;
+	}
+
+	memcpy( files, sockets, count * sizeof(int) );
+	ring->files      = files;
+	ring->file_count = count;
+	return true;
+	#else
+	return false;
+	#endif
+}
+
+bool nu_uring_register_buffers( uring_t* ring, const struct iovec buffers[], unsigned count )
+{
+	#if defined(NU_URING)
+	struct iovec* copy = (struct iovec*) malloc( count * sizeof(struct iovec) );
+
+	if( !copy )
+	{
+		return false;
+	}
+
+	if( ring->buffers )
+	{
+		uring_register( ring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0 );
+	}
+
+	free( ring->buffers );
+	ring->buffers      = NULL;
+	ring->buffer_count = 0;
+
+	/* The pages are pinned once here instead of on every transfer. */
+	if( uring_register( ring->fd, IORING_REGISTER_BUFFERS, buffers, count ) < 0 )
+	{
+		trace( "Unable to register buffers [errno = %d].\n", errno );
+		free( copy );
+		return false;
+	}
+
+	memcpy( copy, buffers, count * sizeof(struct iovec) );
+	ring->buffers      = copy;
+	ring->buffer_count = count;
+	return true;
+	#else
+	return false;
+	#endif
+}
+
+bool nu_uring_provide_buffers( uring_t* ring, unsigned count, size_t size )
+{
+	#if defined(NU_URING)
+	/* The buffer ring needs a power of two entries; a datagram also needs
+	 * room for the recvmsg() header, source address and timestamp. */
+	unsigned entries = 1;
+	while( entries < count ) entries <<= 1;
+
+	if( ring->buffer_ring || entries > 32768 )
+	{
+		return false;
+	}
+
+	size_t overhead = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + NU_TIMESTAMP_CONTROL_SIZE;
+	size_t buffer_size = (overhead + size + 7) & ~((size_t) 7);
+
+	ring->buffer_ring_size = entries * sizeof(struct io_uring_buf);
+	ring->buffer_ring      = (struct io_uring_buf_ring*) mmap( NULL, ring->buffer_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	ring->buffer_memory    = (uint8_t*) malloc( entries * buffer_size );
+
+	if( ring->buffer_ring == MAP_FAILED || !ring->buffer_memory )
+	{
+		goto failed;
+	}
+
+	struct io_uring_buf_reg registration;
+	memset( &registration, 0, sizeof(registration) );
+	registration.ring_addr    = (uint64_t) (uintptr_t) ring->buffer_ring;
+	registration.ring_entries = entries;
+	registration.bgid         = NU_URING_BUFFER_GROUP;
+
+	if( uring_register( ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1 ) < 0 )
+	{
+		trace( "Unable to register buffer ring [errno = %d].\n", errno );
+		goto failed;
+	}
+
+	ring->provided_count = entries;
+	ring->provided_size  = buffer_size;
+
+	for( unsigned i = 0; i < entries; i++ )
+	{
+		struct io_uring_buf* buffer = &ring->buffer_ring->bufs[ i ];
+		buffer->addr = (uint64_t) (uintptr_t) (ring->buffer_memory + i * buffer_size);
+		buffer->len  = (uint32_t) buffer_size;
+		buffer->bid  = (uint16_t) i;
+	}
+	__atomic_store_n( &ring->buffer_ring->tail, (uint16_t) entries, __ATOMIC_RELEASE );
+
+	memset( &ring->recv_message, 0, sizeof(ring->recv_message) );
+	ring->recv_message.msg_namelen    = sizeof(struct sockaddr_in);
+	ring->recv_message.msg_controllen = NU_TIMESTAMP_CONTROL_SIZE;
+	return true;
+
+failed:
+	if( ring->buffer_ring != MAP_FAILED && ring->buffer_ring ) munmap( ring->buffer_ring, ring->buffer_ring_size );
+	free( ring->buffer_memory );
+	ring->buffer_ring   = NULL;
+	ring->buffer_memory = NULL;
+	return false;
+	#else
+	return false;
+	#endif
+}
+
+#if defined(NU_URING)
+static struct io_uring_sqe* uring_prepare( uring_t* ring, int socket, uint8_t opcode, uint64_t user_data, uring_op_t** p_op )
+{
+	unsigned head = __atomic_load_n( ring->sq_head, __ATOMIC_ACQUIRE );
+
+	if( ring->sq_local_tail - head >= ring->sq_entries || ring->free_ops == NU_URING_OP_NONE )
+	{
+		return NULL;
+	}
+
+	uint32_t op_index = ring->free_ops;
+	uring_op_t* op    = &ring->ops[ op_index ];
+	ring->free_ops    = op->next;
+	op->user_data     = user_data;
+
+	unsigned index = ring->sq_local_tail & ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[ index ];
+	ring->sq_array[ index ] = index;
+	ring->sq_local_tail += 1;
+
+	memset( sqe, 0, sizeof(*sqe) );
+	sqe->opcode    = opcode;
+	sqe->fd        = socket;
+	sqe->user_data = op_index;
+
+	for( unsigned i = 0; i < ring->file_count; i++ )
+	{
+		if( ring->files[ i ] == socket )
+		{
+			sqe->fd     = (int) i;
+			sqe->flags |= IOSQE_FIXED_FILE;
+			break;
+		}
+	}
+
+	if( p_op ) *p_op = op;
+	return sqe;
+}
+
+static int uring_registered_buffer( const uring_t* ring, const void* data, size_t size )
+{
+	for( unsigned i = 0; i < ring->buffer_count; i++ )
+	{
+		const uint8_t* base = (const uint8_t*) ring->buffers[ i ].iov_base;
+
+		if( (const uint8_t*) data >= base && (const uint8_t*) data + size <= base + ring->buffers[ i ].iov_len )
+		{
+			return (int) i;
+		}
+	}
+
+	return -1;
+}
+
+static nu_result_t uring_transfer( uring_t* ring, int socket, bool send, void* data, size_t size, uint64_t user_data )
+{
+	int buffer = uring_registered_buffer( ring, data, size );
+	uint8_t opcode;
+
+	if( buffer >= 0 )
+	{
+		opcode = send ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+	}
+	else
+	{
+		opcode = send ? IORING_OP_SEND : IORING_OP_RECV;
+	}
+
+	struct io_uring_sqe* sqe = uring_prepare( ring, socket, opcode, user_data, NULL );
+
+	if( !sqe )
+	{
+		return NU_TRYAGAIN;
+	}
+
+	sqe->addr = (uint64_t) (uintptr_t) data;
+	sqe->len  = (uint32_t) size;
+
+	if( buffer >= 0 )
+	{
+		/* Sockets have no file position.  Fixed reads and writes take no
+		 * message flags: no MSG_WAITALL and no MSG_NOSIGNAL (see netutils.h). */
+		sqe->off       = (uint64_t) -1;
+		sqe->buf_index = (uint16_t) buffer;
+	}
+	else
+	{
+		sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+	}
+
+	return NU_SUCCESS;
+}
+#endif
+
+nu_result_t nu_uring_send_async( uring_t* ring, int socket, const void* data, size_t size, uint64_t user_data )
+{
+	#if defined(NU_URING)
+	return uring_transfer( ring, socket, true, (void*) data, size, user_data );
+	#else
+	return NU_FAILED;
+	#endif
+}
+
+nu_result_t nu_uring_recv_async( uring_t* ring, int socket, void* data, size_t size, uint64_t user_data )
+{
+	#if defined(NU_URING)
+	return uring_transfer( ring, socket, false, data, size, user_data );
+	#else
+	return NU_FAILED;
+	#endif
+}
+
+nu_result_t nu_uring_sendto_async( uring_t* ring, int socket, const void* data, size_t size, const struct sockaddr_in* dst, uint8_t ttl, uint64_t user_data )
+{
+	#if defined(NU_URING)
+	uring_op_t* op;
+	struct io_uring_sqe* sqe = uring_prepare( ring, socket, IORING_OP_SENDMSG, user_data, &op );
+
+	if( !sqe )
+	{
+		return NU_TRYAGAIN;
+	}
+
+	op->iov.iov_base = (void*) data;
+	op->iov.iov_len  = size;
+	op->address      = *dst;
+
+	memset( &op->message, 0, sizeof(op->message) );
+	op->message.msg_name    = &op->address;
+	op->message.msg_namelen = sizeof(op->address);
+	op->message.msg_iov     = &op->iov;
+	op->message.msg_iovlen  = 1;
+
+	if( ttl )
+	{
+		op->message.msg_control    = op->control.buffer;
+		op->message.msg_controllen = sizeof(op->control.buffer);
+
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR( &op->message );
+		int value = ttl;
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type  = IP_TTL;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+		memcpy( CMSG_DATA(cmsg), &value, sizeof(int) );
+	}
+
+	sqe->addr = (uint64_t) (uintptr_t) &op->message;
+	sqe->len  = 1;
+	return NU_SUCCESS;
+	#else
+	return NU_FAILED;
+	#endif
+}
+
+nu_result_t nu_uring_recv_multishot( uring_t* ring, int socket, uint64_t user_data )
+{
+	#if defined(NU_URING)
+	if( !ring->buffer_ring )
+	{
+		return NU_FAILED;
+	}
+
+	struct io_uring_sqe* sqe = uring_prepare( ring, socket, IORING_OP_RECVMSG, user_data, NULL );
+
+	if( !sqe )
+	{
+		return NU_TRYAGAIN;
+	}
+
+	sqe->addr      = (uint64_t) (uintptr_t) &ring->recv_message;
+	sqe->len       = 1;
+	sqe->ioprio    = IORING_RECV_MULTISHOT;
+	sqe->flags    |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = NU_URING_BUFFER_GROUP;
+	return NU_SUCCESS;
+	#else
+	return NU_FAILED;
+	#endif
+}
+
+int nu_uring_submit( uring_t* ring )
+{
+	#if defined(NU_URING)
+	unsigned pending = ring->sq_local_tail - ring->sq_submitted;
+
+	if( pending == 0 )
+	{
+		return 0;
+	}
+
+	__atomic_store_n( ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE );
+
+	int rv;
+	do {
+		rv = uring_enter( ring->fd, pending, 0, 0, NULL, 0 );
+	} while( rv < 0 && errno == EINTR );
+
+	if( rv < 0 )
+	{
+		trace( "Unable to submit to io_uring [errno = %d].\n", errno );
+		return -1;
+	}
+
+	ring->sq_submitted += (unsigned) rv;
+	return rv;
+	#else
+	return -1;
+	#endif
+}
+
+#if defined(NU_URING)
+static size_t uring_reap( uring_t* ring, uring_completion_t completions[], size_t max )
+{
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE );
+	size_t count  = 0;
+
+	while( head != tail && count < max )
+	{
+		const struct io_uring_cqe* cqe = &ring->cqes[ head & ring->cq_mask ];
+		uring_op_t* op = &ring->ops[ cqe->user_data ];
+		uring_completion_t* completion = &completions[ count++ ];
+
+		completion->user_data = op->user_data;
+		completion->result    = cqe->res;
+		completion->buffer    = (cqe->flags & IORING_CQE_F_BUFFER) ? (int32_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+		completion->more      = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+		if( !completion->more )
+		{
+			op->next       = ring->free_ops;
+			ring->free_ops = (uint32_t) cqe->user_data;
+		}
+
+		head += 1;
+	}
+
+	__atomic_store_n( ring->cq_head, head, __ATOMIC_RELEASE );
+	return count;
+}
+#endif
+
+int nu_uring_wait( uring_t* ring, uring_completion_t completions[], size_t max, int timeout )
+{
+	#if defined(NU_URING)
+	if( nu_uring_submit( ring ) < 0 && errno != EBUSY && errno != EAGAIN )
+	{
+		return -1;
+	}
+
+	size_t count = uring_reap( ring, completions, max );
+
+	if( count > 0 || timeout == 0 )
+	{
+		return (int) count;
+	}
+
+	int rv;
+
+	if( timeout > 0 && (ring->features & IORING_FEAT_EXT_ARG) )
+	{
+		struct __kernel_timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000LL };
+		struct io_uring_getevents_arg arg;
+		memset( &arg, 0, sizeof(arg) );
+		arg.ts = (uint64_t) (uintptr_t) &ts;
+
+		rv = uring_enter( ring->fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg) );
+	}
+	else if( timeout > 0 )
+	{
+		/* The ring descriptor is readable while completions are waiting. */
+		struct pollfd fd = { .fd = ring->fd, .events = POLLIN, .revents = 0 };
+		rv = poll( &fd, 1, timeout );
+	}
+	else
+	{
+		rv = uring_enter( ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0 );
+	}
+
+	if( rv < 0 && errno != ETIME && errno != EINTR )
+	{
+		trace( "Unable to wait for io_uring [errno = %d].\n", errno );
+		return -1;
+	}
+
+	return (int) uring_reap( ring, completions, max );
+	#else
+	return -1;
+	#endif
+}
+
+void* nu_uring_buffer( uring_t* ring, const uring_completion_t* completion, size_t* p_length, struct sockaddr_in* p_from, uint64_t* p_timestamp )
+{
+	#if defined(NU_URING)
+	if( completion->buffer < 0 || completion->result < 0 || (unsigned) completion->buffer >= ring->provided_count )
+	{
+		return NULL;
+	}
+
+	uint8_t* buffer = ring->buffer_memory + (size_t) completion->buffer * ring->provided_size;
+	const struct io_uring_recvmsg_out* out = (const struct io_uring_recvmsg_out*) buffer;
+	uint8_t* name    = buffer + sizeof(*out);
+	uint8_t* control = name + ring->recv_message.msg_namelen;
+	uint8_t* payload = control + ring->recv_message.msg_controllen;
+	size_t available = (size_t) completion->result - (size_t) (payload - buffer);
+
+	if( p_length )
+	{
+		*p_length = out->payloadlen < available ? out->payloadlen : available;
+	}
+
+	if( p_from )
+	{
+		memset( p_from, 0, sizeof(*p_from) );
+		memcpy( p_from, name, out->namelen < sizeof(*p_from) ? out->namelen : sizeof(*p_from) );
+	}
+
+	if( p_timestamp )
+	{
+		struct msghdr message;
+		memset( &message, 0, sizeof(message) );
+		message.msg_control    = control;
+		message.msg_controllen = out->controllen;
+		*p_timestamp = out->controllen ? nu_timestamp_from_cmsg( &message ) : 0;
+	}
+
+	return payload;
+	#else
+	return NULL;
+	#endif
+}
+
+void nu_uring_release_buffer( uring_t* ring, const uring_completion_t* completion )
+{
+	#if defined(NU_URING)
+	if( completion->buffer < 0 || !ring->buffer_ring )
+	{
+		return;
+	}
+
+	uint16_t tail = ring->buffer_ring->tail;
+	struct io_uring_buf* buffer = &ring->buffer_ring->bufs[ tail & (ring->provided_count - 1) ];
+
+	buffer->addr = (uint64_t) (uintptr_t) (ring->buffer_memory + (size_t) completion->buffer * ring->provided_size);
+	buffer->len  = (uint32_t) ring->provided_size;
+	buffer->bid  = (uint16_t) completion->buffer;
+	__atomic_store_n( &ring->buffer_ring->tail, (uint16_t) (tail + 1), __ATOMIC_RELEASE );
+	#endif
+}